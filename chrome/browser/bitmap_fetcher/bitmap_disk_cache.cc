@@ -0,0 +1,307 @@
+// Copyright 2017 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chrome/browser/bitmap_fetcher/bitmap_disk_cache.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "base/bind.h"
+#include "base/callback.h"
+#include "base/containers/mru_cache.h"
+#include "base/files/file_enumerator.h"
+#include "base/files/file_util.h"
+#include "base/location.h"
+#include "base/logging.h"
+#include "base/pickle.h"
+#include "base/sequenced_task_runner.h"
+#include "base/sha1.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/task_runner_util.h"
+#include "base/time/time.h"
+#include "third_party/skia/include/core/SkBitmap.h"
+#include "ui/gfx/codec/png_codec.h"
+
+namespace {
+
+// Stored images larger than this in either dimension are treated as corrupt.
+const int kMaxDimension = 4096;
+
+// The name of the file holding the image for |key|.
+std::string FileNameForKey(const std::string& key) {
+  std::string hash = base::SHA1HashString(key);
+  return base::HexEncode(hash.data(), hash.size());
+}
+
+bool IsValidFileName(const std::string& name) {
+  std::vector<uint8_t> hash;
+  return name.size() == 2 * base::kSHA1Length &&
+         base::HexStringToBytes(name, &hash);
+}
+
+// Serializes |bitmap| together with |key|, so that hash collisions can be
+// detected when the image is read back, and the time it was stored.
+bool SerializeBitmap(const std::string& key,
+                     const SkBitmap& bitmap,
+                     base::Time store_time,
+                     base::Pickle* pickle) {
+  if (bitmap.colorType() != kN32_SkColorType || bitmap.drawsNothing() ||
+      bitmap.width() > kMaxDimension || bitmap.height() > kMaxDimension) {
+    return false;
+  }
+
+  std::vector<unsigned char> png_data;
+  if (!gfx::PNGCodec::EncodeBGRASkBitmap(
+          bitmap, false /* discard_transparency */, &png_data)) {
+    return false;
+  }
+
+  pickle->WriteString(key);
+  pickle->WriteInt64(store_time.ToInternalValue());
+  pickle->WriteData(reinterpret_cast<const char*>(png_data.data()),
+                    png_data.size());
+  return true;
+}
+
+// Returns nullptr if the data is corrupt, isn't the image for |key|, or was
+// stored at or before |expiry_time|.
+std::unique_ptr<SkBitmap> DeserializeBitmap(const std::string& key,
+                                            const std::string& data,
+                                            base::Time expiry_time) {
+  base::Pickle pickle(data.data(), data.size());
+  base::PickleIterator iter(pickle);
+  std::string stored_key;
+  int64_t store_time = 0;
+  const char* png_data = nullptr;
+  int length = 0;
+  if (!iter.ReadString(&stored_key) || stored_key != key ||
+      !iter.ReadInt64(&store_time) || !iter.ReadData(&png_data, &length)) {
+    return nullptr;
+  }
+
+  if (base::Time::FromInternalValue(store_time) <= expiry_time)
+    return nullptr;
+
+  std::unique_ptr<SkBitmap> bitmap(new SkBitmap);
+  if (!gfx::PNGCodec::Decode(reinterpret_cast<const unsigned char*>(png_data),
+                             length, bitmap.get()) ||
+      bitmap->width() > kMaxDimension || bitmap->height() > kMaxDimension) {
+    return nullptr;
+  }
+  bitmap->setImmutable();
+  return bitmap;
+}
+
+}  // namespace
+
+class BitmapDiskCache::Backend {
+ public:
+  Backend(const base::FilePath& cache_dir,
+          size_t max_bytes,
+          base::TimeDelta max_age);
+  ~Backend();
+
+  std::unique_ptr<SkBitmap> Load(const std::string& key);
+  void Store(const std::string& key, const SkBitmap& bitmap);
+  void Clear();
+
+ private:
+  // Reads the existing files into |index_| on first use.
+  void EnsureInitialized();
+
+  void RemoveFile(const std::string& name);
+
+  // Deletes the least recently used files until the cache holds at most
+  // |max_bytes|.
+  void EvictToSize(size_t max_bytes);
+
+  const base::FilePath cache_dir_;
+  const size_t max_bytes_;
+  const base::TimeDelta max_age_;
+  bool initialized_;
+
+  // The size of each file in the cache, most recently used first.
+  base::MRUCache<std::string, size_t> index_;
+  size_t total_bytes_;
+
+  DISALLOW_COPY_AND_ASSIGN(Backend);
+};
+
+BitmapDiskCache::Backend::Backend(const base::FilePath& cache_dir,
+                                  size_t max_bytes,
+                                  base::TimeDelta max_age)
+    : cache_dir_(cache_dir),
+      max_bytes_(max_bytes),
+      max_age_(max_age),
+      initialized_(false),
+      index_(base::MRUCache<std::string, size_t>::NO_AUTO_EVICT),
+      total_bytes_(0) {}
+
+BitmapDiskCache::Backend::~Backend() {}
+
+std::unique_ptr<SkBitmap> BitmapDiskCache::Backend::Load(
+    const std::string& key) {
+  EnsureInitialized();
+
+  std::string name = FileNameForKey(key);
+  if (index_.Get(name) == index_.end())
+    return nullptr;
+
+  // Expired images are deleted like corrupt ones.
+  base::FilePath path = cache_dir_.AppendASCII(name);
+  base::Time now = base::Time::Now();
+  std::string data;
+  std::unique_ptr<SkBitmap> bitmap;
+  if (base::ReadFileToString(path, &data))
+    bitmap = DeserializeBitmap(key, data, now - max_age_);
+  if (!bitmap) {
+    RemoveFile(name);
+    return nullptr;
+  }
+
+  // Keep the order of use across restarts.
+  base::TouchFile(path, now, now);
+  return bitmap;
+}
+
+void BitmapDiskCache::Backend::Store(const std::string& key,
+                                     const SkBitmap& bitmap) {
+  EnsureInitialized();
+
+  base::Pickle pickle;
+  if (!SerializeBitmap(key, bitmap, base::Time::Now(), &pickle) ||
+      pickle.size() > max_bytes_) {
+    return;
+  }
+
+  std::string name = FileNameForKey(key);
+  RemoveFile(name);
+  EvictToSize(max_bytes_ - pickle.size());
+
+  // The image is written to a temporary file which is then renamed, so that
+  // readers never see a partial file. The cache can be rebuilt at any time,
+  // so the write isn't flushed to disk.
+  base::FilePath temp_path;
+  if (!base::CreateTemporaryFileInDir(cache_dir_, &temp_path))
+    return;
+  int size = static_cast<int>(pickle.size());
+  if (base::WriteFile(temp_path, static_cast<const char*>(pickle.data()),
+                      size) != size ||
+      !base::Move(temp_path, cache_dir_.AppendASCII(name))) {
+    base::DeleteFile(temp_path, false /* recursive */);
+    return;
+  }
+
+  index_.Put(name, pickle.size());
+  total_bytes_ += pickle.size();
+}
+
+void BitmapDiskCache::Backend::Clear() {
+  base::DeleteFile(cache_dir_, true /* recursive */);
+  index_.Clear();
+  total_bytes_ = 0;
+
+  // The directory is created again by the next use.
+  initialized_ = false;
+}
+
+void BitmapDiskCache::Backend::EnsureInitialized() {
+  if (initialized_)
+    return;
+  initialized_ = true;
+
+  if (!base::CreateDirectory(cache_dir_))
+    return;
+
+  // Add the files to the index in the order they were last used.
+  std::vector<std::tuple<base::Time, std::string, size_t>> files;
+  base::FileEnumerator enumerator(cache_dir_, false /* recursive */,
+                                  base::FileEnumerator::FILES);
+  for (base::FilePath path = enumerator.Next(); !path.empty();
+       path = enumerator.Next()) {
+    base::FileEnumerator::FileInfo info = enumerator.GetInfo();
+    std::string name = path.BaseName().MaybeAsASCII();
+    if (!IsValidFileName(name)) {
+      // Leftovers of interrupted writes.
+      base::DeleteFile(path, false /* recursive */);
+      continue;
+    }
+    files.push_back(std::make_tuple(info.GetLastModifiedTime(), name,
+                                    static_cast<size_t>(info.GetSize())));
+  }
+  std::sort(files.begin(), files.end());
+
+  for (const auto& file : files) {
+    index_.Put(std::get<1>(file), std::get<2>(file));
+    total_bytes_ += std::get<2>(file);
+  }
+
+  // The budget may have been lowered since the files were written.
+  EvictToSize(max_bytes_);
+}
+
+void BitmapDiskCache::Backend::RemoveFile(const std::string& name) {
+  auto iter = index_.Peek(name);
+  if (iter == index_.end())
+    return;
+
+  base::DeleteFile(cache_dir_.AppendASCII(name), false /* recursive */);
+  total_bytes_ -= iter->second;
+  index_.Erase(iter);
+}
+
+void BitmapDiskCache::Backend::EvictToSize(size_t max_bytes) {
+  while (total_bytes_ > max_bytes) {
+    auto oldest = index_.rbegin();
+    base::DeleteFile(cache_dir_.AppendASCII(oldest->first),
+                     false /* recursive */);
+    total_bytes_ -= oldest->second;
+    index_.Erase(oldest);
+  }
+}
+
+BitmapDiskCache::BitmapDiskCache(
+    const base::FilePath& cache_dir,
+    size_t max_bytes,
+    base::TimeDelta max_age,
+    const scoped_refptr<base::SequencedTaskRunner>& task_runner)
+    : task_runner_(task_runner),
+      backend_(new Backend(cache_dir, max_bytes, max_age)),
+      weak_ptr_factory_(this) {}
+
+BitmapDiskCache::~BitmapDiskCache() {
+  task_runner_->DeleteSoon(FROM_HERE, backend_.release());
+}
+
+void BitmapDiskCache::Load(const std::string& key,
+                           const LoadCallback& callback) {
+  base::PostTaskAndReplyWithResult(
+      task_runner_.get(), FROM_HERE,
+      base::Bind(&Backend::Load, base::Unretained(backend_.get()), key),
+      base::Bind(&BitmapDiskCache::DidLoad, weak_ptr_factory_.GetWeakPtr(),
+                 callback));
+}
+
+void BitmapDiskCache::Store(const std::string& key, const SkBitmap& bitmap) {
+  // The backend is deleted on |task_runner_|, after this task has run.
+  task_runner_->PostTask(FROM_HERE,
+                         base::Bind(&Backend::Store,
+                                    base::Unretained(backend_.get()), key,
+                                    bitmap));
+}
+
+void BitmapDiskCache::Clear() {
+  task_runner_->PostTask(
+      FROM_HERE,
+      base::Bind(&Backend::Clear, base::Unretained(backend_.get())));
+}
+
+void BitmapDiskCache::DidLoad(const LoadCallback& callback,
+                              std::unique_ptr<SkBitmap> bitmap) {
+  callback.Run(bitmap ? *bitmap : SkBitmap());
+}
@@ -0,0 +1,70 @@
+// Copyright 2017 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROME_BROWSER_BITMAP_FETCHER_BITMAP_DISK_CACHE_H_
+#define CHROME_BROWSER_BITMAP_FETCHER_BITMAP_DISK_CACHE_H_
+
+#include <stddef.h>
+
+#include <memory>
+#include <string>
+
+#include "base/callback_forward.h"
+#include "base/files/file_path.h"
+#include "base/macros.h"
+#include "base/memory/ref_counted.h"
+#include "base/memory/weak_ptr.h"
+#include "base/time/time.h"
+
+namespace base {
+class SequencedTaskRunner;
+}  // namespace base
+
+class SkBitmap;
+
+// Stores fetched images on disk, so that they can be shown again without
+// fetching them. Each image is kept PNG encoded in its own file, along with the
+// time it was stored. Images older than |max_age| are not used. When the files
+// take more than the byte budget, the least recently used images are deleted.
+//
+// All disk access happens on |task_runner|. The cache must be used on a single
+// sequence, and callbacks are run on that sequence.
+class BitmapDiskCache {
+ public:
+  // Called with the stored image, or an empty bitmap if there was none.
+  using LoadCallback = base::Callback<void(const SkBitmap& bitmap)>;
+
+  BitmapDiskCache(const base::FilePath& cache_dir,
+                  size_t max_bytes,
+                  base::TimeDelta max_age,
+                  const scoped_refptr<base::SequencedTaskRunner>& task_runner);
+  ~BitmapDiskCache();
+
+  // Reads the image stored for |key|.
+  void Load(const std::string& key, const LoadCallback& callback);
+
+  // Stores |bitmap| for |key|, replacing any previous image. Only N32 bitmaps
+  // are stored.
+  void Store(const std::string& key, const SkBitmap& bitmap);
+
+  // Deletes all of the stored images.
+  void Clear();
+
+ private:
+  // Keeps track of the files in the cache. Lives on |task_runner_|.
+  class Backend;
+
+  void DidLoad(const LoadCallback& callback, std::unique_ptr<SkBitmap> bitmap);
+
+  scoped_refptr<base::SequencedTaskRunner> task_runner_;
+
+  // Deleted on |task_runner_|, after any pending disk access has finished.
+  std::unique_ptr<Backend> backend_;
+
+  base::WeakPtrFactory<BitmapDiskCache> weak_ptr_factory_;
+
+  DISALLOW_COPY_AND_ASSIGN(BitmapDiskCache);
+};
+
+#endif  // CHROME_BROWSER_BITMAP_FETCHER_BITMAP_DISK_CACHE_H_
@@ -0,0 +1,171 @@
+// Copyright 2017 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chrome/browser/bitmap_fetcher/bitmap_disk_cache.h"
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+#include "base/bind.h"
+#include "base/files/file_enumerator.h"
+#include "base/files/file_util.h"
+#include "base/files/scoped_temp_dir.h"
+#include "base/macros.h"
+#include "base/memory/ptr_util.h"
+#include "base/run_loop.h"
+#include "base/threading/thread_task_runner_handle.h"
+#include "content/public/test/test_browser_thread_bundle.h"
+#include "testing/gtest/include/gtest/gtest.h"
+#include "third_party/skia/include/core/SkBitmap.h"
+
+namespace {
+
+// Large enough for any number of test images.
+const size_t kMaxBytes = 1024 * 1024;
+
+SkBitmap CreateBitmap(SkColor color) {
+  SkBitmap bitmap;
+  bitmap.allocN32Pixels(4, 4);
+  bitmap.eraseColor(color);
+  return bitmap;
+}
+
+}  // namespace
+
+class BitmapDiskCacheTest : public testing::Test {
+ public:
+  BitmapDiskCacheTest() {}
+  ~BitmapDiskCacheTest() override {}
+
+  void SetUp() override {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    CreateCache();
+  }
+
+  void CreateCache(size_t max_bytes = kMaxBytes,
+                   base::TimeDelta max_age = base::TimeDelta::FromHours(1)) {
+    cache_ = base::MakeUnique<BitmapDiskCache>(
+        temp_dir_.GetPath(), max_bytes, max_age,
+        base::ThreadTaskRunnerHandle::Get());
+  }
+
+  void Clear() {
+    cache_->Clear();
+    base::RunLoop().RunUntilIdle();
+  }
+
+  void DidLoad(base::Closure quit_closure, const SkBitmap& bitmap) {
+    loaded_bitmap_ = bitmap;
+    quit_closure.Run();
+  }
+
+  SkBitmap Load(const std::string& key) {
+    base::RunLoop run_loop;
+    cache_->Load(key, base::Bind(&BitmapDiskCacheTest::DidLoad,
+                                 base::Unretained(this),
+                                 run_loop.QuitClosure()));
+    run_loop.Run();
+    return loaded_bitmap_;
+  }
+
+  void Store(const std::string& key, const SkBitmap& bitmap) {
+    cache_->Store(key, bitmap);
+    base::RunLoop().RunUntilIdle();
+  }
+
+  // The total size of the stored files.
+  int64_t GetCacheSize() {
+    return base::ComputeDirectorySize(temp_dir_.GetPath());
+  }
+
+  int CountFiles() {
+    int count = 0;
+    base::FileEnumerator enumerator(temp_dir_.GetPath(), false,
+                                    base::FileEnumerator::FILES);
+    while (!enumerator.Next().empty())
+      ++count;
+    return count;
+  }
+
+ protected:
+  base::ScopedTempDir temp_dir_;
+
+ private:
+  content::TestBrowserThreadBundle thread_bundle_;
+  std::unique_ptr<BitmapDiskCache> cache_;
+  SkBitmap loaded_bitmap_;
+
+  DISALLOW_COPY_AND_ASSIGN(BitmapDiskCacheTest);
+};
+
+TEST_F(BitmapDiskCacheTest, StoreAndLoad) {
+  EXPECT_TRUE(Load("a").isNull());
+
+  Store("a", CreateBitmap(SK_ColorGREEN));
+  SkBitmap bitmap = Load("a");
+  ASSERT_FALSE(bitmap.isNull());
+  EXPECT_EQ(4, bitmap.width());
+  EXPECT_EQ(4, bitmap.height());
+  EXPECT_EQ(SK_ColorGREEN, bitmap.getColor(3, 3));
+
+  // The image survives the cache being recreated.
+  CreateCache();
+  EXPECT_EQ(SK_ColorGREEN, Load("a").getColor(0, 0));
+  EXPECT_TRUE(Load("b").isNull());
+}
+
+TEST_F(BitmapDiskCacheTest, EvictsLeastRecentlyUsed) {
+  // Limit the cache to about three images of the size of the first one.
+  Store("a", CreateBitmap(SK_ColorRED));
+  CreateCache(GetCacheSize() * 7 / 2);
+  Store("b", CreateBitmap(SK_ColorGREEN));
+  Store("c", CreateBitmap(SK_ColorBLUE));
+  EXPECT_EQ(3, CountFiles());
+
+  // Using "a" makes "b" the least recently used image.
+  EXPECT_FALSE(Load("a").isNull());
+  Store("d", CreateBitmap(SK_ColorWHITE));
+  EXPECT_EQ(3, CountFiles());
+  EXPECT_TRUE(Load("b").isNull());
+  EXPECT_FALSE(Load("a").isNull());
+  EXPECT_FALSE(Load("d").isNull());
+}
+
+TEST_F(BitmapDiskCacheTest, CorruptFilesAreDeleted) {
+  Store("a", CreateBitmap(SK_ColorGREEN));
+  ASSERT_EQ(1, CountFiles());
+
+  base::FileEnumerator enumerator(temp_dir_.GetPath(), false,
+                                  base::FileEnumerator::FILES);
+  ASSERT_EQ(4, base::WriteFile(enumerator.Next(), "junk", 4));
+
+  EXPECT_TRUE(Load("a").isNull());
+  EXPECT_EQ(0, CountFiles());
+}
+
+TEST_F(BitmapDiskCacheTest, ExpiredImagesAreDeleted) {
+  Store("a", CreateBitmap(SK_ColorGREEN));
+  ASSERT_EQ(1, CountFiles());
+
+  // Images older than the maximum age are never returned.
+  CreateCache(kMaxBytes, base::TimeDelta());
+  EXPECT_TRUE(Load("a").isNull());
+  EXPECT_EQ(0, CountFiles());
+}
+
+TEST_F(BitmapDiskCacheTest, Clear) {
+  Store("a", CreateBitmap(SK_ColorRED));
+  Store("b", CreateBitmap(SK_ColorGREEN));
+  ASSERT_EQ(2, CountFiles());
+
+  Clear();
+  EXPECT_EQ(0, CountFiles());
+  EXPECT_TRUE(Load("a").isNull());
+
+  // The cache can still be used afterwards.
+  Store("c", CreateBitmap(SK_ColorBLUE));
+  EXPECT_EQ(SK_ColorBLUE, Load("c").getColor(0, 0));
+}
@@ -4,18 +4,32 @@
 
 #include "chrome/browser/bitmap_fetcher/bitmap_fetcher.h"
 
+#include <stdint.h>
+
+#include <vector>
+
 #include "content/public/browser/browser_thread.h"
 #include "net/url_request/url_fetcher.h"
 #include "net/url_request/url_request_context_getter.h"
 #include "net/url_request/url_request_status.h"
 
+namespace {
+
+// Decoded images take four bytes per pixel.
+const int64_t kBytesPerPixel = 4;
+
+}  // namespace
+
 namespace chrome {
 
 BitmapFetcher::BitmapFetcher(
     const GURL& url,
     BitmapFetcherDelegate* delegate,
     const net::NetworkTrafficAnnotationTag& traffic_annotation)
-    : url_(url), delegate_(delegate), traffic_annotation_(traffic_annotation) {}
+    : url_(url),
+      delegate_(delegate),
+      traffic_annotation_(traffic_annotation),
+      decode_started_(false) {}
 
 BitmapFetcher::~BitmapFetcher() {
 }
@@ -51,9 +65,29 @@ void BitmapFetcher::OnURLFetchComplete(const net::URLFetcher* source) {
   std::string image_data;
   source->GetResponseAsString(&image_data);
 
+  // The image is decoded for the size wanted now. Later changes to the
+  // desired size can't be taken into account anymore.
+  decoded_size_ = desired_size_;
+  decode_started_ = true;
+  DecodeImage(image_data);
+}
+
+void BitmapFetcher::DecodeImage(const std::string& image_data) {
   // Call start to begin decoding.  The ImageDecoder will call OnImageDecoded
   // with the data when it is done.
-  ImageDecoder::Start(this, image_data);
+  if (decoded_size_.IsEmpty()) {
+    ImageDecoder::Start(this, image_data);
+    return;
+  }
+
+  // The decoder halves the image until it fits in the byte limit. Allowing
+  // four times the pixels of the desired size keeps the image at least as
+  // large as it is displayed.
+  int64_t max_size_in_bytes = 4 * kBytesPerPixel * decoded_size_.GetArea();
+  ImageDecoder::StartWithOptions(
+      this, std::vector<uint8_t>(image_data.begin(), image_data.end()),
+      ImageDecoder::DEFAULT_CODEC, true /* shrink_to_fit */, decoded_size_,
+      max_size_in_bytes);
 }
 
 // Methods inherited from ImageDecoder::ImageRequest.
@@ -6,6 +6,7 @@
 #define CHROME_BROWSER_BITMAP_FETCHER_BITMAP_FETCHER_H_
 
 #include <memory>
+#include <string>
 
 #include "base/macros.h"
 #include "chrome/browser/bitmap_fetcher/bitmap_fetcher_delegate.h"
@@ -13,6 +14,7 @@
 #include "net/traffic_annotation/network_traffic_annotation.h"
 #include "net/url_request/url_fetcher_delegate.h"
 #include "net/url_request/url_request.h"
+#include "ui/gfx/geometry/size.h"
 #include "url/gurl.h"
 
 class SkBitmap;
@@ -37,6 +39,21 @@ class BitmapFetcher : public net::URLFetcherDelegate,
   const GURL& url() const { return url_; }
   net::URLFetcher* url_fetcher() { return url_fetcher_.get(); }
 
+  // The size the image will be displayed at. Large images are shrunk while
+  // they are decoded, so that they take little more memory than needed at this
+  // size. An empty size, the default, keeps the full resolution. Changes made
+  // after the download has completed don't affect the image.
+  const gfx::Size& desired_size() const { return desired_size_; }
+  void set_desired_size(const gfx::Size& desired_size) {
+    desired_size_ = desired_size;
+  }
+
+  // The size the image is decoded for. This is the desired size at the time
+  // the download completed, or the current desired size until then.
+  const gfx::Size& decoded_size() const {
+    return decode_started_ ? decoded_size_ : desired_size_;
+  }
+
   // Initializes internal fetcher.  After this function returns url_fetcher()
   // can be accessed to configure it further (eg. add user data to request).
   // All configuration must be done before Start() is called.
@@ -70,6 +87,11 @@ class BitmapFetcher : public net::URLFetcherDelegate,
   // Called when decoding image failed.
   void OnDecodeImageFailed() override;
 
+ protected:
+  // Starts decoding the downloaded |image_data| for decoded_size(). Virtual
+  // so tests can side-step the decode, which requires a utility process.
+  virtual void DecodeImage(const std::string& image_data);
+
  private:
   // Alerts the delegate that a failure occurred.
   void ReportFailure();
@@ -78,6 +100,9 @@ class BitmapFetcher : public net::URLFetcherDelegate,
   const GURL url_;
   BitmapFetcherDelegate* const delegate_;
   const net::NetworkTrafficAnnotationTag traffic_annotation_;
+  gfx::Size desired_size_;
+  gfx::Size decoded_size_;
+  bool decode_started_;
 
   DISALLOW_COPY_AND_ASSIGN(BitmapFetcher);
 };
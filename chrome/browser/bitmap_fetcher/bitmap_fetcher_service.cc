@@ -5,31 +5,122 @@
 #include "chrome/browser/bitmap_fetcher/bitmap_fetcher_service.h"
 
 #include <stddef.h>
+#include <algorithm>
+#include <deque>
+#include <iterator>
 #include <utility>
+#include <vector>
 
+#include "base/bind.h"
+#include "base/feature_list.h"
+#include "base/files/file_util.h"
 #include "base/macros.h"
 #include "base/memory/weak_ptr.h"
+#include "base/metrics/field_trial_params.h"
+#include "base/sequenced_task_runner.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/threading/sequenced_worker_pool.h"
+#include "base/time/default_tick_clock.h"
+#include "chrome/browser/bitmap_fetcher/bitmap_disk_cache.h"
 #include "chrome/browser/bitmap_fetcher/bitmap_fetcher.h"
+#include "chrome/browser/browsing_data/browsing_data_remover_factory.h"
 #include "chrome/browser/profiles/profile.h"
+#include "content/public/browser/browser_context.h"
+#include "content/public/browser/browser_thread.h"
 #include "content/public/browser/storage_partition.h"
 #include "net/base/load_flags.h"
 #include "third_party/skia/include/core/SkBitmap.h"
+#include "ui/gfx/geometry/size.h"
 
 namespace {
 
 const size_t kMaxRequests = 25;  // Maximum number of inflight requests allowed.
-const int kMaxCacheEntries = 5;  // Maximum number of cache entries.
+
+// Maximum number of requests waiting for an inflight request to finish.
+const size_t kMaxQueuedRequests = 100;
+
+// Maximum number of images downloaded at once for prefetch batches, so that
+// batches leave bandwidth for the images being displayed.
+const size_t kMaxBatchPrefetches = 4;
+
+// Tunes the decoded image cache with the max_bytes and ttl_seconds
+// parameters.
+const base::Feature kBitmapFetcherCacheFeature{
+    "BitmapFetcherCache", base::FEATURE_ENABLED_BY_DEFAULT};
+const char kMaxCacheBytesParam[] = "max_bytes";
+const char kCacheTtlSecondsParam[] = "ttl_seconds";
+
+const int kDefaultMaxCacheBytes = 4 * 1024 * 1024;
+const int kDefaultCacheTtlSeconds = 60 * 60;
+
+// Keeps decoded images on disk across restarts. The size of the disk cache can
+// be changed with the max_bytes parameter.
+const base::Feature kBitmapFetcherDiskCacheFeature{
+    "BitmapFetcherDiskCache", base::FEATURE_DISABLED_BY_DEFAULT};
+const int kDefaultMaxDiskCacheBytes = 20 * 1024 * 1024;
+
+const base::FilePath::CharType kDiskCacheDirname[] =
+    FILE_PATH_LITERAL("BitmapFetcherCache");
+
+// The size bucket of images kept at their full resolution.
+const int kFullSizeBucket = 0;
+
+// Images displayed larger than this are shrunk to this size.
+const int kMaxSizeBucket = 1 << 14;
+
+// Rounds the larger dimension of |desired_size| up to a power of two, so that
+// requests for similar sizes share the same image.
+int GetSizeBucket(const gfx::Size& desired_size) {
+  if (desired_size.IsEmpty())
+    return kFullSizeBucket;
+  int max_dimension = std::max(desired_size.width(), desired_size.height());
+  int bucket = 1;
+  while (bucket < max_dimension && bucket < kMaxSizeBucket)
+    bucket *= 2;
+  return bucket;
+}
+
+// Returns the bucket which serves both |a| and |b|.
+int MergeSizeBuckets(int a, int b) {
+  if (a == kFullSizeBucket || b == kFullSizeBucket)
+    return kFullSizeBucket;
+  return std::max(a, b);
+}
+
+gfx::Size GetDesiredSize(int size_bucket) {
+  return gfx::Size(size_bucket, size_bucket);
+}
+
+// Full size images are keyed by their URL alone. The space can't be part of a
+// valid URL.
+std::string GetCacheKey(const GURL& url, int size_bucket) {
+  if (size_bucket == kFullSizeBucket)
+    return url.spec();
+  return url.spec() + " " + base::IntToString(size_bucket);
+}
 
 }  // namespace.
 
 class BitmapFetcherRequest {
  public:
-  BitmapFetcherRequest(BitmapFetcherService::RequestId request_id,
-                       BitmapFetcherService::Observer* observer);
+  BitmapFetcherRequest(
+      BitmapFetcherService::RequestId request_id,
+      BitmapFetcherService::Observer* observer,
+      const GURL& url,
+      int size_bucket,
+      BitmapFetcherService::RequestPriority priority,
+      const net::NetworkTrafficAnnotationTag& traffic_annotation);
   ~BitmapFetcherRequest();
 
   void NotifyImageChanged(const SkBitmap* bitmap);
   BitmapFetcherService::RequestId request_id() const { return request_id_; }
+  const GURL& url() const { return url_; }
+  int size_bucket() const { return size_bucket_; }
+  const std::string& cache_key() const { return cache_key_; }
+  BitmapFetcherService::RequestPriority priority() const { return priority_; }
+  const net::NetworkTrafficAnnotationTag& traffic_annotation() const {
+    return traffic_annotation_;
+  }
 
   // Weak ptr |fetcher| is used to identify associated fetchers.
   void set_fetcher(const chrome::BitmapFetcher* fetcher) { fetcher_ = fetcher; }
@@ -38,6 +129,11 @@ class BitmapFetcherRequest {
  private:
   const BitmapFetcherService::RequestId request_id_;
   std::unique_ptr<BitmapFetcherService::Observer> observer_;
+  const GURL url_;
+  const int size_bucket_;
+  const std::string cache_key_;
+  const BitmapFetcherService::RequestPriority priority_;
+  const net::NetworkTrafficAnnotationTag traffic_annotation_;
   const chrome::BitmapFetcher* fetcher_;
 
   DISALLOW_COPY_AND_ASSIGN(BitmapFetcherRequest);
@@ -45,8 +141,19 @@ class BitmapFetcherRequest {
 
 BitmapFetcherRequest::BitmapFetcherRequest(
     BitmapFetcherService::RequestId request_id,
-    BitmapFetcherService::Observer* observer)
-    : request_id_(request_id), observer_(observer) {
+    BitmapFetcherService::Observer* observer,
+    const GURL& url,
+    int size_bucket,
+    BitmapFetcherService::RequestPriority priority,
+    const net::NetworkTrafficAnnotationTag& traffic_annotation)
+    : request_id_(request_id),
+      observer_(observer),
+      url_(url),
+      size_bucket_(size_bucket),
+      cache_key_(GetCacheKey(url, size_bucket)),
+      priority_(priority),
+      traffic_annotation_(traffic_annotation),
+      fetcher_(nullptr) {
 }
 
 BitmapFetcherRequest::~BitmapFetcherRequest() {
@@ -57,74 +164,568 @@ void BitmapFetcherRequest::NotifyImageChanged(const SkBitmap* bitmap) {
     observer_->OnImageChanged(request_id_, *bitmap);
 }
 
-BitmapFetcherService::CacheEntry::CacheEntry() {
+BitmapFetcherService::CacheEntry::CacheEntry() : byte_size(0) {
 }
 
 BitmapFetcherService::CacheEntry::~CacheEntry() {
 }
 
+BitmapFetcherService::DiskLookup::DiskLookup(
+    const GURL& url,
+    int size_bucket,
+    const net::NetworkTrafficAnnotationTag& traffic_annotation)
+    : url(url),
+      size_bucket(size_bucket),
+      traffic_annotation(traffic_annotation) {}
+
+BitmapFetcherService::DiskLookup::DiskLookup(DiskLookup&& other) = default;
+
+BitmapFetcherService::DiskLookup::~DiskLookup() {}
+
+BitmapFetcherService::PrefetchBatch::PrefetchBatch(
+    int size_bucket,
+    const net::NetworkTrafficAnnotationTag& traffic_annotation)
+    : size_bucket(size_bucket), traffic_annotation(traffic_annotation) {}
+
+BitmapFetcherService::PrefetchBatch::~PrefetchBatch() {}
+
 BitmapFetcherService::BitmapFetcherService(content::BrowserContext* context)
-    : cache_(kMaxCacheEntries), current_request_id_(1), context_(context) {
+    : current_batch_id_(PREFETCH_BATCH_ID_INVALID),
+      cache_(ImageCache::NO_AUTO_EVICT),
+      cache_bytes_(0),
+      max_cache_bytes_(0),
+      cache_hit_count_(0),
+      cache_miss_count_(0),
+      cache_eviction_count_(0),
+      tick_clock_(new base::DefaultTickClock),
+      current_request_id_(1),
+      context_(context),
+      browsing_data_remover_observer_(this),
+      weak_ptr_factory_(this) {
+  size_t max_cache_bytes = kDefaultMaxCacheBytes;
+  int cache_ttl_seconds = kDefaultCacheTtlSeconds;
+  if (base::FeatureList::IsEnabled(kBitmapFetcherCacheFeature)) {
+    max_cache_bytes = base::GetFieldTrialParamByFeatureAsInt(
+        kBitmapFetcherCacheFeature, kMaxCacheBytesParam, kDefaultMaxCacheBytes);
+    cache_ttl_seconds = base::GetFieldTrialParamByFeatureAsInt(
+        kBitmapFetcherCacheFeature, kCacheTtlSecondsParam,
+        kDefaultCacheTtlSeconds);
+  }
+  SetCacheLimits(max_cache_bytes,
+                 base::TimeDelta::FromSeconds(cache_ttl_seconds));
+
+  base::FilePath disk_cache_dir = context_->GetPath().Append(kDiskCacheDirname);
+  scoped_refptr<base::SequencedTaskRunner> disk_task_runner =
+      content::BrowserThread::GetBlockingPool()
+          ->GetSequencedTaskRunnerWithShutdownBehavior(
+              base::SequencedWorkerPool::GetSequenceToken(),
+              base::SequencedWorkerPool::SKIP_ON_SHUTDOWN);
+  if (base::FeatureList::IsEnabled(kBitmapFetcherDiskCacheFeature)) {
+    disk_cache_.reset(new BitmapDiskCache(
+        disk_cache_dir,
+        base::GetFieldTrialParamByFeatureAsInt(kBitmapFetcherDiskCacheFeature,
+                                               kMaxCacheBytesParam,
+                                               kDefaultMaxDiskCacheBytes),
+        cache_ttl_, disk_task_runner));
+  } else {
+    // Delete the images stored while the disk cache was enabled.
+    disk_task_runner->PostTask(
+        FROM_HERE, base::Bind(base::IgnoreResult(&base::DeleteFile),
+                              disk_cache_dir, true /* recursive */));
+  }
+
+  // Cached images are cleared along with the rest of the cache.
+  browsing_data_remover_observer_.Add(
+      BrowsingDataRemoverFactory::GetForBrowserContext(context_));
 }
 
 BitmapFetcherService::~BitmapFetcherService() {
 }
 
 void BitmapFetcherService::CancelRequest(int request_id) {
-  ScopedVector<BitmapFetcherRequest>::iterator iter;
-  for (iter = requests_.begin(); iter != requests_.end(); ++iter) {
-    if ((*iter)->request_id() == request_id) {
-      requests_.erase(iter);
-      // Deliberately leave the associated fetcher running to populate cache.
-      return;
+  // Requests which are still queued are simply dropped.
+  auto queued = queued_requests_.find(request_id);
+  if (queued != queued_requests_.end()) {
+    request_queue_.erase(
+        std::make_pair(queued->second->priority(), request_id));
+    queued_requests_.erase(queued);
+    return;
+  }
+
+  auto iter = requests_.find(request_id);
+  if (iter == requests_.end())
+    return;
+
+  // Requests without a fetcher are waiting for the disk cache.
+  if (!iter->second->get_fetcher()) {
+    std::vector<RequestId>& disk_request_ids =
+        disk_lookups_.find(iter->second->cache_key())->second.request_ids;
+    disk_request_ids.erase(std::find(disk_request_ids.begin(),
+                                     disk_request_ids.end(), request_id));
+    requests_.erase(iter);
+    StartQueuedRequests();
+    return;
+  }
+
+  auto range = fetcher_requests_.equal_range(iter->second->get_fetcher());
+  for (auto fetcher_iter = range.first; fetcher_iter != range.second;
+       ++fetcher_iter) {
+    if (fetcher_iter->second == request_id) {
+      fetcher_requests_.erase(fetcher_iter);
+      break;
     }
   }
+
+  // Deliberately leave the associated fetcher running to populate cache.
+  requests_.erase(iter);
+
+  // The request's slot can be used by a queued request straight away.
+  StartQueuedRequests();
 }
 
 BitmapFetcherService::RequestId BitmapFetcherService::RequestImage(
     const GURL& url,
     Observer* observer,
     const net::NetworkTrafficAnnotationTag& traffic_annotation) {
+  return RequestImage(url, gfx::Size(), observer, RequestPriority::VISIBLE,
+                      traffic_annotation);
+}
+
+BitmapFetcherService::RequestId BitmapFetcherService::RequestImage(
+    const GURL& url,
+    Observer* observer,
+    RequestPriority priority,
+    const net::NetworkTrafficAnnotationTag& traffic_annotation) {
+  return RequestImage(url, gfx::Size(), observer, priority, traffic_annotation);
+}
+
+BitmapFetcherService::RequestId BitmapFetcherService::RequestImage(
+    const GURL& url,
+    const gfx::Size& desired_size,
+    Observer* observer,
+    RequestPriority priority,
+    const net::NetworkTrafficAnnotationTag& traffic_annotation) {
   // Create a new request, assigning next available request ID.
   ++current_request_id_;
   if (current_request_id_ == REQUEST_ID_INVALID)
     ++current_request_id_;
   int request_id = current_request_id_;
-  std::unique_ptr<BitmapFetcherRequest> request(
-      new BitmapFetcherRequest(request_id, observer));
+  std::unique_ptr<BitmapFetcherRequest> request(new BitmapFetcherRequest(
+      request_id, observer, url, GetSizeBucket(desired_size), priority,
+      traffic_annotation));
 
   // Reject invalid URLs.
   if (!url.is_valid())
     return REQUEST_ID_INVALID;
 
   // Check for existing images first.
-  auto iter = cache_.Get(url);
-  if (iter != cache_.end()) {
-    BitmapFetcherService::CacheEntry* entry = iter->second.get();
-    request->NotifyImageChanged(entry->bitmap.get());
+  const SkBitmap* cached_bitmap = GetCachedBitmap(request->cache_key());
+  if (cached_bitmap) {
+    request->NotifyImageChanged(cached_bitmap);
 
     // There is no request ID associated with this - data is already delivered.
     return REQUEST_ID_INVALID;
   }
 
-  // Limit number of simultaneous in-flight requests.
-  if (requests_.size() > kMaxRequests)
-    return REQUEST_ID_INVALID;
+  // Limit number of simultaneous in-flight requests. Requests beyond the limit
+  // wait until an inflight request finishes.
+  if (requests_.size() > kMaxRequests) {
+    if (!QueueRequest(std::move(request)))
+      return REQUEST_ID_INVALID;
+    return request_id;
+  }
 
-  // Make sure there's a fetcher for this URL and attach to request.
-  const chrome::BitmapFetcher* fetcher =
-      EnsureFetcherForUrl(url, traffic_annotation);
-  request->set_fetcher(fetcher);
+  StartRequest(std::move(request));
+  return request_id;
+}
 
-  requests_.push_back(request.release());
-  return requests_.back()->request_id();
+void BitmapFetcherService::Prefetch(
+    const GURL& url,
+    const net::NetworkTrafficAnnotationTag& traffic_annotation) {
+  Prefetch(url, gfx::Size(), traffic_annotation);
 }
 
 void BitmapFetcherService::Prefetch(
     const GURL& url,
+    const gfx::Size& desired_size,
+    const net::NetworkTrafficAnnotationTag& traffic_annotation) {
+  if (!url.is_valid())
+    return;
+
+  // A batch download of the image must not be stopped with its batch anymore.
+  ShareBatchPrefetch(url);
+
+  int size_bucket = GetSizeBucket(desired_size);
+  if (disk_cache_ && !FindFetcherForUrl(url)) {
+    LookUpOnDisk(url, size_bucket, traffic_annotation);
+    return;
+  }
+  EnsureFetcherForUrl(url, size_bucket, traffic_annotation);
+}
+
+BitmapFetcherService::PrefetchBatchId BitmapFetcherService::PrefetchImages(
+    const std::vector<GURL>& urls,
+    const gfx::Size& desired_size,
+    const net::NetworkTrafficAnnotationTag& traffic_annotation) {
+  std::unique_ptr<PrefetchBatch> batch(
+      new PrefetchBatch(GetSizeBucket(desired_size), traffic_annotation));
+  for (const GURL& url : urls) {
+    if (url.is_valid())
+      batch->pending_urls.push_back(url);
+  }
+  if (batch->pending_urls.empty())
+    return PREFETCH_BATCH_ID_INVALID;
+
+  ++current_batch_id_;
+  if (current_batch_id_ == PREFETCH_BATCH_ID_INVALID)
+    ++current_batch_id_;
+  PrefetchBatchId batch_id = current_batch_id_;
+  prefetch_batches_[batch_id] = std::move(batch);
+
+  StartBatchPrefetches();
+  return batch_id;
+}
+
+void BitmapFetcherService::CancelPrefetchImages(PrefetchBatchId batch_id) {
+  prefetch_batches_.erase(batch_id);
+
+  for (auto iter = batch_prefetches_.begin();
+       iter != batch_prefetches_.end();) {
+    if (iter->second.batch_id != batch_id) {
+      ++iter;
+      continue;
+    }
+
+    // Downloads which other callers asked for are left to finish.
+    if (iter->second.shared) {
+      iter = batch_prefetches_.erase(iter);
+      continue;
+    }
+
+    // Downloads which are still waiting for the disk cache are dropped when
+    // the image isn't found.
+    auto fetcher = active_fetchers_.find(iter->first);
+    if (fetcher == active_fetchers_.end()) {
+      iter->second.batch_id = PREFETCH_BATCH_ID_INVALID;
+      ++iter;
+      continue;
+    }
+
+    // Downloads which requests are waiting for are left to finish.
+    if (fetcher_requests_.count(fetcher->second.get()) == 0)
+      active_fetchers_.erase(fetcher);
+    iter = batch_prefetches_.erase(iter);
+  }
+
+  // Other batches can use the freed slots.
+  StartBatchPrefetches();
+}
+
+void BitmapFetcherService::ClearCache() {
+  cache_.Clear();
+  cache_bytes_ = 0;
+  if (disk_cache_)
+    disk_cache_->Clear();
+}
+
+// static
+size_t BitmapFetcherService::GetMaxRequestsForTesting() {
+  return kMaxRequests;
+}
+
+// static
+size_t BitmapFetcherService::GetMaxQueuedRequestsForTesting() {
+  return kMaxQueuedRequests;
+}
+
+// static
+size_t BitmapFetcherService::GetMaxBatchPrefetchesForTesting() {
+  return kMaxBatchPrefetches;
+}
+
+void BitmapFetcherService::SetDiskCacheForTesting(
+    std::unique_ptr<BitmapDiskCache> disk_cache) {
+  disk_cache_ = std::move(disk_cache);
+}
+
+void BitmapFetcherService::StartRequest(
+    std::unique_ptr<BitmapFetcherRequest> request) {
+  RequestId request_id = request->request_id();
+
+  // Images which aren't being downloaded already are looked for on disk first.
+  const chrome::BitmapFetcher* fetcher = FindFetcherForUrl(request->url());
+  if (!fetcher && disk_cache_) {
+    LookUpOnDisk(request->url(), request->size_bucket(),
+                 request->traffic_annotation())
+        ->request_ids.push_back(request_id);
+    requests_[request_id] = std::move(request);
+    return;
+  }
+
+  // Make sure there's a fetcher for this URL, large enough for the request,
+  // and attach to request.
+  fetcher = EnsureFetcherForUrl(request->url(), request->size_bucket(),
+                                request->traffic_annotation());
+  AttachRequest(std::move(request), fetcher);
+}
+
+void BitmapFetcherService::AttachRequest(
+    std::unique_ptr<BitmapFetcherRequest> request,
+    const chrome::BitmapFetcher* fetcher) {
+  RequestId request_id = request->request_id();
+  request->set_fetcher(fetcher);
+  fetcher_requests_.insert(std::make_pair(fetcher, request_id));
+  requests_[request_id] = std::move(request);
+}
+
+void BitmapFetcherService::FinishRequests(
+    const std::vector<RequestId>& request_ids,
+    const SkBitmap* bitmap) {
+  // Detach the requests before notifying them, as observers may start or
+  // cancel other requests.
+  std::vector<std::unique_ptr<BitmapFetcherRequest>> finished_requests;
+  for (RequestId request_id : request_ids) {
+    auto request = requests_.find(request_id);
+    DCHECK(request != requests_.end());
+    finished_requests.push_back(std::move(request->second));
+    requests_.erase(request);
+  }
+
+  // Notify all of the requests of completion.
+  for (const auto& request : finished_requests)
+    request->NotifyImageChanged(bitmap);
+}
+
+BitmapFetcherService::DiskLookup* BitmapFetcherService::LookUpOnDisk(
+    const GURL& url,
+    int size_bucket,
     const net::NetworkTrafficAnnotationTag& traffic_annotation) {
-  if (url.is_valid())
-    EnsureFetcherForUrl(url, traffic_annotation);
+  std::string cache_key = GetCacheKey(url, size_bucket);
+  auto iter = disk_lookups_.find(cache_key);
+  if (iter != disk_lookups_.end())
+    return &iter->second;
+
+  iter = disk_lookups_
+             .insert(std::make_pair(
+                 cache_key, DiskLookup(url, size_bucket, traffic_annotation)))
+             .first;
+  disk_cache_->Load(cache_key,
+                    base::Bind(&BitmapFetcherService::DidLoadFromDisk,
+                               weak_ptr_factory_.GetWeakPtr(), cache_key));
+  return &iter->second;
+}
+
+void BitmapFetcherService::DidLoadFromDisk(const std::string& cache_key,
+                                           const SkBitmap& bitmap) {
+  auto iter = disk_lookups_.find(cache_key);
+  DCHECK(iter != disk_lookups_.end());
+  DiskLookup lookup = std::move(iter->second);
+  disk_lookups_.erase(iter);
+
+  if (!bitmap.isNull()) {
+    // Images found on disk are promoted to the memory cache, so that
+    // following requests don't have to read them again.
+    AddToCache(cache_key, bitmap);
+    OnBatchPrefetchFinished(lookup.url);
+    FinishRequests(lookup.request_ids, &bitmap);
+    StartQueuedRequests();
+    return;
+  }
+
+  // Nobody wants the image anymore if its batch was cancelled.
+  auto batch_prefetch = batch_prefetches_.find(lookup.url.spec());
+  if (lookup.request_ids.empty() && batch_prefetch != batch_prefetches_.end() &&
+      batch_prefetch->second.batch_id == PREFETCH_BATCH_ID_INVALID) {
+    batch_prefetches_.erase(batch_prefetch);
+    StartBatchPrefetches();
+    return;
+  }
+
+  // The image wasn't on disk, so download it.
+  const chrome::BitmapFetcher* fetcher = EnsureFetcherForUrl(
+      lookup.url, lookup.size_bucket, lookup.traffic_annotation);
+  for (RequestId request_id : lookup.request_ids) {
+    auto request = requests_.find(request_id);
+    DCHECK(request != requests_.end());
+    std::unique_ptr<BitmapFetcherRequest> waiting = std::move(request->second);
+    requests_.erase(request);
+    AttachRequest(std::move(waiting), fetcher);
+  }
+}
+
+bool BitmapFetcherService::QueueRequest(
+    std::unique_ptr<BitmapFetcherRequest> request) {
+  std::unique_ptr<BitmapFetcherRequest> dropped_request;
+  if (queued_requests_.size() >= kMaxQueuedRequests) {
+    // Make room by dropping the newest of the lowest priority requests, if it
+    // is less important than |request|.
+    auto lowest = std::prev(request_queue_.end());
+    if (lowest->first <= request->priority()) {
+      request->NotifyImageChanged(nullptr);
+      return false;
+    }
+    auto dropped = queued_requests_.find(lowest->second);
+    dropped_request = std::move(dropped->second);
+    queued_requests_.erase(dropped);
+    request_queue_.erase(lowest);
+  }
+
+  RequestId request_id = request->request_id();
+  request_queue_.insert(std::make_pair(request->priority(), request_id));
+  queued_requests_[request_id] = std::move(request);
+
+  // The dropped request fails like a failed fetch. It is notified last, as
+  // its observer may start or cancel other requests.
+  if (dropped_request)
+    dropped_request->NotifyImageChanged(nullptr);
+  return true;
+}
+
+void BitmapFetcherService::StartQueuedRequests() {
+  // Start the most important requests first, oldest first within a priority.
+  while (!request_queue_.empty() && requests_.size() <= kMaxRequests) {
+    auto next = request_queue_.begin();
+    auto queued = queued_requests_.find(next->second);
+    DCHECK(queued != queued_requests_.end());
+    std::unique_ptr<BitmapFetcherRequest> request = std::move(queued->second);
+    queued_requests_.erase(queued);
+    request_queue_.erase(next);
+
+    // The image may have been fetched while the request was waiting.
+    const SkBitmap* cached_bitmap = GetCachedBitmap(request->cache_key());
+    if (cached_bitmap) {
+      request->NotifyImageChanged(cached_bitmap);
+      continue;
+    }
+
+    StartRequest(std::move(request));
+  }
+
+  StartBatchPrefetches();
+}
+
+void BitmapFetcherService::StartBatchPrefetches() {
+  // Batches only run once every waiting request has been started.
+  while (request_queue_.empty() &&
+         batch_prefetches_.size() < kMaxBatchPrefetches &&
+         !prefetch_batches_.empty()) {
+    auto batch_iter = prefetch_batches_.begin();
+    PrefetchBatch* batch = batch_iter->second.get();
+    if (batch->pending_urls.empty()) {
+      prefetch_batches_.erase(batch_iter);
+      continue;
+    }
+
+    GURL url = batch->pending_urls.front();
+    batch->pending_urls.pop_front();
+
+    // Skip images which are cached, or already being fetched. Downloads of
+    // other batches now serve this batch as well.
+    std::string cache_key = GetCacheKey(url, batch->size_bucket);
+    if (IsCached(cache_key))
+      continue;
+    if (disk_lookups_.count(cache_key) || batch_prefetches_.count(url.spec())) {
+      ShareBatchPrefetch(url);
+      continue;
+    }
+    if (FindFetcherForUrl(url)) {
+      EnsureFetcherForUrl(url, batch->size_bucket, batch->traffic_annotation);
+      continue;
+    }
+
+    BatchPrefetch& batch_prefetch = batch_prefetches_[url.spec()];
+    batch_prefetch.batch_id = batch_iter->first;
+    batch_prefetch.shared = false;
+    if (disk_cache_)
+      LookUpOnDisk(url, batch->size_bucket, batch->traffic_annotation);
+    else
+      EnsureFetcherForUrl(url, batch->size_bucket, batch->traffic_annotation);
+  }
+}
+
+void BitmapFetcherService::OnBatchPrefetchFinished(const GURL& url) {
+  batch_prefetches_.erase(url.spec());
+}
+
+void BitmapFetcherService::ShareBatchPrefetch(const GURL& url) {
+  auto iter = batch_prefetches_.find(url.spec());
+  if (iter != batch_prefetches_.end())
+    iter->second.shared = true;
+}
+
+void BitmapFetcherService::SetCacheLimits(size_t max_cache_bytes,
+                                          base::TimeDelta cache_ttl) {
+  max_cache_bytes_ = max_cache_bytes;
+  cache_ttl_ = cache_ttl;
+
+  // Drop the least recently used images if the budget shrank.
+  EvictCacheToSize(max_cache_bytes_);
+}
+
+void BitmapFetcherService::SetTickClockForTesting(
+    std::unique_ptr<base::TickClock> tick_clock) {
+  tick_clock_ = std::move(tick_clock);
+}
+
+bool BitmapFetcherService::IsCached(const std::string& cache_key) const {
+  auto iter = cache_.Peek(cache_key);
+  return iter != cache_.end() &&
+         tick_clock_->NowTicks() < iter->second->expiration_time;
+}
+
+const SkBitmap* BitmapFetcherService::GetCachedBitmap(
+    const std::string& cache_key) {
+  auto iter = cache_.Get(cache_key);
+  if (iter == cache_.end()) {
+    ++cache_miss_count_;
+    return nullptr;
+  }
+
+  // Expired images are dropped, so that the image is fetched again.
+  if (tick_clock_->NowTicks() >= iter->second->expiration_time) {
+    cache_bytes_ -= iter->second->byte_size;
+    cache_.Erase(iter);
+    ++cache_miss_count_;
+    return nullptr;
+  }
+
+  ++cache_hit_count_;
+  return iter->second->bitmap.get();
+}
+
+void BitmapFetcherService::AddToCache(const std::string& cache_key,
+                                      const SkBitmap& bitmap) {
+  // Replace any previous image for the same URL and size.
+  auto existing = cache_.Peek(cache_key);
+  if (existing != cache_.end()) {
+    cache_bytes_ -= existing->second->byte_size;
+    cache_.Erase(existing);
+  }
+
+  // Images which don't fit in the whole budget aren't cached at all, rather
+  // than flushing every other image.
+  size_t byte_size = bitmap.computeByteSize();
+  if (byte_size > max_cache_bytes_)
+    return;
+
+  // Evict the least recently used images to make room for the new one.
+  EvictCacheToSize(max_cache_bytes_ - byte_size);
+
+  std::unique_ptr<CacheEntry> entry(new CacheEntry);
+  entry->bitmap.reset(new SkBitmap(bitmap));
+  entry->byte_size = byte_size;
+  entry->expiration_time = tick_clock_->NowTicks() + cache_ttl_;
+  cache_.Put(cache_key, std::move(entry));
+  cache_bytes_ += byte_size;
+}
+
+void BitmapFetcherService::EvictCacheToSize(size_t max_bytes) {
+  while (cache_bytes_ > max_bytes) {
+    auto oldest = cache_.rbegin();
+    cache_bytes_ -= oldest->second->byte_size;
+    cache_.Erase(oldest);
+    ++cache_eviction_count_;
+  }
 }
 
 std::unique_ptr<chrome::BitmapFetcher> BitmapFetcherService::CreateFetcher(
@@ -145,34 +746,37 @@ std::unique_ptr<chrome::BitmapFetcher> BitmapFetcherService::CreateFetcher(
 
 const chrome::BitmapFetcher* BitmapFetcherService::EnsureFetcherForUrl(
     const GURL& url,
+    int size_bucket,
     const net::NetworkTrafficAnnotationTag& traffic_annotation) {
-  const chrome::BitmapFetcher* fetcher = FindFetcherForUrl(url);
-  if (fetcher)
-    return fetcher;
+  std::unique_ptr<chrome::BitmapFetcher>& fetcher =
+      active_fetchers_[url.spec()];
+  if (!fetcher) {
+    fetcher = CreateFetcher(url, traffic_annotation);
+    fetcher->set_desired_size(GetDesiredSize(size_bucket));
+    return fetcher.get();
+  }
 
-  std::unique_ptr<chrome::BitmapFetcher> new_fetcher =
-      CreateFetcher(url, traffic_annotation);
-  active_fetchers_.push_back(std::move(new_fetcher));
-  return active_fetchers_.back().get();
+  // All of the requests for a URL share its fetcher, so the image is decoded
+  // at the largest size any of them asked for before the download completed.
+  int fetcher_bucket = GetSizeBucket(fetcher->desired_size());
+  fetcher->set_desired_size(
+      GetDesiredSize(MergeSizeBuckets(fetcher_bucket, size_bucket)));
+  return fetcher.get();
 }
 
 const chrome::BitmapFetcher* BitmapFetcherService::FindFetcherForUrl(
     const GURL& url) {
-  for (auto it = active_fetchers_.begin(); it != active_fetchers_.end(); ++it) {
-    if (url == (*it)->url())
-      return it->get();
-  }
-  return nullptr;
+  auto it = active_fetchers_.find(url.spec());
+  if (it == active_fetchers_.end())
+    return nullptr;
+  return it->second.get();
 }
 
 void BitmapFetcherService::RemoveFetcher(const chrome::BitmapFetcher* fetcher) {
-  auto it = active_fetchers_.begin();
-  for (; it != active_fetchers_.end(); ++it) {
-    if (it->get() == fetcher)
-      break;
-  }
+  auto it = active_fetchers_.find(fetcher->url().spec());
   // RemoveFetcher should always result in removal.
   DCHECK(it != active_fetchers_.end());
+  DCHECK_EQ(fetcher, it->second.get());
   active_fetchers_.erase(it);
 }
 
@@ -181,22 +785,61 @@ void BitmapFetcherService::OnFetchComplete(const GURL& url,
   const chrome::BitmapFetcher* fetcher = FindFetcherForUrl(url);
   DCHECK(fetcher);
 
-  // Notify all attached requests of completion.
-  ScopedVector<BitmapFetcherRequest>::iterator iter = requests_.begin();
-  while (iter != requests_.end()) {
-    if ((*iter)->get_fetcher() == fetcher) {
-      (*iter)->NotifyImageChanged(bitmap);
-      iter = requests_.erase(iter);
+  // |url| belongs to the fetcher, which is deleted below.
+  GURL fetched_url = url;
+  bool success = bitmap && !bitmap->isNull();
+
+  // The image was decoded for the size the fetcher wanted when its download
+  // completed. Requests which joined later and need a larger image are
+  // fetched again; the others are notified of completion.
+  int decoded_bucket = GetSizeBucket(fetcher->decoded_size());
+  std::vector<RequestId> request_ids;
+  std::vector<RequestId> restarted_request_ids;
+  auto range = fetcher_requests_.equal_range(fetcher);
+  for (auto iter = range.first; iter != range.second; ++iter) {
+    int size_bucket = requests_[iter->second]->size_bucket();
+    if (success &&
+        MergeSizeBuckets(decoded_bucket, size_bucket) != decoded_bucket) {
+      restarted_request_ids.push_back(iter->second);
     } else {
-      ++iter;
+      request_ids.push_back(iter->second);
     }
   }
-
-  if (bitmap && !bitmap->isNull()) {
-    std::unique_ptr<CacheEntry> entry(new CacheEntry);
-    entry->bitmap.reset(new SkBitmap(*bitmap));
-    cache_.Put(fetcher->url(), std::move(entry));
+  fetcher_requests_.erase(range.first, range.second);
+
+  // Cache the image and drop the fetcher before notifying the requests, as
+  // observers may start or cancel other requests. Those must not be attached
+  // to the finished fetcher.
+  if (success) {
+    std::string cache_key = GetCacheKey(fetched_url, decoded_bucket);
+    AddToCache(cache_key, *bitmap);
+    if (disk_cache_)
+      disk_cache_->Store(cache_key, *bitmap);
   }
 
   RemoveFetcher(fetcher);
+  OnBatchPrefetchFinished(fetched_url);
+
+  for (RequestId request_id : restarted_request_ids) {
+    auto request = requests_.find(request_id);
+    std::unique_ptr<BitmapFetcherRequest> waiting = std::move(request->second);
+    requests_.erase(request);
+    const chrome::BitmapFetcher* new_fetcher = EnsureFetcherForUrl(
+        waiting->url(), waiting->size_bucket(), waiting->traffic_annotation());
+    AttachRequest(std::move(waiting), new_fetcher);
+  }
+
+  FinishRequests(request_ids, bitmap);
+
+  // The finished requests made room for queued ones.
+  StartQueuedRequests();
+}
+
+void BitmapFetcherService::OnBrowsingDataRemoverDone() {
+  // The removal's time range isn't taken into account, as cached images are
+  // cheap to fetch again.
+  BrowsingDataRemover* remover =
+      BrowsingDataRemoverFactory::GetForBrowserContext(context_);
+  if (remover->GetLastUsedRemovalMask() & BrowsingDataRemover::DATA_TYPE_CACHE)
+    ClearCache();
 }
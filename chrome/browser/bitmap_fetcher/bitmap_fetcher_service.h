@@ -4,16 +4,32 @@
 #ifndef CHROME_BROWSER_BITMAP_FETCHER_BITMAP_FETCHER_SERVICE_H_
 #define CHROME_BROWSER_BITMAP_FETCHER_BITMAP_FETCHER_SERVICE_H_
 
+#include <stddef.h>
+
+#include <deque>
+#include <map>
 #include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "base/compiler_specific.h"
 #include "base/containers/mru_cache.h"
 #include "base/macros.h"
-#include "base/memory/scoped_vector.h"
+#include "base/memory/weak_ptr.h"
+#include "base/scoped_observer.h"
+#include "base/time/time.h"
 #include "chrome/browser/bitmap_fetcher/bitmap_fetcher_delegate.h"
+#include "chrome/browser/browsing_data/browsing_data_remover.h"
 #include "components/keyed_service/core/keyed_service.h"
 #include "net/traffic_annotation/network_traffic_annotation.h"
 
+namespace base {
+class TickClock;
+}  // namespace base
+
 namespace content {
 class BrowserContext;
 }  // namespace content
@@ -22,17 +38,26 @@ namespace chrome {
 class BitmapFetcher;
 }  // namespace chrome
 
+namespace gfx {
+class Size;
+}  // namespace gfx
+
+class BitmapDiskCache;
 class BitmapFetcherRequest;
 class GURL;
 class SkBitmap;
 
 // Service to retrieve images for Answers in Suggest.
 class BitmapFetcherService : public KeyedService,
-                             public chrome::BitmapFetcherDelegate {
+                             public chrome::BitmapFetcherDelegate,
+                             public BrowsingDataRemover::Observer {
  public:
   typedef int RequestId;
   static const RequestId REQUEST_ID_INVALID = 0;
 
+  typedef int PrefetchBatchId;
+  static const PrefetchBatchId PREFETCH_BATCH_ID_INVALID = 0;
+
   class Observer {
    public:
     virtual ~Observer() {}
@@ -44,6 +69,15 @@ class BitmapFetcherService : public KeyedService,
                                 const SkBitmap& answers_image) = 0;
   };
 
+  // The priority of a request which has to wait for other requests to finish
+  // before it can be started.
+  enum class RequestPriority {
+    // The image is about to be displayed.
+    VISIBLE,
+    // The image may be displayed later.
+    PREFETCH,
+  };
+
   explicit BitmapFetcherService(content::BrowserContext* context);
   ~BitmapFetcherService() override;
 
@@ -52,20 +86,79 @@ class BitmapFetcherService : public KeyedService,
 
   // Requests a new image. Will either trigger download or satisfy from cache.
   // Takes ownership of |observer|. If there are too many outstanding requests,
-  // the request will fail and |observer| will be called to signal failure.
+  // the request waits in a queue until others finish, and the most important
+  // queued requests are started first. If the queue is full as well, the
+  // request will fail and |observer| will be called to signal failure.
   // Otherwise, |observer| will be called with either the cached image or the
   // downloaded one.
   // NOTE: The observer might be called back synchronously from RequestImage if
   // the image is already in the cache.
+  // Large images are shrunk to about |desired_size|, the size they will be
+  // displayed at. Sizes are rounded up to a power of two, and each rounded size
+  // is cached separately. An empty |desired_size| keeps the full resolution.
   RequestId RequestImage(
       const GURL& url,
+      const gfx::Size& desired_size,
       Observer* observer,
+      RequestPriority priority,
       const net::NetworkTrafficAnnotationTag& traffic_annotation);
 
-  // Start fetching the image at the given |url|.
+  // Same as above, for an image kept at its full resolution.
+  RequestId RequestImage(
+      const GURL& url,
+      Observer* observer,
+      RequestPriority priority,
+      const net::NetworkTrafficAnnotationTag& traffic_annotation);
+
+  // Same as above, for an image which is about to be displayed.
+  RequestId RequestImage(
+      const GURL& url,
+      Observer* observer,
+      const net::NetworkTrafficAnnotationTag& traffic_annotation);
+
+  // Start fetching the image at the given |url|, to be displayed at
+  // |desired_size|.
   void Prefetch(const GURL& url,
+                const gfx::Size& desired_size,
                 const net::NetworkTrafficAnnotationTag& traffic_annotation);
 
+  // Same as above, for an image kept at its full resolution.
+  void Prefetch(const GURL& url,
+                const net::NetworkTrafficAnnotationTag& traffic_annotation);
+
+  // Fetches the images at |urls| in the background, a few at a time. Images
+  // are only fetched while no requests are waiting, and images which are
+  // cached or already being fetched are skipped. Returns an ID which can be
+  // used to cancel the batch, or PREFETCH_BATCH_ID_INVALID if there was
+  // nothing to fetch.
+  PrefetchBatchId PrefetchImages(
+      const std::vector<GURL>& urls,
+      const gfx::Size& desired_size,
+      const net::NetworkTrafficAnnotationTag& traffic_annotation);
+
+  // Drops the images of a batch which haven't been fetched yet, and stops the
+  // downloads the batch started, unless a request is waiting for them or they
+  // were also asked for by Prefetch() or another batch.
+  void CancelPrefetchImages(PrefetchBatchId batch_id);
+
+  // Statistics for the image cache: lookups which were served from the cache,
+  // lookups which weren't, and images dropped to stay within the byte budget.
+  int cache_hit_count() const { return cache_hit_count_; }
+  int cache_miss_count() const { return cache_miss_count_; }
+  int cache_eviction_count() const { return cache_eviction_count_; }
+
+  // The number of bytes of pixels held by the image cache.
+  size_t cache_bytes() const { return cache_bytes_; }
+
+  // Drops all of the cached images, in memory and on disk. Images which are
+  // being fetched are still cached once they arrive.
+  void ClearCache();
+
+  // The limits on inflight requests, queued requests and batch downloads.
+  static size_t GetMaxRequestsForTesting();
+  static size_t GetMaxQueuedRequestsForTesting();
+  static size_t GetMaxBatchPrefetchesForTesting();
+
  protected:
   // Create a bitmap fetcher for the given |url| and start it. Virtual method
   // so tests can override this for different behavior.
@@ -76,36 +169,181 @@ class BitmapFetcherService : public KeyedService,
  private:
   friend class BitmapFetcherServiceTest;
 
+  // Sets the byte budget and the lifetime of cached images.
+  void SetCacheLimits(size_t max_cache_bytes, base::TimeDelta cache_ttl);
+
+  void SetTickClockForTesting(std::unique_ptr<base::TickClock> tick_clock);
+
+  void SetDiskCacheForTesting(std::unique_ptr<BitmapDiskCache> disk_cache);
+
+  // The requests waiting for an image to be read from the disk cache, and how
+  // to download it if it isn't found.
+  struct DiskLookup {
+    DiskLookup(const GURL& url,
+               int size_bucket,
+               const net::NetworkTrafficAnnotationTag& traffic_annotation);
+    DiskLookup(DiskLookup&& other);
+    ~DiskLookup();
+
+    const GURL url;
+    const int size_bucket;
+    const net::NetworkTrafficAnnotationTag traffic_annotation;
+    std::vector<RequestId> request_ids;
+  };
+
+  // The images of a PrefetchImages() batch which haven't been started yet.
+  struct PrefetchBatch {
+    PrefetchBatch(int size_bucket,
+                  const net::NetworkTrafficAnnotationTag& traffic_annotation);
+    ~PrefetchBatch();
+
+    const int size_bucket;
+    const net::NetworkTrafficAnnotationTag traffic_annotation;
+    std::deque<GURL> pending_urls;
+  };
+
+  // Returns whether an unexpired image is cached for |cache_key|, without
+  // counting it as a lookup.
+  bool IsCached(const std::string& cache_key) const;
+
+  // Returns the cached image for |cache_key|, or nullptr if there is none or
+  // it has expired. Updates the cache statistics.
+  const SkBitmap* GetCachedBitmap(const std::string& cache_key);
+
+  // Adds |bitmap| to the cache, evicting the least recently used images until
+  // the cache fits in its byte budget.
+  void AddToCache(const std::string& cache_key, const SkBitmap& bitmap);
+
+  // Evicts the least recently used images until the cache holds at most
+  // |max_bytes|.
+  void EvictCacheToSize(size_t max_bytes);
+
+  // Attaches |request| to the fetcher for its URL, creating the fetcher if
+  // the image isn't in the disk cache.
+  void StartRequest(std::unique_ptr<BitmapFetcherRequest> request);
+
+  void AttachRequest(std::unique_ptr<BitmapFetcherRequest> request,
+                     const chrome::BitmapFetcher* fetcher);
+
+  // Removes the requests in |request_ids| and notifies them of |bitmap|.
+  void FinishRequests(const std::vector<RequestId>& request_ids,
+                      const SkBitmap* bitmap);
+
+  // Starts reading the image for |url| at |size_bucket| from the disk cache,
+  // unless that is already in progress.
+  DiskLookup* LookUpOnDisk(
+      const GURL& url,
+      int size_bucket,
+      const net::NetworkTrafficAnnotationTag& traffic_annotation);
+
+  // Delivers an image found on disk, or downloads it if it wasn't found.
+  void DidLoadFromDisk(const std::string& cache_key, const SkBitmap& bitmap);
+
+  // Adds |request| to the queue of waiting requests. If the queue is full, a
+  // less important request is dropped to make room, and fails like a failed
+  // fetch. Returns false if there was no room for |request|.
+  bool QueueRequest(std::unique_ptr<BitmapFetcherRequest> request);
+
+  // Starts queued requests while there is room for them, then batch
+  // prefetches.
+  void StartQueuedRequests();
+
+  // Starts the images of the oldest prefetch batches, while no requests are
+  // queued and fewer than the maximum batch downloads are in flight.
+  void StartBatchPrefetches();
+
+  // Called when the batch download of |url| has finished, successfully or
+  // not, to make room for the next one.
+  void OnBatchPrefetchFinished(const GURL& url);
+
+  // Marks the batch download of |url|, if there is one, as wanted by another
+  // caller too.
+  void ShareBatchPrefetch(const GURL& url);
+
   // Gets the existing fetcher for |url| or constructs a new one if it doesn't
-  // exist.
+  // exist. The fetcher's image is made large enough for |size_bucket|.
   const chrome::BitmapFetcher* EnsureFetcherForUrl(
       const GURL& url,
+      int size_bucket,
       const net::NetworkTrafficAnnotationTag& traffic_annotation);
 
   // Find a fetcher with a given |url|. Return NULL if none is found.
   const chrome::BitmapFetcher* FindFetcherForUrl(const GURL& url);
 
-  // Remove |fetcher| from list of active fetchers. |fetcher| MUST be part of
-  // the list.
+  // Remove |fetcher| from the active fetchers. |fetcher| MUST be active.
   void RemoveFetcher(const chrome::BitmapFetcher* fetcher);
 
   // BitmapFetcherDelegate implementation.
   void OnFetchComplete(const GURL& url, const SkBitmap* bitmap) override;
 
-  // Currently active image fetchers.
-  std::vector<std::unique_ptr<chrome::BitmapFetcher>> active_fetchers_;
+  // BrowsingDataRemover::Observer implementation.
+  void OnBrowsingDataRemoverDone() override;
+
+  // Currently active image fetchers, keyed by the spec of their URL.
+  std::unordered_map<std::string, std::unique_ptr<chrome::BitmapFetcher>>
+      active_fetchers_;
 
   // Currently active requests.
-  ScopedVector<BitmapFetcherRequest> requests_;
+  std::unordered_map<RequestId, std::unique_ptr<BitmapFetcherRequest>>
+      requests_;
+
+  // The requests waiting for each active fetcher.
+  std::unordered_multimap<const chrome::BitmapFetcher*, RequestId>
+      fetcher_requests_;
+
+  // Requests waiting for inflight requests to finish, and the order in which
+  // they will be started.
+  std::unordered_map<RequestId, std::unique_ptr<BitmapFetcherRequest>>
+      queued_requests_;
+  std::set<std::pair<RequestPriority, RequestId>> request_queue_;
 
-  // Cache of retrieved images.
+  // A download started by a prefetch batch. Downloads which other callers
+  // asked for as well are |shared|, and aren't stopped with the batch.
+  struct BatchPrefetch {
+    PrefetchBatchId batch_id;
+    bool shared;
+  };
+
+  // Prefetch batches, oldest first, and the downloads started by them, keyed
+  // by the spec of their URL. Downloads of cancelled batches which are still
+  // looking at the disk cache have PREFETCH_BATCH_ID_INVALID.
+  std::map<PrefetchBatchId, std::unique_ptr<PrefetchBatch>> prefetch_batches_;
+  std::unordered_map<std::string, BatchPrefetch> batch_prefetches_;
+  PrefetchBatchId current_batch_id_;
+
+  // Cache of retrieved images, keyed by their URL and size bucket.
   struct CacheEntry {
     CacheEntry();
     ~CacheEntry();
 
     std::unique_ptr<const SkBitmap> bitmap;
+
+    // The number of bytes of pixels held by |bitmap|.
+    size_t byte_size;
+
+    // The entry is no longer used once this time has passed.
+    base::TimeTicks expiration_time;
   };
-  base::MRUCache<GURL, std::unique_ptr<CacheEntry>> cache_;
+  using ImageCache = base::MRUCache<std::string, std::unique_ptr<CacheEntry>>;
+  ImageCache cache_;
+
+  // The total size of the cached images, and the limit for it.
+  size_t cache_bytes_;
+  size_t max_cache_bytes_;
+
+  // How long images stay in the cache.
+  base::TimeDelta cache_ttl_;
+
+  int cache_hit_count_;
+  int cache_miss_count_;
+  int cache_eviction_count_;
+
+  std::unique_ptr<base::TickClock> tick_clock_;
+
+  // Optional cache of decoded images on disk, and the images being read from
+  // it, keyed like |cache_|.
+  std::unique_ptr<BitmapDiskCache> disk_cache_;
+  std::unordered_map<std::string, DiskLookup> disk_lookups_;
 
   // Current request ID to be used.
   int current_request_id_;
@@ -113,6 +351,11 @@ class BitmapFetcherService : public KeyedService,
   // Browser context this service is active for.
   content::BrowserContext* context_;
 
+  ScopedObserver<BrowsingDataRemover, BrowsingDataRemover::Observer>
+      browsing_data_remover_observer_;
+
+  base::WeakPtrFactory<BitmapFetcherService> weak_ptr_factory_;
+
   DISALLOW_COPY_AND_ASSIGN(BitmapFetcherService);
 };
 
@@ -4,6 +4,7 @@
 #include "chrome/browser/bitmap_fetcher/bitmap_fetcher_service_factory.h"
 
 #include "chrome/browser/bitmap_fetcher/bitmap_fetcher_service.h"
+#include "chrome/browser/browsing_data/browsing_data_remover_factory.h"
 #include "chrome/browser/profiles/profile.h"
 #include "components/keyed_service/content/browser_context_dependency_manager.h"
 
@@ -23,6 +24,7 @@ BitmapFetcherServiceFactory::BitmapFetcherServiceFactory()
     : BrowserContextKeyedServiceFactory(
           "BitmapFetcherService",
           BrowserContextDependencyManager::GetInstance()) {
+  DependsOn(BrowsingDataRemoverFactory::GetInstance());
 }
 
 BitmapFetcherServiceFactory::~BitmapFetcherServiceFactory() {
@@ -6,17 +6,38 @@
 
 #include <stddef.h>
 
+#include <vector>
+
 #include "base/macros.h"
+#include "base/files/scoped_temp_dir.h"
 #include "base/memory/ptr_util.h"
+#include "base/run_loop.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/test/simple_test_tick_clock.h"
+#include "base/threading/thread_task_runner_handle.h"
+#include "chrome/browser/bitmap_fetcher/bitmap_disk_cache.h"
 #include "chrome/browser/bitmap_fetcher/bitmap_fetcher.h"
 #include "chrome/test/base/testing_profile.h"
 #include "content/public/test/test_browser_thread_bundle.h"
 #include "net/traffic_annotation/network_traffic_annotation_test_helper.h"
+#include "net/url_request/test_url_fetcher_factory.h"
+#include "net/url_request/url_request_status.h"
 #include "testing/gtest/include/gtest/gtest.h"
 #include "third_party/skia/include/core/SkBitmap.h"
+#include "ui/gfx/geometry/size.h"
 
 namespace {
 
+// Returns |count| distinct image URLs.
+std::vector<GURL> CreateUrls(size_t count) {
+  std::vector<GURL> urls;
+  for (size_t i = 0; i < count; ++i) {
+    urls.push_back(
+        GURL("http://example.org/batch-image-" + base::SizeTToString(i)));
+  }
+  return urls;
+}
+
 class TestNotificationInterface {
  public:
   virtual ~TestNotificationInterface() {}
@@ -40,6 +61,47 @@ class TestObserver : public BitmapFetcherService::Observer {
   DISALLOW_COPY_AND_ASSIGN(TestObserver);
 };
 
+// An observer which cancels another request once its image arrives.
+class CancellingObserver : public TestObserver {
+ public:
+  CancellingObserver(TestNotificationInterface* target,
+                     BitmapFetcherService* service,
+                     BitmapFetcherService::RequestId cancelled_request_id)
+      : TestObserver(target),
+        service_(service),
+        cancelled_request_id_(cancelled_request_id) {}
+  ~CancellingObserver() override {}
+
+  void OnImageChanged(BitmapFetcherService::RequestId request_id,
+                      const SkBitmap& answers_image) override {
+    TestObserver::OnImageChanged(request_id, answers_image);
+    service_->CancelRequest(cancelled_request_id_);
+  }
+
+ private:
+  BitmapFetcherService* service_;
+  BitmapFetcherService::RequestId cancelled_request_id_;
+
+  DISALLOW_COPY_AND_ASSIGN(CancellingObserver);
+};
+
+// A fetcher which never decodes its downloaded image, as that requires a
+// utility process. Tests deliver the decoded image themselves.
+class TestBitmapFetcher : public chrome::BitmapFetcher {
+ public:
+  TestBitmapFetcher(const GURL& url,
+                    chrome::BitmapFetcherDelegate* delegate,
+                    const net::NetworkTrafficAnnotationTag& traffic_annotation)
+      : chrome::BitmapFetcher(url, delegate, traffic_annotation) {}
+  ~TestBitmapFetcher() override {}
+
+ protected:
+  void DecodeImage(const std::string& image_data) override {}
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(TestBitmapFetcher);
+};
+
 class TestService : public BitmapFetcherService {
  public:
   explicit TestService(content::BrowserContext* context)
@@ -51,8 +113,7 @@ class TestService : public BitmapFetcherService {
   std::unique_ptr<chrome::BitmapFetcher> CreateFetcher(
       const GURL& url,
       const net::NetworkTrafficAnnotationTag& traffic_annotation) override {
-    return base::MakeUnique<chrome::BitmapFetcher>(url, this,
-                                                   traffic_annotation);
+    return base::MakeUnique<TestBitmapFetcher>(url, this, traffic_annotation);
   }
 };
 
@@ -67,20 +128,45 @@ class BitmapFetcherServiceTest : public testing::Test,
   }
 
   void SetUp() override {
-    service_.reset(new TestService(&profile_));
+    RecreateService();
     requests_finished_ = 0;
     images_changed_ = 0;
   }
 
-  const ScopedVector<BitmapFetcherRequest>& requests() const {
-    return service_->requests_;
+  void RecreateService() { service_.reset(new TestService(&profile_)); }
+
+  size_t requests_size() const { return service_->requests_.size(); }
+  size_t active_fetchers_size() const {
+    return service_->active_fetchers_.size();
   }
-  const std::vector<std::unique_ptr<chrome::BitmapFetcher>>& active_fetchers()
-      const {
-    return service_->active_fetchers_;
+  size_t queued_requests_size() const {
+    return service_->queued_requests_.size();
+  }
+
+  // Starts as many requests for |url| as can be inflight at once, and returns
+  // their IDs.
+  std::vector<BitmapFetcherService::RequestId> FillRequests(const GURL& url) {
+    std::vector<BitmapFetcherService::RequestId> request_ids;
+    while (service_->requests_.size() <=
+           BitmapFetcherService::GetMaxRequestsForTesting()) {
+      request_ids.push_back(service_->RequestImage(
+          url, new TestObserver(this), TRAFFIC_ANNOTATION_FOR_TESTS));
+    }
+    return request_ids;
   }
   size_t cache_size() const { return service_->cache_.size(); }
 
+  void SetCacheLimits(size_t max_cache_bytes, base::TimeDelta cache_ttl) {
+    service_->SetCacheLimits(max_cache_bytes, cache_ttl);
+  }
+
+  // Setup a test clock so that the tests can control time.
+  base::SimpleTestTickClock* SetTickClockForTesting() {
+    base::SimpleTestTickClock* clock = new base::SimpleTestTickClock();
+    service_->SetTickClockForTesting(base::WrapUnique(clock));
+    return clock;
+  }
+
   void OnImageChanged() override { images_changed_++; }
 
   void OnRequestFinished() override { requests_finished_++; }
@@ -98,12 +184,34 @@ class BitmapFetcherServiceTest : public testing::Test,
     const_cast<chrome::BitmapFetcher*>(fetcher)->OnImageDecoded(image);
   }
 
+  // Simulate the download for the given fetcher completing, which starts the
+  // decode.
+  void CompleteDownload(const GURL& url) {
+    const chrome::BitmapFetcher* fetcher = service_->FindFetcherForUrl(url);
+    ASSERT_TRUE(fetcher);
+
+    net::TestURLFetcher url_fetcher(0, url, nullptr);
+    url_fetcher.set_status(net::URLRequestStatus());
+    url_fetcher.set_response_code(200);
+    url_fetcher.SetResponseString("image data");
+    const_cast<chrome::BitmapFetcher*>(fetcher)->OnURLFetchComplete(
+        &url_fetcher);
+  }
+
   void FailFetch(const GURL& url) {
     const chrome::BitmapFetcher* fetcher = service_->FindFetcherForUrl(url);
     ASSERT_TRUE(fetcher);
     const_cast<chrome::BitmapFetcher*>(fetcher)->OnImageDecoded(SkBitmap());
   }
 
+  // Gives the service a disk cache in |dir|, which does its file operations
+  // on the current thread.
+  void SetDiskCache(const base::FilePath& dir) {
+    service_->SetDiskCacheForTesting(base::MakeUnique<BitmapDiskCache>(
+        dir, 1024 * 1024, base::TimeDelta::FromHours(1),
+        base::ThreadTaskRunnerHandle::Get()));
+  }
+
   // A failed decode results in a nullptr image.
   void FailDecode(const GURL& url) {
     const chrome::BitmapFetcher* fetcher = service_->FindFetcherForUrl(url);
@@ -142,15 +250,15 @@ TEST_F(BitmapFetcherServiceTest, CancelInvalidRequest) {
 }
 
 TEST_F(BitmapFetcherServiceTest, OnlyFirstRequestCreatesFetcher) {
-  EXPECT_EQ(0U, active_fetchers().size());
+  EXPECT_EQ(0U, active_fetchers_size());
 
   service_->RequestImage(url1_, new TestObserver(this),
                          TRAFFIC_ANNOTATION_FOR_TESTS);
-  EXPECT_EQ(1U, active_fetchers().size());
+  EXPECT_EQ(1U, active_fetchers_size());
 
   service_->RequestImage(url1_, new TestObserver(this),
                          TRAFFIC_ANNOTATION_FOR_TESTS);
-  EXPECT_EQ(1U, active_fetchers().size());
+  EXPECT_EQ(1U, active_fetchers_size());
 }
 
 TEST_F(BitmapFetcherServiceTest, CompletedFetchNotifiesAllObservers) {
@@ -162,8 +270,8 @@ TEST_F(BitmapFetcherServiceTest, CompletedFetchNotifiesAllObservers) {
                          TRAFFIC_ANNOTATION_FOR_TESTS);
   service_->RequestImage(url1_, new TestObserver(this),
                          TRAFFIC_ANNOTATION_FOR_TESTS);
-  EXPECT_EQ(1U, active_fetchers().size());
-  EXPECT_EQ(4U, requests().size());
+  EXPECT_EQ(1U, active_fetchers_size());
+  EXPECT_EQ(4U, requests_size());
 
   CompleteFetch(url1_);
   EXPECT_EQ(4, images_changed_);
@@ -181,10 +289,10 @@ TEST_F(BitmapFetcherServiceTest, CancelRequest) {
                          TRAFFIC_ANNOTATION_FOR_TESTS);
   service_->RequestImage(url1_, new TestObserver(this),
                          TRAFFIC_ANNOTATION_FOR_TESTS);
-  EXPECT_EQ(5U, requests().size());
+  EXPECT_EQ(5U, requests_size());
 
   service_->CancelRequest(requestId);
-  EXPECT_EQ(4U, requests().size());
+  EXPECT_EQ(4U, requests_size());
 
   CompleteFetch(url2_);
   EXPECT_EQ(0, images_changed_);
@@ -219,3 +327,436 @@ TEST_F(BitmapFetcherServiceTest, FailedRequestsDontEnterCache) {
   FailFetch(url2_);
   EXPECT_EQ(1U, cache_size());
 }
+
+TEST_F(BitmapFetcherServiceTest, CacheIsLimitedByBytes) {
+  // Each test image is 2x2 pixels of 4 bytes each, so two of them fit.
+  SetCacheLimits(32, base::TimeDelta::FromHours(1));
+  const GURL url3("http://example.org/sample-image-3.png");
+
+  for (const GURL& url : {url1_, url2_, url3}) {
+    service_->RequestImage(url, new TestObserver(this),
+                           TRAFFIC_ANNOTATION_FOR_TESTS);
+    CompleteFetch(url);
+  }
+  EXPECT_EQ(2U, cache_size());
+  EXPECT_EQ(32U, service_->cache_bytes());
+  EXPECT_EQ(1, service_->cache_eviction_count());
+  EXPECT_EQ(3, service_->cache_miss_count());
+
+  // The least recently used image was evicted.
+  EXPECT_EQ(BitmapFetcherService::REQUEST_ID_INVALID,
+            service_->RequestImage(url3, new TestObserver(this),
+                                   TRAFFIC_ANNOTATION_FOR_TESTS));
+  EXPECT_EQ(1, service_->cache_hit_count());
+  EXPECT_NE(BitmapFetcherService::REQUEST_ID_INVALID,
+            service_->RequestImage(url1_, new TestObserver(this),
+                                   TRAFFIC_ANNOTATION_FOR_TESTS));
+  EXPECT_EQ(4, service_->cache_miss_count());
+
+  // Shrinking the budget evicts images straight away.
+  SetCacheLimits(16, base::TimeDelta::FromHours(1));
+  EXPECT_EQ(1U, cache_size());
+  EXPECT_EQ(16U, service_->cache_bytes());
+}
+
+TEST_F(BitmapFetcherServiceTest, CachedImagesExpire) {
+  base::SimpleTestTickClock* clock = SetTickClockForTesting();
+  SetCacheLimits(1024, base::TimeDelta::FromMinutes(10));
+
+  service_->RequestImage(url1_, new TestObserver(this),
+                         TRAFFIC_ANNOTATION_FOR_TESTS);
+  CompleteFetch(url1_);
+  EXPECT_EQ(1U, cache_size());
+
+  clock->Advance(base::TimeDelta::FromMinutes(9));
+  EXPECT_EQ(BitmapFetcherService::REQUEST_ID_INVALID,
+            service_->RequestImage(url1_, new TestObserver(this),
+                                   TRAFFIC_ANNOTATION_FOR_TESTS));
+  EXPECT_EQ(1, service_->cache_hit_count());
+
+  // Expired images are dropped and fetched again.
+  clock->Advance(base::TimeDelta::FromMinutes(1));
+  EXPECT_NE(BitmapFetcherService::REQUEST_ID_INVALID,
+            service_->RequestImage(url1_, new TestObserver(this),
+                                   TRAFFIC_ANNOTATION_FOR_TESTS));
+  EXPECT_EQ(0U, cache_size());
+  EXPECT_EQ(0U, service_->cache_bytes());
+  EXPECT_EQ(1U, active_fetchers_size());
+}
+
+TEST_F(BitmapFetcherServiceTest, CancelRequestDetachesFromFetcher) {
+  BitmapFetcherService::RequestId request_id = service_->RequestImage(
+      url1_, new TestObserver(this), TRAFFIC_ANNOTATION_FOR_TESTS);
+  service_->RequestImage(url1_, new TestObserver(this),
+                         TRAFFIC_ANNOTATION_FOR_TESTS);
+  service_->RequestImage(url2_, new TestObserver(this),
+                         TRAFFIC_ANNOTATION_FOR_TESTS);
+  EXPECT_EQ(2U, active_fetchers_size());
+
+  // Cancelling a request destroys its observer straight away.
+  service_->CancelRequest(request_id);
+  EXPECT_EQ(1, requests_finished_);
+  EXPECT_EQ(2U, requests_size());
+
+  // Cancelling it again does nothing.
+  service_->CancelRequest(request_id);
+  EXPECT_EQ(2U, requests_size());
+
+  // Only the remaining request for the URL is notified.
+  CompleteFetch(url1_);
+  EXPECT_EQ(1, images_changed_);
+  EXPECT_EQ(2, requests_finished_);
+  EXPECT_EQ(1U, requests_size());
+  EXPECT_EQ(1U, active_fetchers_size());
+}
+
+TEST_F(BitmapFetcherServiceTest, OverflowRequestsAreQueued) {
+  std::vector<BitmapFetcherService::RequestId> request_ids =
+      FillRequests(url1_);
+  EXPECT_EQ(1U, active_fetchers_size());
+
+  // Requests beyond the limit wait without starting a fetcher.
+  const GURL url3("http://example.org/sample-image-3.png");
+  BitmapFetcherService::RequestId prefetch_id = service_->RequestImage(
+      url2_, new TestObserver(this),
+      BitmapFetcherService::RequestPriority::PREFETCH,
+      TRAFFIC_ANNOTATION_FOR_TESTS);
+  BitmapFetcherService::RequestId visible_id = service_->RequestImage(
+      url3, new TestObserver(this),
+      BitmapFetcherService::RequestPriority::VISIBLE,
+      TRAFFIC_ANNOTATION_FOR_TESTS);
+  EXPECT_NE(BitmapFetcherService::REQUEST_ID_INVALID, prefetch_id);
+  EXPECT_NE(BitmapFetcherService::REQUEST_ID_INVALID, visible_id);
+  EXPECT_EQ(2U, queued_requests_size());
+  EXPECT_EQ(1U, active_fetchers_size());
+
+  // Cancelling an inflight request starts the most important queued request.
+  service_->CancelRequest(request_ids[0]);
+  EXPECT_EQ(1U, queued_requests_size());
+  EXPECT_EQ(2U, active_fetchers_size());
+  EXPECT_FALSE(service_->FindFetcherForUrl(url2_));
+  EXPECT_TRUE(service_->FindFetcherForUrl(url3));
+
+  // Completing the fetch for the other requests starts the rest.
+  CompleteFetch(url1_);
+  EXPECT_EQ(0U, queued_requests_size());
+  EXPECT_TRUE(service_->FindFetcherForUrl(url2_));
+
+  CompleteFetch(url2_);
+  CompleteFetch(url3);
+  EXPECT_EQ(static_cast<int>(request_ids.size()) + 1, images_changed_);
+}
+
+TEST_F(BitmapFetcherServiceTest, CancelQueuedRequest) {
+  FillRequests(url1_);
+
+  BitmapFetcherService::RequestId request_id = service_->RequestImage(
+      url2_, new TestObserver(this), TRAFFIC_ANNOTATION_FOR_TESTS);
+  EXPECT_EQ(1U, queued_requests_size());
+
+  // A cancelled queued request is dropped straight away, and never starts.
+  service_->CancelRequest(request_id);
+  EXPECT_EQ(0U, queued_requests_size());
+  EXPECT_EQ(1, requests_finished_);
+
+  CompleteFetch(url1_);
+  EXPECT_FALSE(service_->FindFetcherForUrl(url2_));
+}
+
+TEST_F(BitmapFetcherServiceTest, DroppedQueuedRequestsFinish) {
+  FillRequests(url1_);
+  int inflight_requests = static_cast<int>(requests_size());
+
+  // Fill the queue with prefetch requests.
+  std::vector<GURL> urls =
+      CreateUrls(BitmapFetcherService::GetMaxQueuedRequestsForTesting());
+  for (const GURL& url : urls) {
+    service_->RequestImage(url, new TestObserver(this),
+                           BitmapFetcherService::RequestPriority::PREFETCH,
+                           TRAFFIC_ANNOTATION_FOR_TESTS);
+  }
+  EXPECT_EQ(0, requests_finished_);
+
+  // Another prefetch request doesn't fit, and fails straight away.
+  EXPECT_EQ(BitmapFetcherService::REQUEST_ID_INVALID,
+            service_->RequestImage(
+                url2_, new TestObserver(this),
+                BitmapFetcherService::RequestPriority::PREFETCH,
+                TRAFFIC_ANNOTATION_FOR_TESTS));
+  EXPECT_EQ(1, requests_finished_);
+
+  // A visible request takes the place of the newest prefetch request, which
+  // finishes without an image.
+  EXPECT_NE(BitmapFetcherService::REQUEST_ID_INVALID,
+            service_->RequestImage(
+                url2_, new TestObserver(this),
+                BitmapFetcherService::RequestPriority::VISIBLE,
+                TRAFFIC_ANNOTATION_FOR_TESTS));
+  EXPECT_EQ(2, requests_finished_);
+  EXPECT_EQ(0, images_changed_);
+  EXPECT_EQ(urls.size(), queued_requests_size());
+
+  CompleteFetch(url1_);
+  EXPECT_EQ(inflight_requests, images_changed_);
+}
+
+TEST_F(BitmapFetcherServiceTest, ObserverCancelsRequestDuringNotification) {
+  BitmapFetcherService::RequestId other_request_id = service_->RequestImage(
+      url2_, new TestObserver(this), TRAFFIC_ANNOTATION_FOR_TESTS);
+  service_->RequestImage(
+      url1_, new CancellingObserver(this, service_.get(), other_request_id),
+      TRAFFIC_ANNOTATION_FOR_TESTS);
+  FillRequests(url1_);
+  int url1_requests = static_cast<int>(requests_size()) - 1;
+
+  // Another request for the same image has to wait.
+  service_->RequestImage(url1_, new TestObserver(this),
+                         TRAFFIC_ANNOTATION_FOR_TESTS);
+  EXPECT_EQ(1U, queued_requests_size());
+
+  // The cancellation starts the queued request while the fetcher is notifying
+  // its requests. It is answered from the cache rather than being attached to
+  // the finished fetcher.
+  CompleteFetch(url1_);
+  EXPECT_EQ(url1_requests + 1, images_changed_);
+  EXPECT_EQ(url1_requests + 2, requests_finished_);
+  EXPECT_EQ(0U, queued_requests_size());
+  EXPECT_EQ(0U, requests_size());
+  EXPECT_FALSE(service_->FindFetcherForUrl(url1_));
+}
+
+TEST_F(BitmapFetcherServiceTest, ImagesAreReadFromDiskCache) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  SetDiskCache(temp_dir.GetPath());
+
+  // The first request looks on disk, then downloads the image.
+  service_->RequestImage(url1_, new TestObserver(this),
+                         TRAFFIC_ANNOTATION_FOR_TESTS);
+  EXPECT_EQ(0U, active_fetchers_size());
+  base::RunLoop().RunUntilIdle();
+  EXPECT_EQ(1U, active_fetchers_size());
+  CompleteFetch(url1_);
+  base::RunLoop().RunUntilIdle();
+  EXPECT_EQ(1, images_changed_);
+
+  // A new service, as after a restart, finds the image on disk and never
+  // starts a fetcher for it.
+  RecreateService();
+  SetDiskCache(temp_dir.GetPath());
+  service_->RequestImage(url1_, new TestObserver(this),
+                         TRAFFIC_ANNOTATION_FOR_TESTS);
+  base::RunLoop().RunUntilIdle();
+  EXPECT_EQ(2, images_changed_);
+  EXPECT_EQ(2, requests_finished_);
+  EXPECT_EQ(0U, active_fetchers_size());
+
+  // The image was promoted to the memory cache.
+  EXPECT_EQ(1U, cache_size());
+}
+
+TEST_F(BitmapFetcherServiceTest, ClearCacheDropsImages) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  SetDiskCache(temp_dir.GetPath());
+
+  service_->RequestImage(url1_, new TestObserver(this),
+                         TRAFFIC_ANNOTATION_FOR_TESTS);
+  base::RunLoop().RunUntilIdle();
+  CompleteFetch(url1_);
+  base::RunLoop().RunUntilIdle();
+  EXPECT_EQ(1U, cache_size());
+
+  // Once the cache is cleared, the image is neither in memory nor on disk, so
+  // it is downloaded again.
+  service_->ClearCache();
+  EXPECT_EQ(0U, cache_size());
+  EXPECT_EQ(0U, service_->cache_bytes());
+  service_->RequestImage(url1_, new TestObserver(this),
+                         TRAFFIC_ANNOTATION_FOR_TESTS);
+  base::RunLoop().RunUntilIdle();
+  EXPECT_EQ(1, images_changed_);
+  EXPECT_TRUE(service_->FindFetcherForUrl(url1_));
+}
+
+TEST_F(BitmapFetcherServiceTest, CancelRequestWaitingForDiskCache) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  SetDiskCache(temp_dir.GetPath());
+
+  BitmapFetcherService::RequestId request_id = service_->RequestImage(
+      url1_, new TestObserver(this), TRAFFIC_ANNOTATION_FOR_TESTS);
+  service_->CancelRequest(request_id);
+  EXPECT_EQ(1, requests_finished_);
+  EXPECT_EQ(0U, requests_size());
+
+  // The image is still downloaded to populate the cache.
+  base::RunLoop().RunUntilIdle();
+  EXPECT_EQ(1U, active_fetchers_size());
+  CompleteFetch(url1_);
+  EXPECT_EQ(0, images_changed_);
+}
+
+TEST_F(BitmapFetcherServiceTest, ImagesAreCachedPerSizeBucket) {
+  const BitmapFetcherService::RequestPriority kVisible =
+      BitmapFetcherService::RequestPriority::VISIBLE;
+
+  // Requests for the same URL share a fetcher, which decodes the image at the
+  // largest size asked for, rounded up to a power of two.
+  service_->RequestImage(url1_, gfx::Size(20, 30), new TestObserver(this),
+                         kVisible, TRAFFIC_ANNOTATION_FOR_TESTS);
+  EXPECT_EQ(gfx::Size(32, 32),
+            service_->FindFetcherForUrl(url1_)->desired_size());
+  service_->RequestImage(url1_, gfx::Size(50, 10), new TestObserver(this),
+                         kVisible, TRAFFIC_ANNOTATION_FOR_TESTS);
+  EXPECT_EQ(1U, active_fetchers_size());
+  EXPECT_EQ(gfx::Size(64, 64),
+            service_->FindFetcherForUrl(url1_)->desired_size());
+
+  CompleteFetch(url1_);
+  EXPECT_EQ(2, images_changed_);
+  EXPECT_EQ(1U, cache_size());
+
+  // The image serves requests in the same size bucket.
+  EXPECT_EQ(BitmapFetcherService::REQUEST_ID_INVALID,
+            service_->RequestImage(url1_, gfx::Size(60, 60),
+                                   new TestObserver(this), kVisible,
+                                   TRAFFIC_ANNOTATION_FOR_TESTS));
+  EXPECT_EQ(1, service_->cache_hit_count());
+
+  // Other sizes are fetched separately.
+  EXPECT_NE(BitmapFetcherService::REQUEST_ID_INVALID,
+            service_->RequestImage(url1_, gfx::Size(20, 20),
+                                   new TestObserver(this), kVisible,
+                                   TRAFFIC_ANNOTATION_FOR_TESTS));
+  EXPECT_EQ(gfx::Size(32, 32),
+            service_->FindFetcherForUrl(url1_)->desired_size());
+
+  // A request for the full image removes the size limit.
+  service_->RequestImage(url1_, new TestObserver(this),
+                         TRAFFIC_ANNOTATION_FOR_TESTS);
+  EXPECT_TRUE(service_->FindFetcherForUrl(url1_)->desired_size().IsEmpty());
+  CompleteFetch(url1_);
+  EXPECT_EQ(2U, cache_size());
+  EXPECT_EQ(BitmapFetcherService::REQUEST_ID_INVALID,
+            service_->RequestImage(url1_, new TestObserver(this),
+                                   TRAFFIC_ANNOTATION_FOR_TESTS));
+}
+
+TEST_F(BitmapFetcherServiceTest, LargerRequestDuringDecodeIsFetchedAgain) {
+  const BitmapFetcherService::RequestPriority kVisible =
+      BitmapFetcherService::RequestPriority::VISIBLE;
+
+  // Once the download has completed, the image is decoded for the size
+  // requested so far.
+  service_->RequestImage(url1_, gfx::Size(16, 16), new TestObserver(this),
+                         kVisible, TRAFFIC_ANNOTATION_FOR_TESTS);
+  CompleteDownload(url1_);
+
+  // A request for the full image joins the fetcher, and a smaller one is
+  // served by the image being decoded.
+  service_->RequestImage(url1_, new TestObserver(this),
+                         TRAFFIC_ANNOTATION_FOR_TESTS);
+  service_->RequestImage(url1_, gfx::Size(8, 8), new TestObserver(this),
+                         kVisible, TRAFFIC_ANNOTATION_FOR_TESTS);
+  EXPECT_EQ(1U, active_fetchers_size());
+
+  // The decoded image is only given to, and cached for, the sizes it was
+  // decoded for. The full image is fetched again.
+  CompleteFetch(url1_);
+  EXPECT_EQ(2, images_changed_);
+  EXPECT_EQ(1U, cache_size());
+  EXPECT_EQ(BitmapFetcherService::REQUEST_ID_INVALID,
+            service_->RequestImage(url1_, gfx::Size(16, 16),
+                                   new TestObserver(this), kVisible,
+                                   TRAFFIC_ANNOTATION_FOR_TESTS));
+  EXPECT_EQ(3, images_changed_);
+  ASSERT_TRUE(service_->FindFetcherForUrl(url1_));
+  EXPECT_TRUE(service_->FindFetcherForUrl(url1_)->desired_size().IsEmpty());
+
+  CompleteFetch(url1_);
+  EXPECT_EQ(4, images_changed_);
+  EXPECT_EQ(2U, cache_size());
+}
+
+TEST_F(BitmapFetcherServiceTest, PrefetchImagesIsLimited) {
+  const size_t max_batch_prefetches =
+      BitmapFetcherService::GetMaxBatchPrefetchesForTesting();
+  std::vector<GURL> urls = CreateUrls(max_batch_prefetches + 2);
+  BitmapFetcherService::PrefetchBatchId batch_id = service_->PrefetchImages(
+      urls, gfx::Size(), TRAFFIC_ANNOTATION_FOR_TESTS);
+  EXPECT_NE(BitmapFetcherService::PREFETCH_BATCH_ID_INVALID, batch_id);
+  EXPECT_EQ(max_batch_prefetches, active_fetchers_size());
+
+  // Each finished download starts the next image of the batch.
+  CompleteFetch(urls[0]);
+  EXPECT_EQ(max_batch_prefetches, active_fetchers_size());
+  EXPECT_TRUE(service_->FindFetcherForUrl(urls[max_batch_prefetches]));
+  FailFetch(urls[1]);
+  EXPECT_TRUE(service_->FindFetcherForUrl(urls[max_batch_prefetches + 1]));
+
+  // Cached images and images being fetched are skipped.
+  service_->PrefetchImages({urls[0], urls[2]}, gfx::Size(),
+                           TRAFFIC_ANNOTATION_FOR_TESTS);
+  EXPECT_EQ(max_batch_prefetches, active_fetchers_size());
+  CompleteFetch(urls[2]);
+  EXPECT_EQ(max_batch_prefetches - 1, active_fetchers_size());
+}
+
+TEST_F(BitmapFetcherServiceTest, PrefetchImagesWaitsForQueuedRequests) {
+  FillRequests(url1_);
+  service_->RequestImage(url2_, new TestObserver(this),
+                         TRAFFIC_ANNOTATION_FOR_TESTS);
+  EXPECT_EQ(1U, queued_requests_size());
+
+  const GURL url3("http://example.org/sample-image-3.png");
+  service_->PrefetchImages({url3}, gfx::Size(), TRAFFIC_ANNOTATION_FOR_TESTS);
+  EXPECT_FALSE(service_->FindFetcherForUrl(url3));
+
+  // The batch starts once the queued request has been started.
+  CompleteFetch(url1_);
+  EXPECT_TRUE(service_->FindFetcherForUrl(url2_));
+  EXPECT_TRUE(service_->FindFetcherForUrl(url3));
+}
+
+TEST_F(BitmapFetcherServiceTest, CancelPrefetchImages) {
+  const size_t max_batch_prefetches =
+      BitmapFetcherService::GetMaxBatchPrefetchesForTesting();
+  std::vector<GURL> urls = CreateUrls(max_batch_prefetches + 2);
+  BitmapFetcherService::PrefetchBatchId batch_id = service_->PrefetchImages(
+      urls, gfx::Size(), TRAFFIC_ANNOTATION_FOR_TESTS);
+  service_->RequestImage(urls[0], new TestObserver(this),
+                         TRAFFIC_ANNOTATION_FOR_TESTS);
+  EXPECT_EQ(max_batch_prefetches, active_fetchers_size());
+
+  // Downloads nobody waits for are stopped, and the rest of the batch never
+  // starts.
+  service_->CancelPrefetchImages(batch_id);
+  EXPECT_EQ(1U, active_fetchers_size());
+  EXPECT_TRUE(service_->FindFetcherForUrl(urls[0]));
+
+  CompleteFetch(urls[0]);
+  EXPECT_EQ(1, images_changed_);
+  EXPECT_EQ(0U, active_fetchers_size());
+}
+
+TEST_F(BitmapFetcherServiceTest, CancelPrefetchImagesKeepsSharedDownloads) {
+  std::vector<GURL> urls = CreateUrls(2);
+  BitmapFetcherService::PrefetchBatchId batch_id = service_->PrefetchImages(
+      urls, gfx::Size(), TRAFFIC_ANNOTATION_FOR_TESTS);
+  EXPECT_EQ(2U, active_fetchers_size());
+
+  // The downloads are also asked for by a prefetch, and by another batch.
+  service_->Prefetch(urls[0], TRAFFIC_ANNOTATION_FOR_TESTS);
+  service_->PrefetchImages({urls[1]}, gfx::Size(),
+                           TRAFFIC_ANNOTATION_FOR_TESTS);
+  EXPECT_EQ(2U, active_fetchers_size());
+
+  // Cancelling the batch which started them leaves both of them running.
+  service_->CancelPrefetchImages(batch_id);
+  EXPECT_EQ(2U, active_fetchers_size());
+
+  CompleteFetch(urls[0]);
+  CompleteFetch(urls[1]);
+  EXPECT_EQ(2U, cache_size());
+}
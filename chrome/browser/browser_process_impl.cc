@@ -371,6 +371,10 @@ void BrowserProcessImpl::StartTearDown() {
     webrtc_log_uploader_->StartShutdown();
 #endif
 
+  // The icon usage is written to local state lazily.
+  if (icon_manager_)
+    icon_manager_->WriteUsage();
+
   if (local_state())
     local_state()->CommitPendingWrite();
 }
@@ -1119,6 +1123,10 @@ void BrowserProcessImpl::PreMainMessageLoopRun() {
 
   platform_part_->PreMainMessageLoopRun();
 
+#if !defined(OS_ANDROID)
+  icon_manager()->WarmUpCacheAfterStartup();
+#endif
+
   if (base::FeatureList::IsEnabled(network_time::kNetworkTimeServiceQuerying)) {
     network_time_tracker_.reset(new network_time::NetworkTimeTracker(
         base::WrapUnique(new base::DefaultClock()),
@@ -1130,7 +1138,7 @@ void BrowserProcessImpl::PreMainMessageLoopRun() {
 void BrowserProcessImpl::CreateIconManager() {
   DCHECK(!created_icon_manager_ && !icon_manager_);
   created_icon_manager_ = true;
-  icon_manager_.reset(new IconManager);
+  icon_manager_.reset(new IconManager(local_state()));
 }
 
 void BrowserProcessImpl::CreateIntranetRedirectDetector() {
@@ -0,0 +1,125 @@
+// Copyright 2017 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chrome/browser/budget_service/budget_chunk_queue.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "base/logging.h"
+
+namespace {
+
+// Most origins only hold a handful of chunks, since budget is awarded at most
+// once an hour and expires after a few days.
+constexpr size_t kInitialCapacity = 4;
+
+}  // namespace
+
+BudgetChunkQueue::Chunk::Chunk() : amount(0) {}
+
+BudgetChunkQueue::Chunk::Chunk(double amount, base::Time expiration)
+    : amount(amount), expiration(expiration) {}
+
+BudgetChunkQueue::BudgetChunkQueue() : head_(0), size_(0), total_(0) {}
+
+BudgetChunkQueue::BudgetChunkQueue(BudgetChunkQueue&& other)
+    : buffer_(std::move(other.buffer_)),
+      head_(other.head_),
+      size_(other.size_),
+      total_(other.total_) {
+  other.buffer_.clear();
+  other.head_ = 0;
+  other.size_ = 0;
+  other.total_ = 0;
+}
+
+BudgetChunkQueue& BudgetChunkQueue::operator=(BudgetChunkQueue&& other) {
+  buffer_ = std::move(other.buffer_);
+  head_ = other.head_;
+  size_ = other.size_;
+  total_ = other.total_;
+  other.buffer_.clear();
+  other.head_ = 0;
+  other.size_ = 0;
+  other.total_ = 0;
+  return *this;
+}
+
+BudgetChunkQueue::~BudgetChunkQueue() {}
+
+const BudgetChunkQueue::Chunk& BudgetChunkQueue::operator[](
+    size_t index) const {
+  DCHECK_LT(index, size_);
+  return buffer_[(head_ + index) % buffer_.size()];
+}
+
+BudgetChunkQueue::Chunk& BudgetChunkQueue::at(size_t index) {
+  DCHECK_LT(index, size_);
+  return buffer_[(head_ + index) % buffer_.size()];
+}
+
+void BudgetChunkQueue::emplace_back(double amount, base::Time expiration) {
+  if (size_ == buffer_.size())
+    Grow();
+  buffer_[(head_ + size_) % buffer_.size()] = Chunk(amount, expiration);
+  ++size_;
+  total_ += amount;
+}
+
+void BudgetChunkQueue::pop_front() {
+  DCHECK(!empty());
+  total_ -= buffer_[head_].amount;
+  head_ = (head_ + 1) % buffer_.size();
+  --size_;
+
+  // Avoid accumulating rounding errors once all of the budget is gone.
+  if (empty()) {
+    head_ = 0;
+    total_ = 0;
+  }
+}
+
+void BudgetChunkQueue::RemoveExpired(base::Time now) {
+  // This relies on the chunks being in timestamp order.
+  while (!empty() && front().expiration <= now)
+    pop_front();
+}
+
+bool BudgetChunkQueue::Spend(double amount) {
+  if (total_ < amount)
+    return false;
+
+  // Walk the chunks and remove enough budget to cover the needed amount.
+  double bill = amount;
+  while (!empty()) {
+    Chunk& chunk = at(0);
+    if (chunk.amount > bill) {
+      chunk.amount -= bill;
+      total_ -= bill;
+      bill = 0;
+      break;
+    }
+    bill -= chunk.amount;
+    pop_front();
+  }
+
+  // There should have been enough budget to cover the entire bill.
+  DCHECK_EQ(0, bill);
+  return true;
+}
+
+size_t BudgetChunkQueue::EstimateMemoryUsage() const {
+  return buffer_.capacity() * sizeof(Chunk);
+}
+
+void BudgetChunkQueue::Grow() {
+  // Copy the chunks into a larger buffer, unwrapping them so that the soonest
+  // expiring chunk is at the start.
+  std::vector<Chunk> buffer(std::max(kInitialCapacity, buffer_.size() * 2));
+  for (size_t i = 0; i < size_; ++i)
+    buffer[i] = (*this)[i];
+  buffer_.swap(buffer);
+  head_ = 0;
+}
@@ -0,0 +1,104 @@
+// Copyright 2017 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROME_BROWSER_BUDGET_SERVICE_BUDGET_CHUNK_QUEUE_H_
+#define CHROME_BROWSER_BUDGET_SERVICE_BUDGET_CHUNK_QUEUE_H_
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "base/macros.h"
+#include "base/time/time.h"
+
+// Holds the chunks of budget awarded to an origin, soonest expiring first.
+// Chunks are stored in a contiguous ring buffer, and the total amount of
+// budget is kept up to date as chunks are added, spent and removed, so that
+// reading it doesn't need to walk the chunks.
+class BudgetChunkQueue {
+ public:
+  // An individual piece of awarded budget.
+  struct Chunk {
+    Chunk();
+    Chunk(double amount, base::Time expiration);
+
+    double amount;
+    base::Time expiration;
+  };
+
+  class const_iterator {
+   public:
+    const_iterator(const BudgetChunkQueue* queue, size_t index)
+        : queue_(queue), index_(index) {}
+
+    const Chunk& operator*() const { return (*queue_)[index_]; }
+    const Chunk* operator->() const { return &(*queue_)[index_]; }
+    const_iterator& operator++() {
+      ++index_;
+      return *this;
+    }
+    bool operator==(const const_iterator& other) const {
+      return queue_ == other.queue_ && index_ == other.index_;
+    }
+    bool operator!=(const const_iterator& other) const {
+      return !(*this == other);
+    }
+
+   private:
+    const BudgetChunkQueue* queue_;
+    size_t index_;
+  };
+
+  BudgetChunkQueue();
+  BudgetChunkQueue(BudgetChunkQueue&& other);
+  BudgetChunkQueue& operator=(BudgetChunkQueue&& other);
+  ~BudgetChunkQueue();
+
+  bool empty() const { return size_ == 0; }
+  size_t size() const { return size_; }
+
+  // The sum of the amounts of all chunks.
+  double total() const { return total_; }
+
+  // The |index|th soonest expiring chunk.
+  const Chunk& operator[](size_t index) const;
+  const Chunk& front() const { return (*this)[0]; }
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, size_); }
+
+  // Adds a chunk at the back of the queue. Chunks are expected to be added in
+  // expiration order, which holds as long as the clock doesn't move backwards.
+  void emplace_back(double amount, base::Time expiration);
+
+  // Removes the soonest expiring chunk.
+  void pop_front();
+
+  // Removes all of the chunks at the front of the queue which expire at or
+  // before |now|.
+  void RemoveExpired(base::Time now);
+
+  // Removes |amount| of budget, starting with the soonest expiring chunks.
+  // Returns false without changing anything if there isn't enough budget.
+  bool Spend(double amount);
+
+  // The number of bytes of heap memory used for the chunks.
+  size_t EstimateMemoryUsage() const;
+
+ private:
+  Chunk& at(size_t index);
+
+  // Grows the buffer so that it can hold at least one more chunk.
+  void Grow();
+
+  // Ring buffer of chunks. The soonest expiring chunk is at |head_|.
+  std::vector<Chunk> buffer_;
+  size_t head_;
+  size_t size_;
+  double total_;
+
+  DISALLOW_COPY_AND_ASSIGN(BudgetChunkQueue);
+};
+
+#endif  // CHROME_BROWSER_BUDGET_SERVICE_BUDGET_CHUNK_QUEUE_H_
@@ -0,0 +1,125 @@
+// Copyright 2017 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stddef.h>
+
+#include <list>
+#include <string>
+
+#include "base/time/time.h"
+#include "chrome/browser/budget_service/budget_chunk_queue.h"
+#include "testing/gtest/include/gtest/gtest.h"
+#include "testing/perf/perf_test.h"
+
+namespace {
+
+// Budget is awarded at most once an hour and expires after four days, so an
+// origin which is active every hour holds this many chunks.
+constexpr int kChunksPerOrigin = 96;
+
+// The number of simulated hours of budget activity.
+constexpr int kIterations = 100000;
+
+// The budget is checked, spent and expired this many times per award.
+constexpr int kOperationsPerAward = 4;
+
+// The list based storage that BudgetDatabase used before BudgetChunkQueue,
+// including the linear walks needed to total and spend the budget.
+class ListBudgetChunks {
+ public:
+  struct Chunk {
+    Chunk(double amount, base::Time expiration)
+        : amount(amount), expiration(expiration) {}
+
+    double amount;
+    base::Time expiration;
+  };
+
+  void emplace_back(double amount, base::Time expiration) {
+    chunks_.emplace_back(amount, expiration);
+  }
+
+  double total() const {
+    double total = 0;
+    for (const Chunk& chunk : chunks_)
+      total += chunk.amount;
+    return total;
+  }
+
+  void RemoveExpired(base::Time now) {
+    auto iter = chunks_.begin();
+    while (iter != chunks_.end() && iter->expiration <= now)
+      iter = chunks_.erase(iter);
+  }
+
+  bool Spend(double amount) {
+    if (total() < amount)
+      return false;
+    double bill = amount;
+    for (auto iter = chunks_.begin(); iter != chunks_.end();) {
+      if (iter->amount > bill) {
+        iter->amount -= bill;
+        break;
+      }
+      bill -= iter->amount;
+      iter = chunks_.erase(iter);
+    }
+    return true;
+  }
+
+  size_t EstimateMemoryUsage() const {
+    // Each node holds the chunk and two pointers, in a separate allocation.
+    return chunks_.size() * (sizeof(Chunk) + 2 * sizeof(void*));
+  }
+
+ private:
+  std::list<Chunk> chunks_;
+};
+
+// Simulates an origin which is awarded budget every hour, checks its budget
+// and spends a little of it, with chunks expiring after kChunksPerOrigin
+// hours.
+template <typename Chunks>
+void RunBudgetChunksBenchmark(const std::string& trace) {
+  Chunks chunks;
+  base::Time now = base::Time::UnixEpoch();
+  const base::TimeDelta lifetime = base::TimeDelta::FromHours(kChunksPerOrigin);
+
+  // Fill the chunks so that the benchmark runs at steady state.
+  for (int i = 0; i < kChunksPerOrigin; ++i) {
+    now += base::TimeDelta::FromHours(1);
+    chunks.emplace_back(1.0, now + lifetime);
+  }
+
+  double total = 0;
+  base::TimeTicks start = base::TimeTicks::Now();
+  for (int i = 0; i < kIterations; ++i) {
+    now += base::TimeDelta::FromHours(1);
+    chunks.emplace_back(1.0, now + lifetime);
+    for (int j = 0; j < kOperationsPerAward; ++j) {
+      chunks.RemoveExpired(now);
+      total += chunks.total();
+      chunks.Spend(0.01);
+    }
+  }
+  base::TimeDelta elapsed = base::TimeTicks::Now() - start;
+
+  EXPECT_GT(total, 0);
+  perf_test::PrintResult(
+      "budget_chunks", "", trace + "_time_per_operation",
+      elapsed.InMicrosecondsF() / (kIterations * kOperationsPerAward), "us",
+      true);
+  perf_test::PrintResult("budget_chunks", "", trace + "_memory_per_origin",
+                         chunks.EstimateMemoryUsage(), "bytes", true);
+}
+
+}  // namespace
+
+TEST(BudgetChunkQueuePerfTest, List) {
+  RunBudgetChunksBenchmark<ListBudgetChunks>("list");
+}
+
+TEST(BudgetChunkQueuePerfTest, RingBuffer) {
+  RunBudgetChunksBenchmark<BudgetChunkQueue>("ring_buffer");
+}
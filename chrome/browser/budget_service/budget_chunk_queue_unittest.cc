@@ -0,0 +1,76 @@
+// Copyright 2017 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chrome/browser/budget_service/budget_chunk_queue.h"
+
+#include <utility>
+
+#include "base/time/time.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace {
+
+base::Time TimeAtDay(int day) {
+  return base::Time::UnixEpoch() + base::TimeDelta::FromDays(day);
+}
+
+}  // namespace
+
+TEST(BudgetChunkQueueTest, AddAndExpire) {
+  BudgetChunkQueue queue;
+  EXPECT_TRUE(queue.empty());
+  EXPECT_EQ(0, queue.total());
+
+  // Add enough chunks to wrap around and grow the buffer several times.
+  for (int day = 1; day <= 10; ++day)
+    queue.emplace_back(day, TimeAtDay(day));
+  EXPECT_EQ(10U, queue.size());
+  EXPECT_DOUBLE_EQ(55, queue.total());
+
+  // Chunks which expire at or before the given time are removed.
+  queue.RemoveExpired(TimeAtDay(3));
+  ASSERT_EQ(7U, queue.size());
+  EXPECT_DOUBLE_EQ(49, queue.total());
+  EXPECT_EQ(4, queue.front().amount);
+
+  // Wrap the ring buffer and check that iteration stays in order.
+  queue.emplace_back(11, TimeAtDay(11));
+  queue.emplace_back(12, TimeAtDay(12));
+  int expected_day = 4;
+  for (const auto& chunk : queue) {
+    EXPECT_EQ(expected_day, chunk.amount);
+    EXPECT_EQ(TimeAtDay(expected_day), chunk.expiration);
+    ++expected_day;
+  }
+  EXPECT_EQ(13, expected_day);
+
+  queue.RemoveExpired(TimeAtDay(12));
+  EXPECT_TRUE(queue.empty());
+  EXPECT_EQ(0, queue.total());
+}
+
+TEST(BudgetChunkQueueTest, Spend) {
+  BudgetChunkQueue queue;
+  queue.emplace_back(2, TimeAtDay(1));
+  queue.emplace_back(3, TimeAtDay(2));
+  queue.emplace_back(4, TimeAtDay(3));
+
+  // Spending more than the total doesn't change anything.
+  EXPECT_FALSE(queue.Spend(10));
+  EXPECT_EQ(3U, queue.size());
+  EXPECT_DOUBLE_EQ(9, queue.total());
+
+  // Spending is taken from the soonest expiring chunks first.
+  EXPECT_TRUE(queue.Spend(3));
+  ASSERT_EQ(2U, queue.size());
+  EXPECT_DOUBLE_EQ(2, queue.front().amount);
+  EXPECT_DOUBLE_EQ(6, queue.total());
+
+  // Spending exactly the remaining budget empties the queue.
+  BudgetChunkQueue moved(std::move(queue));
+  EXPECT_TRUE(queue.empty());
+  EXPECT_TRUE(moved.Spend(6));
+  EXPECT_TRUE(moved.empty());
+  EXPECT_EQ(0, moved.total());
+}
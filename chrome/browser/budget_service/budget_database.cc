@@ -4,8 +4,17 @@
 
 #include "chrome/browser/budget_service/budget_database.h"
 
+#include <algorithm>
+
+#include "base/callback_helpers.h"
+#include "base/feature_list.h"
+#include "base/logging.h"
+#include "base/macros.h"
+#include "base/memory/ref_counted.h"
 #include "base/memory/ptr_util.h"
+#include "base/metrics/field_trial_params.h"
 #include "base/metrics/histogram_macros.h"
+#include "base/threading/thread_task_runner_handle.h"
 #include "base/time/clock.h"
 #include "base/time/default_clock.h"
 #include "chrome/browser/budget_service/budget.pb.h"
@@ -13,6 +22,8 @@
 #include "chrome/browser/engagement/site_engagement_service.h"
 #include "chrome/browser/profiles/profile.h"
 #include "components/leveldb_proto/proto_database_impl.h"
+#include "components/pref_registry/pref_registry_syncable.h"
+#include "components/prefs/pref_service.h"
 #include "content/public/browser/browser_thread.h"
 #include "url/gurl.h"
 #include "url/origin.h"
@@ -35,35 +46,190 @@ constexpr int kBudgetDurationInDays = 4;
 // various actions.
 constexpr double kMaximumHourlyBudget = 12.0 / 24.0;
 
-}  // namespace
+// The engagement score of an origin is cached for this long. Increases in
+// engagement invalidate the cached score straight away, but decay and resets
+// of the score aren't announced, so the cached value is refreshed every few
+// hours. Engagement decays over days, so this bounds the error to a small
+// fraction of an award.
+constexpr int kEngagementScoreCacheHours = 6;
+
+// Enables coalescing of budget writes. The parameters below tune how long
+// changes may stay in the cache only.
+const base::Feature kBudgetWriteBehindFeature{
+    "BudgetWriteBehind", base::FEATURE_DISABLED_BY_DEFAULT};
+
+// Whether callbacks wait for the coalesced write. Either "coalesced" or
+// "cache_only".
+const char kDurabilityParam[] = "durability";
+const char kFlushDelayMsParam[] = "flush_delay_ms";
+const char kMaxDirtyOriginsParam[] = "max_dirty_origins";
+
+constexpr int kDefaultFlushDelayMs = 5000;
+constexpr int kDefaultMaxDirtyOrigins = 50;
+
+// Limits the memory used by the budget cache. The limit can be changed with
+// the max_bytes parameter.
+const base::Feature kBudgetCacheLimitFeature{"BudgetCacheLimit",
+                                             base::FEATURE_ENABLED_BY_DEFAULT};
+const char kMaxCacheBytesParam[] = "max_bytes";
+constexpr int kDefaultMaxCacheBytes = 1024 * 1024;
+
+// Loads the whole budget database into the cache once startup is complete.
+const base::Feature kBudgetCacheWarmUpFeature{
+    "BudgetCacheWarmUp", base::FEATURE_DISABLED_BY_DEFAULT};
+
+// Periodically removes expired budget for origins which aren't accessed.
+const base::Feature kBudgetExpirySweepFeature{"BudgetExpirySweep",
+                                              base::FEATURE_ENABLED_BY_DEFAULT};
+
+// How often the expired budget sweep runs, and how many entries each of its
+// database writes may contain.
+constexpr int kSweepIntervalHours = 24;
+constexpr size_t kSweepBatchSize = 100;
+
+// The time of the last sweep, so that restarts don't sweep again before the
+// interval has passed.
+const char kLastSweepTimePref[] = "budget_service.last_sweep_time";
+
+// A sweep which is due at startup waits this long, so that it doesn't compete
+// with the first use of the browser.
+constexpr int kMinSweepDelayMinutes = 10;
+
+// The number of legacy entries, stored without their origin, that a sweep
+// looks for by reading origins one at a time.
+constexpr size_t kMaxLegacyProbesPerSweep = 100;
 
-BudgetDatabase::BudgetInfo::BudgetInfo() {}
+// Failed writes are retried with exponential backoff, starting at this delay.
+// After kMaxWriteRetries consecutive failures, dirty origins are only retried
+// with the next flush.
+constexpr int kInitialWriteRetryDelayMs = 1000;
+constexpr int kMaxWriteRetries = 5;
 
-BudgetDatabase::BudgetInfo::BudgetInfo(const BudgetInfo&& other)
-    : last_engagement_award(other.last_engagement_award) {
-  chunks = std::move(other.chunks);
+// A batch of uncached origins is loaded by reading the whole database when it
+// makes up at least 1/kLoadEntriesMinShare of the entries. Smaller batches
+// read each origin on its own.
+constexpr size_t kLoadEntriesMinShare = 4;
+
+void IgnoreStoreResult(bool success) {}
+
+// Approximates the memory used by a cache entry which is not accounted for by
+// the entry itself: a node in the map, one in the LRU list and the strings
+// held by both copies of the origin.
+size_t EstimateOriginMemoryUsage(const url::Origin& origin) {
+  constexpr size_t kNodeOverhead = 4 * sizeof(void*);
+  return 2 * (kNodeOverhead + sizeof(url::Origin) + origin.scheme().size() +
+              origin.host().size());
+}
+
+void RunStoreBudgetCallbacks(
+    const std::vector<base::Callback<void(bool success)>>& callbacks,
+    bool success) {
+  for (const auto& callback : callbacks)
+    callback.Run(success);
 }
 
+// Runs a callback once a number of loads have finished, with whether all of
+// them succeeded.
+class LoadBarrier : public base::RefCounted<LoadBarrier> {
+ public:
+  LoadBarrier(size_t load_count, const base::Callback<void(bool)>& callback)
+      : remaining_loads_(load_count), success_(true), callback_(callback) {
+    DCHECK_GT(load_count, 0u);
+  }
+
+  void DidLoad(bool success) {
+    success_ &= success;
+    if (--remaining_loads_ == 0)
+      callback_.Run(success_);
+  }
+
+ private:
+  friend class base::RefCounted<LoadBarrier>;
+  ~LoadBarrier() {}
+
+  size_t remaining_loads_;
+  bool success_;
+  base::Callback<void(bool)> callback_;
+
+  DISALLOW_COPY_AND_ASSIGN(LoadBarrier);
+};
+
+}  // namespace
+
+BudgetDatabase::BudgetInfo::BudgetInfo()
+    : engagement_score(0), in_lru(false), memory_usage(0) {}
+
+BudgetDatabase::BudgetInfo::BudgetInfo(BudgetInfo&& other)
+    : last_engagement_award(other.last_engagement_award),
+      chunks(std::move(other.chunks)),
+      engagement_score(other.engagement_score),
+      engagement_score_time(other.engagement_score_time),
+      lru_position(other.lru_position),
+      in_lru(other.in_lru),
+      memory_usage(other.memory_usage) {}
+
 BudgetDatabase::BudgetInfo::~BudgetInfo() {}
 
 BudgetDatabase::BudgetDatabase(
     Profile* profile,
     const base::FilePath& database_dir,
     const scoped_refptr<base::SequencedTaskRunner>& task_runner)
-    : profile_(profile),
+    : SiteEngagementObserver(SiteEngagementService::Get(profile)),
+      profile_(profile),
       db_(new leveldb_proto::ProtoDatabaseImpl<budget_service::Budget>(
           task_runner)),
+      cache_bytes_(0),
+      max_cache_bytes_(0),
+      cache_hit_count_(0),
+      cache_miss_count_(0),
+      known_entry_count_(0),
+      entry_count_known_(false),
       clock_(base::WrapUnique(new base::DefaultClock)),
+      durability_(Durability::WRITE_THROUGH),
+      max_dirty_origins_(0),
+      writes_since_flush_(0),
+      failed_write_count_(0),
+      sweep_reclaimed_bytes_(0),
+      sweep_in_progress_(false),
       weak_ptr_factory_(this) {
   db_->Init(kDatabaseUMAName, database_dir,
             base::Bind(&BudgetDatabase::OnDatabaseInit,
                        weak_ptr_factory_.GetWeakPtr()));
+
+  if (base::FeatureList::IsEnabled(kBudgetWriteBehindFeature)) {
+    std::string durability = base::GetFieldTrialParamValueByFeature(
+        kBudgetWriteBehindFeature, kDurabilityParam);
+    int flush_delay_ms = base::GetFieldTrialParamByFeatureAsInt(
+        kBudgetWriteBehindFeature, kFlushDelayMsParam, kDefaultFlushDelayMs);
+    int max_dirty_origins = base::GetFieldTrialParamByFeatureAsInt(
+        kBudgetWriteBehindFeature, kMaxDirtyOriginsParam,
+        kDefaultMaxDirtyOrigins);
+    SetDurability(durability == "cache_only" ? Durability::CACHE_ONLY
+                                             : Durability::COALESCED,
+                  base::TimeDelta::FromMilliseconds(flush_delay_ms),
+                  max_dirty_origins);
+  }
+
+  if (base::FeatureList::IsEnabled(kBudgetCacheLimitFeature)) {
+    SetMaxCacheSize(base::GetFieldTrialParamByFeatureAsInt(
+        kBudgetCacheLimitFeature, kMaxCacheBytesParam, kDefaultMaxCacheBytes));
+  }
+}
+
+BudgetDatabase::~BudgetDatabase() {
+  // Make sure that no coalesced changes are lost on shutdown.
+  FlushDirtyOrigins();
 }
 
-BudgetDatabase::~BudgetDatabase() {}
+// static
+void BudgetDatabase::RegisterProfilePrefs(
+    user_prefs::PrefRegistrySyncable* registry) {
+  registry->RegisterInt64Pref(kLastSweepTimePref, 0);
+}
 
 void BudgetDatabase::GetBudgetDetails(const url::Origin& origin,
                                       const GetBudgetCallback& callback) {
+  PinOrigins({origin});
   SyncCache(origin,
             base::Bind(&BudgetDatabase::GetBudgetAfterSync,
                        weak_ptr_factory_.GetWeakPtr(), origin, callback));
@@ -72,33 +238,402 @@ void BudgetDatabase::GetBudgetDetails(const url::Origin& origin,
 void BudgetDatabase::SpendBudget(const url::Origin& origin,
                                  double amount,
                                  const SpendBudgetCallback& callback) {
+  PinOrigins({origin});
   SyncCache(origin, base::Bind(&BudgetDatabase::SpendBudgetAfterSync,
                                weak_ptr_factory_.GetWeakPtr(), origin, amount,
                                callback));
 }
 
+bool BudgetDatabase::SpendCachedBudget(const url::Origin& origin,
+                                       double amount,
+                                       bool* success) {
+  if (!IsCached(origin))
+    return false;
+
+  UMA_HISTOGRAM_BOOLEAN("PushMessaging.BudgetCacheHit", true);
+  ++cache_hit_count_;
+
+  bool needs_write = UpdateCachedBudget(origin);
+  *success = SpendFromCache(origin, amount);
+
+  // The cache is already up to date, so the caller doesn't wait for the write.
+  if (*success || needs_write) {
+    ScheduleWrite(std::set<url::Origin>({origin}),
+                  base::Bind(&IgnoreStoreResult));
+  }
+
+  EvictIfNeeded();
+  return true;
+}
+
+void BudgetDatabase::GetBudgetDetailsForOrigins(
+    const std::vector<url::Origin>& origins,
+    const GetBudgetForOriginsCallback& callback) {
+  std::set<url::Origin> unique_origins(origins.begin(), origins.end());
+  PinOrigins(unique_origins);
+  SyncCacheForOrigins(
+      unique_origins,
+      base::Bind(&BudgetDatabase::GetBudgetForOriginsAfterSync,
+                 weak_ptr_factory_.GetWeakPtr(), origins, callback));
+}
+
+void BudgetDatabase::SpendBudgetForOrigins(
+    const OriginAmounts& spends,
+    const SpendBudgetForOriginsCallback& callback) {
+  std::set<url::Origin> unique_origins;
+  for (const auto& spend : spends)
+    unique_origins.insert(spend.first);
+  PinOrigins(unique_origins);
+  SyncCacheForOrigins(
+      unique_origins,
+      base::Bind(&BudgetDatabase::SpendBudgetForOriginsAfterSync,
+                 weak_ptr_factory_.GetWeakPtr(), spends, callback));
+}
+
+void BudgetDatabase::OnEngagementIncreased(content::WebContents* web_contents,
+                                           const GURL& url,
+                                           double score) {
+  auto iter = budget_map_.find(url::Origin(url));
+  if (iter != budget_map_.end())
+    iter->second.engagement_score_time = base::Time();
+}
+
 void BudgetDatabase::SetClockForTesting(std::unique_ptr<base::Clock> clock) {
   clock_ = std::move(clock);
 }
 
+void BudgetDatabase::SetDurability(Durability durability,
+                                   base::TimeDelta flush_delay,
+                                   size_t max_dirty_origins) {
+  durability_ = durability;
+  flush_delay_ = flush_delay;
+  max_dirty_origins_ = max_dirty_origins;
+
+  // Anything still pending was queued under the old policy.
+  FlushDirtyOrigins();
+}
+
+void BudgetDatabase::SetMaxCacheSize(size_t max_cache_bytes) {
+  max_cache_bytes_ = max_cache_bytes;
+  EvictIfNeeded();
+}
+
 void BudgetDatabase::OnDatabaseInit(bool success) {
-  // TODO(harkness): Consider caching the budget database now?
+  if (!success)
+    return;
+
+  // Don't compete with startup for the disk.
+  BrowserThread::PostAfterStartupTask(
+      FROM_HERE, base::ThreadTaskRunnerHandle::Get(),
+      base::Bind(&BudgetDatabase::OnStartupComplete,
+                 weak_ptr_factory_.GetWeakPtr()));
+}
+
+void BudgetDatabase::OnStartupComplete() {
+  if (base::FeatureList::IsEnabled(kBudgetCacheWarmUpFeature))
+    WarmUpCache();
+
+  if (base::FeatureList::IsEnabled(kBudgetExpirySweepFeature))
+    ScheduleSweep();
+}
+
+void BudgetDatabase::WarmUpCache() {
+  db_->LoadEntries(base::Bind(&BudgetDatabase::DidLoadEntriesForWarmUp,
+                              weak_ptr_factory_.GetWeakPtr()));
+}
+
+void BudgetDatabase::DidLoadEntriesForWarmUp(
+    bool success,
+    std::unique_ptr<std::vector<budget_service::Budget>> entries) {
+  if (!success)
+    return;
+
+  known_entry_count_ = entries->size();
+  entry_count_known_ = true;
+
+  std::set<url::Origin> expired_origins;
+  for (const budget_service::Budget& budget_proto : *entries) {
+    // Entries written before the origin was stored with the budget can't be
+    // matched to their origin. They're loaded on first access instead.
+    if (!budget_proto.has_origin())
+      continue;
+
+    // Origins which were loaded while the warm-up was in flight may have
+    // been updated since, so don't overwrite them.
+    url::Origin origin(GURL(budget_proto.origin()));
+    if (IsCached(origin))
+      continue;
+
+    StoreInCache(origin, budget_proto);
+    if (CleanupExpiredBudget(origin))
+      expired_origins.insert(origin);
+    else
+      TouchOrigin(origin);
+  }
+
+  UMA_HISTOGRAM_COUNTS_1000("PushMessaging.BudgetCacheWarmUpOrigins",
+                            budget_map_.size());
+
+  // Delete the fully expired origins in a single write.
+  if (!expired_origins.empty())
+    ScheduleWrite(expired_origins, base::Bind(&IgnoreStoreResult));
+
+  EvictIfNeeded();
+}
+
+void BudgetDatabase::ScheduleSweep() {
+  base::TimeDelta interval = base::TimeDelta::FromHours(kSweepIntervalHours);
+  base::Time last_sweep = base::Time::FromInternalValue(
+      profile_->GetPrefs()->GetInt64(kLastSweepTimePref));
+  base::TimeDelta delay = last_sweep + interval - clock_->Now();
+
+  // A last sweep in the future means that the clock was set back.
+  delay = std::min(delay, interval);
+  delay = std::max(delay, base::TimeDelta::FromMinutes(kMinSweepDelayMinutes));
+  sweep_timer_.Start(FROM_HERE, delay,
+                     base::Bind(&BudgetDatabase::RunScheduledSweep,
+                                base::Unretained(this)));
+}
+
+void BudgetDatabase::RunScheduledSweep() {
+  SweepExpiredBudget();
+  ScheduleSweep();
+}
+
+void BudgetDatabase::SweepExpiredBudget() {
+  if (sweep_in_progress_)
+    return;
+
+  // A sweep which fails is retried with the next one.
+  profile_->GetPrefs()->SetInt64(kLastSweepTimePref,
+                                 clock_->Now().ToInternalValue());
+
+  sweep_in_progress_ = true;
+  sweep_reclaimed_bytes_ = 0;
+  sweep_written_origins_.clear();
+  db_->LoadEntries(base::Bind(&BudgetDatabase::DidLoadEntriesForSweep,
+                              weak_ptr_factory_.GetWeakPtr()));
+}
+
+void BudgetDatabase::DidLoadEntriesForSweep(
+    bool success,
+    std::unique_ptr<std::vector<budget_service::Budget>> entries) {
+  if (!success) {
+    sweep_written_origins_.clear();
+    sweep_in_progress_ = false;
+    return;
+  }
+
+  known_entry_count_ = entries->size();
+  entry_count_known_ = true;
+
+  std::set<url::Origin> stored_origins;
+  bool has_legacy_entries = false;
+  for (const budget_service::Budget& budget_proto : *entries) {
+    if (!budget_proto.has_origin()) {
+      has_legacy_entries = true;
+      continue;
+    }
+
+    url::Origin origin(GURL(budget_proto.origin()));
+    stored_origins.insert(origin);
+    SweepEntry(origin, budget_proto);
+  }
+
+  if (!has_legacy_entries) {
+    WriteNextSweepBatch();
+    return;
+  }
+
+  // Entries written before the origin was stored with the budget can't be
+  // matched to their key, and the database can't list its keys. Instead, the
+  // origins with engagement are read individually, and any legacy entries
+  // found among them are swept and rewritten with their origin, so that later
+  // sweeps find them directly. Budget is awarded for engagement, so the most
+  // engaged origins are read first, and the reads are bounded. Legacy entries
+  // of other origins are rewritten when they are next loaded.
+  std::map<url::Origin, double> candidate_scores;
+  for (const auto& score : GetSiteEngagementService()->GetScoreMap()) {
+    url::Origin origin(score.first);
+    if (!stored_origins.count(origin) && !IsCached(origin)) {
+      double& candidate_score = candidate_scores[origin];
+      candidate_score = std::max(candidate_score, score.second);
+    }
+  }
+
+  std::vector<std::pair<double, url::Origin>> candidates;
+  for (const auto& candidate : candidate_scores)
+    candidates.push_back(std::make_pair(candidate.second, candidate.first));
+  size_t probe_count = std::min(candidates.size(), kMaxLegacyProbesPerSweep);
+  std::partial_sort(candidates.begin(), candidates.begin() + probe_count,
+                    candidates.end(),
+                    [](const std::pair<double, url::Origin>& a,
+                       const std::pair<double, url::Origin>& b) {
+                      return a.first > b.first;
+                    });
+  std::set<url::Origin> candidate_origins;
+  for (size_t i = 0; i < probe_count; ++i)
+    candidate_origins.insert(candidates[i].second);
+
+  if (candidate_origins.empty()) {
+    WriteNextSweepBatch();
+    return;
+  }
+
+  CacheCallback probe_callback = base::Bind(
+      &LoadBarrier::DidLoad,
+      make_scoped_refptr(new LoadBarrier(
+          candidate_origins.size(),
+          base::Bind(&BudgetDatabase::DidProbeLegacyEntriesForSweep,
+                     weak_ptr_factory_.GetWeakPtr()))));
+  for (const url::Origin& origin : candidate_origins) {
+    db_->GetEntry(
+        origin.Serialize(),
+        base::Bind(&BudgetDatabase::DidProbeLegacyEntryForSweep,
+                   weak_ptr_factory_.GetWeakPtr(), origin, probe_callback));
+  }
+}
+
+void BudgetDatabase::DidProbeLegacyEntryForSweep(
+    const url::Origin& origin,
+    const CacheCallback& callback,
+    bool success,
+    std::unique_ptr<budget_service::Budget> budget_proto) {
+  if (success && budget_proto && !budget_proto->has_origin())
+    SweepEntry(origin, *budget_proto);
+  callback.Run(success);
+}
+
+void BudgetDatabase::DidProbeLegacyEntriesForSweep(bool success) {
+  // Failed reads are retried by the next sweep.
+  WriteNextSweepBatch();
+}
+
+void BudgetDatabase::SweepEntry(const url::Origin& origin,
+                                const budget_service::Budget& budget_proto) {
+  // Cached origins are cleaned up on access, and origins written since the
+  // sweep started have newer values than |budget_proto|.
+  if (IsCached(origin) || sweep_written_origins_.count(origin))
+    return;
+
+  base::Time now = clock_->Now();
+  budget_service::Budget swept_budget;
+  for (const auto& chunk : budget_proto.budget()) {
+    if (base::Time::FromInternalValue(chunk.expiration()) > now)
+      *swept_budget.add_budget() = chunk;
+  }
+
+  // Legacy entries are rewritten even if nothing expired, to add the origin.
+  if (swept_budget.budget_size() == budget_proto.budget_size() &&
+      budget_proto.has_origin()) {
+    return;
+  }
+
+  // Mirror CleanupExpiredBudget: origins without budget or recent
+  // engagement are removed entirely.
+  base::Time engagement_cutoff =
+      now - base::TimeDelta::FromDays(kBudgetDurationInDays);
+  if (swept_budget.budget_size() == 0 &&
+      base::Time::FromInternalValue(budget_proto.engagement_last_updated()) <
+          engagement_cutoff) {
+    sweep_removals_.insert(origin);
+    sweep_reclaimed_bytes_ +=
+        budget_proto.ByteSize() + static_cast<int>(origin.Serialize().size());
+    return;
+  }
+
+  swept_budget.set_engagement_last_updated(
+      budget_proto.engagement_last_updated());
+  swept_budget.set_origin(origin.Serialize());
+  sweep_reclaimed_bytes_ += budget_proto.ByteSize() - swept_budget.ByteSize();
+  sweep_updates_[origin] = swept_budget;
+}
+
+void BudgetDatabase::WriteNextSweepBatch() {
+  std::unique_ptr<
+      leveldb_proto::ProtoDatabase<budget_service::Budget>::KeyEntryVector>
+      entries(new leveldb_proto::ProtoDatabase<
+              budget_service::Budget>::KeyEntryVector());
+  std::unique_ptr<std::vector<std::string>> keys_to_remove(
+      new std::vector<std::string>());
+
+  // Origins which have been loaded into the cache or written since the sweep
+  // read the database may have changed, so the newer values take precedence.
+  while (entries->size() + keys_to_remove->size() < kSweepBatchSize &&
+         !sweep_removals_.empty()) {
+    url::Origin origin = *sweep_removals_.begin();
+    sweep_removals_.erase(sweep_removals_.begin());
+    if (!IsSweepStale(origin))
+      keys_to_remove->push_back(origin.Serialize());
+  }
+  while (entries->size() + keys_to_remove->size() < kSweepBatchSize &&
+         !sweep_updates_.empty()) {
+    auto iter = sweep_updates_.begin();
+    if (!IsSweepStale(iter->first))
+      entries->push_back(std::make_pair(iter->first.Serialize(), iter->second));
+    sweep_updates_.erase(iter);
+  }
+
+  if (entries->empty() && keys_to_remove->empty()) {
+    // The deleted and rewritten records are reclaimed on disk by LevelDB's
+    // background compaction.
+    UMA_HISTOGRAM_COUNTS("PushMessaging.BudgetSweepReclaimedBytes",
+                         sweep_reclaimed_bytes_);
+    sweep_written_origins_.clear();
+    sweep_in_progress_ = false;
+    return;
+  }
+
+  db_->UpdateEntries(std::move(entries), std::move(keys_to_remove),
+                     base::Bind(&BudgetDatabase::DidWriteSweepBatch,
+                                weak_ptr_factory_.GetWeakPtr()));
+}
+
+void BudgetDatabase::DidWriteSweepBatch(bool success) {
+  // The next sweep will pick up anything which couldn't be written.
+  if (!success) {
+    sweep_updates_.clear();
+    sweep_removals_.clear();
+    sweep_written_origins_.clear();
+    sweep_in_progress_ = false;
+    return;
+  }
+
+  WriteNextSweepBatch();
 }
 
 bool BudgetDatabase::IsCached(const url::Origin& origin) const {
   return budget_map_.find(origin) != budget_map_.end();
 }
 
+bool BudgetDatabase::IsSweepStale(const url::Origin& origin) const {
+  return IsCached(origin) || pending_loads_.count(origin) ||
+         sweep_written_origins_.count(origin);
+}
+
+double BudgetDatabase::GetEngagementScore(const url::Origin& origin) {
+  // If the origin wasn't already in the map, this adds a new entry for it.
+  BudgetInfo& info = budget_map_[origin];
+  base::Time now = clock_->Now();
+  if (!info.engagement_score_time.is_null() &&
+      now >= info.engagement_score_time &&
+      now - info.engagement_score_time <
+          base::TimeDelta::FromHours(kEngagementScoreCacheHours)) {
+    return info.engagement_score;
+  }
+
+  info.engagement_score =
+      GetSiteEngagementService()->GetScore(origin.GetURL());
+  info.engagement_score_time = now;
+  return info.engagement_score;
+}
+
 double BudgetDatabase::GetBudget(const url::Origin& origin) const {
-  double total = 0;
   auto iter = budget_map_.find(origin);
   if (iter == budget_map_.end())
-    return total;
+    return 0;
 
-  const BudgetInfo& info = iter->second;
-  for (const BudgetChunk& chunk : info.chunks)
-    total += chunk.amount;
-  return total;
+  return iter->second.chunks.total();
 }
 
 void BudgetDatabase::AddToCache(
@@ -112,40 +647,80 @@ void BudgetDatabase::AddToCache(
     return;
   }
 
-  // If there were two simultaneous loads, don't overwrite the cache value,
-  // which might have been updated after the previous load.
+  // If the origin was also loaded by a batched load, don't overwrite the cache
+  // value, which might have been updated after the other load.
   if (IsCached(origin)) {
     callback.Run(success);
     return;
   }
 
+  StoreInCache(origin, *budget_proto);
+  callback.Run(success);
+}
+
+void BudgetDatabase::AddEntriesToCache(
+    const std::set<url::Origin>& origins,
+    bool success,
+    std::unique_ptr<std::vector<budget_service::Budget>> entries) {
+  if (!success) {
+    for (const url::Origin& origin : origins)
+      DidLoadOrigin(origin, false /* success */);
+    return;
+  }
+
+  known_entry_count_ = entries->size();
+  entry_count_known_ = true;
+
+  // Entries are matched back to their origin through the origin stored in the
+  // proto. Only the requested origins are cached, and as in AddToCache, an
+  // origin which was cached while the load was in flight is not overwritten.
+  std::set<url::Origin> unmatched_origins = origins;
+  bool has_legacy_entries = false;
+  for (const budget_service::Budget& budget_proto : *entries) {
+    if (!budget_proto.has_origin()) {
+      has_legacy_entries = true;
+      continue;
+    }
+    url::Origin origin(GURL(budget_proto.origin()));
+    if (!unmatched_origins.erase(origin) || IsCached(origin))
+      continue;
+    StoreInCache(origin, budget_proto);
+  }
+
+  // If every entry carried its origin, any unmatched origin simply has no
+  // stored budget. Otherwise, the unmatched origins are read individually,
+  // all at once.
+  for (const url::Origin& origin : origins) {
+    if (!has_legacy_entries || !unmatched_origins.count(origin)) {
+      DidLoadOrigin(origin, true /* success */);
+      continue;
+    }
+    db_->GetEntry(
+        origin.Serialize(),
+        base::Bind(&BudgetDatabase::AddToCache, weak_ptr_factory_.GetWeakPtr(),
+                   origin, base::Bind(&BudgetDatabase::DidLoadOrigin,
+                                      weak_ptr_factory_.GetWeakPtr(), origin)));
+  }
+}
+
+void BudgetDatabase::StoreInCache(const url::Origin& origin,
+                                  const budget_service::Budget& budget_proto) {
   // Add the data to the cache, converting from the proto format to an STL
   // format which is better for removing things from the list.
   BudgetInfo& info = budget_map_[origin];
-  for (const auto& chunk : budget_proto->budget()) {
+  for (const auto& chunk : budget_proto.budget()) {
     info.chunks.emplace_back(chunk.amount(),
                              base::Time::FromInternalValue(chunk.expiration()));
   }
 
   info.last_engagement_award =
-      base::Time::FromInternalValue(budget_proto->engagement_last_updated());
-
-  callback.Run(success);
+      base::Time::FromInternalValue(budget_proto.engagement_last_updated());
 }
 
-void BudgetDatabase::GetBudgetAfterSync(const url::Origin& origin,
-                                        const GetBudgetCallback& callback,
-                                        bool success) {
+std::vector<blink::mojom::BudgetStatePtr> BudgetDatabase::GetPredictions(
+    const url::Origin& origin) {
   std::vector<blink::mojom::BudgetStatePtr> predictions;
 
-  // If the database wasn't able to read the information, return the
-  // failure and an empty predictions array.
-  if (!success) {
-    callback.Run(blink::mojom::BudgetServiceErrorType::DATABASE_ERROR,
-                 std::move(predictions));
-    return;
-  }
-
   // Now, build up the BudgetExpection. This is different from the format
   // in which the cache stores the data. The cache stores chunks of budget and
   // when that budget expires. The mojo array describes a set of times
@@ -169,6 +744,46 @@ void BudgetDatabase::GetBudgetAfterSync(const url::Origin& origin,
     predictions.push_back(std::move(prediction));
   }
 
+  return predictions;
+}
+
+void BudgetDatabase::GetBudgetAfterSync(const url::Origin& origin,
+                                        const GetBudgetCallback& callback,
+                                        bool success) {
+  base::ScopedClosureRunner unpin(base::Bind(&BudgetDatabase::UnpinOrigins,
+                                             base::Unretained(this),
+                                             std::set<url::Origin>({origin})));
+
+  // If the database wasn't able to read the information, return the
+  // failure and an empty predictions array.
+  if (!success) {
+    callback.Run(blink::mojom::BudgetServiceErrorType::DATABASE_ERROR,
+                 std::vector<blink::mojom::BudgetStatePtr>());
+    return;
+  }
+
+  callback.Run(blink::mojom::BudgetServiceErrorType::NONE,
+               GetPredictions(origin));
+}
+
+void BudgetDatabase::GetBudgetForOriginsAfterSync(
+    const std::vector<url::Origin>& origins,
+    const GetBudgetForOriginsCallback& callback,
+    bool success) {
+  base::ScopedClosureRunner unpin(base::Bind(
+      &BudgetDatabase::UnpinOrigins, base::Unretained(this),
+      std::set<url::Origin>(origins.begin(), origins.end())));
+
+  std::vector<std::vector<blink::mojom::BudgetStatePtr>> predictions;
+  if (!success) {
+    callback.Run(blink::mojom::BudgetServiceErrorType::DATABASE_ERROR,
+                 std::move(predictions));
+    return;
+  }
+
+  for (const url::Origin& origin : origins)
+    predictions.push_back(GetPredictions(origin));
+
   callback.Run(blink::mojom::BudgetServiceErrorType::NONE,
                std::move(predictions));
 }
@@ -177,58 +792,94 @@ void BudgetDatabase::SpendBudgetAfterSync(const url::Origin& origin,
                                           double amount,
                                           const SpendBudgetCallback& callback,
                                           bool success) {
+  base::ScopedClosureRunner unpin(base::Bind(&BudgetDatabase::UnpinOrigins,
+                                             base::Unretained(this),
+                                             std::set<url::Origin>({origin})));
+
   if (!success) {
     callback.Run(blink::mojom::BudgetServiceErrorType::DATABASE_ERROR,
                  false /* success */);
     return;
   }
 
+  if (!SpendFromCache(origin, amount)) {
+    callback.Run(blink::mojom::BudgetServiceErrorType::NONE,
+                 false /* success */);
+    return;
+  }
+
+  // Now that the cache is updated, write the data to the database.
+  ScheduleWrite(std::set<url::Origin>({origin}),
+                base::Bind(&BudgetDatabase::SpendBudgetAfterWrite,
+                           weak_ptr_factory_.GetWeakPtr(), callback));
+}
+
+void BudgetDatabase::SpendBudgetForOriginsAfterSync(
+    const OriginAmounts& spends,
+    const SpendBudgetForOriginsCallback& callback,
+    bool success) {
+  std::set<url::Origin> unique_origins;
+  for (const auto& spend : spends)
+    unique_origins.insert(spend.first);
+  base::ScopedClosureRunner unpin(base::Bind(&BudgetDatabase::UnpinOrigins,
+                                             base::Unretained(this),
+                                             unique_origins));
+
+  if (!success) {
+    callback.Run(blink::mojom::BudgetServiceErrorType::DATABASE_ERROR,
+                 std::vector<bool>(spends.size(), false));
+    return;
+  }
+
+  std::vector<bool> spend_results;
+  std::set<url::Origin> spent_origins;
+  for (const auto& spend : spends) {
+    bool spent = SpendFromCache(spend.first, spend.second);
+    spend_results.push_back(spent);
+    if (spent)
+      spent_origins.insert(spend.first);
+  }
+
+  if (spent_origins.empty()) {
+    callback.Run(blink::mojom::BudgetServiceErrorType::NONE, spend_results);
+    return;
+  }
+
+  // Commit all of the spends in a single database write.
+  ScheduleWrite(
+      spent_origins,
+      base::Bind(&BudgetDatabase::SpendBudgetForOriginsAfterWrite,
+                 weak_ptr_factory_.GetWeakPtr(), callback, spend_results));
+}
+
+bool BudgetDatabase::SpendFromCache(const url::Origin& origin, double amount) {
   // Get the current SES score, to generate UMA.
-  SiteEngagementService* service = SiteEngagementService::Get(profile_);
-  double score = service->GetScore(origin.GetURL());
+  double score = GetEngagementScore(origin);
 
-  // Walk the list of budget chunks to see if the origin has enough budget.
-  double total = 0;
+  // Check whether the origin has enough budget.
   BudgetInfo& info = budget_map_[origin];
-  for (const BudgetChunk& chunk : info.chunks)
-    total += chunk.amount;
+  double total = info.chunks.total();
 
   if (total < amount) {
     UMA_HISTOGRAM_COUNTS_100("PushMessaging.SESForNoBudgetOrigin", score);
-    callback.Run(blink::mojom::BudgetServiceErrorType::NONE,
-                 false /* success */);
-    return;
+    return false;
   } else if (total < amount * 2) {
     UMA_HISTOGRAM_COUNTS_100("PushMessaging.SESForLowBudgetOrigin", score);
   }
 
-  // Walk the chunks and remove enough budget to cover the needed amount.
-  double bill = amount;
-  for (auto iter = info.chunks.begin(); iter != info.chunks.end();) {
-    if (iter->amount > bill) {
-      iter->amount -= bill;
-      bill = 0;
-      break;
-    }
-    bill -= iter->amount;
-    iter = info.chunks.erase(iter);
-  }
-
-  // There should have been enough budget to cover the entire bill.
-  DCHECK_EQ(0, bill);
-
-  // Now that the cache is updated, write the data to the database.
-  WriteCachedValuesToDatabase(
-      origin, base::Bind(&BudgetDatabase::SpendBudgetAfterWrite,
-                         weak_ptr_factory_.GetWeakPtr(), callback));
+  // Remove enough budget to cover the needed amount, starting with the soonest
+  // expiring chunks.
+  bool spent = info.chunks.Spend(amount);
+  DCHECK(spent);
+  return true;
 }
 
 // This converts the bool value which is returned from the database to a Mojo
 // error type.
 void BudgetDatabase::SpendBudgetAfterWrite(const SpendBudgetCallback& callback,
                                            bool write_successful) {
-  // TODO(harkness): If the database write fails, the cache will be out of sync
-  // with the database. Consider ways to mitigate this.
+  // A failed write is retried by DidWriteCachedValues, but the caller is still
+  // told that the spend wasn't stored.
   if (!write_successful) {
     callback.Run(blink::mojom::BudgetServiceErrorType::DATABASE_ERROR,
                  false /* success */);
@@ -237,8 +888,66 @@ void BudgetDatabase::SpendBudgetAfterWrite(const SpendBudgetCallback& callback,
   callback.Run(blink::mojom::BudgetServiceErrorType::NONE, true /* success */);
 }
 
+void BudgetDatabase::SpendBudgetForOriginsAfterWrite(
+    const SpendBudgetForOriginsCallback& callback,
+    const std::vector<bool>& spend_results,
+    bool write_successful) {
+  if (!write_successful) {
+    callback.Run(blink::mojom::BudgetServiceErrorType::DATABASE_ERROR,
+                 std::vector<bool>(spend_results.size(), false));
+    return;
+  }
+  callback.Run(blink::mojom::BudgetServiceErrorType::NONE, spend_results);
+}
+
+void BudgetDatabase::ScheduleWrite(const std::set<url::Origin>& origins,
+                                   const StoreBudgetCallback& callback) {
+  if (durability_ == Durability::WRITE_THROUGH) {
+    WriteCachedValuesToDatabase(origins, callback);
+    return;
+  }
+
+  dirty_origins_.insert(origins.begin(), origins.end());
+  ++writes_since_flush_;
+
+  if (durability_ == Durability::CACHE_ONLY)
+    callback.Run(true /* success */);
+  else
+    pending_write_callbacks_.push_back(callback);
+
+  if (dirty_origins_.size() >= max_dirty_origins_) {
+    FlushDirtyOrigins();
+    return;
+  }
+
+  if (!flush_timer_.IsRunning()) {
+    flush_timer_.Start(FROM_HERE, flush_delay_,
+                       base::Bind(&BudgetDatabase::FlushDirtyOrigins,
+                                  base::Unretained(this)));
+  }
+}
+
+void BudgetDatabase::FlushDirtyOrigins() {
+  flush_timer_.Stop();
+  if (dirty_origins_.empty())
+    return;
+
+  if (writes_since_flush_ > 0) {
+    UMA_HISTOGRAM_COUNTS_100("PushMessaging.BudgetCoalescedWrites",
+                             writes_since_flush_ - 1);
+  }
+  writes_since_flush_ = 0;
+
+  std::set<url::Origin> origins;
+  origins.swap(dirty_origins_);
+  std::vector<StoreBudgetCallback> callbacks;
+  callbacks.swap(pending_write_callbacks_);
+  WriteCachedValuesToDatabase(origins,
+                              base::Bind(&RunStoreBudgetCallbacks, callbacks));
+}
+
 void BudgetDatabase::WriteCachedValuesToDatabase(
-    const url::Origin& origin,
+    const std::set<url::Origin>& origins,
     const StoreBudgetCallback& callback) {
   // Create the data structures that are passed to the ProtoDatabase.
   std::unique_ptr<
@@ -248,44 +957,118 @@ void BudgetDatabase::WriteCachedValuesToDatabase(
   std::unique_ptr<std::vector<std::string>> keys_to_remove(
       new std::vector<std::string>());
 
+  // The origins can't be evicted until the write completes, as a failed write
+  // needs the cached values to retry.
+  PinOrigins(origins);
+
+  // A running sweep must not overwrite these origins with its older snapshot,
+  // even if they are evicted before the sweep gets to them.
+  if (sweep_in_progress_)
+    sweep_written_origins_.insert(origins.begin(), origins.end());
+
   // Each operation can either update the existing budget or remove the origin's
   // budget information.
-  if (IsCached(origin)) {
-    // Build the Budget proto object.
-    budget_service::Budget budget;
-    const BudgetInfo& info = budget_map_[origin];
-    for (const auto& chunk : info.chunks) {
-      budget_service::BudgetChunk* budget_chunk = budget.add_budget();
-      budget_chunk->set_amount(chunk.amount);
-      budget_chunk->set_expiration(chunk.expiration.ToInternalValue());
+  for (const url::Origin& origin : origins) {
+    if (IsCached(origin)) {
+      // Build the Budget proto object.
+      budget_service::Budget budget;
+      const BudgetInfo& info = budget_map_[origin];
+      for (const auto& chunk : info.chunks) {
+        budget_service::BudgetChunk* budget_chunk = budget.add_budget();
+        budget_chunk->set_amount(chunk.amount);
+        budget_chunk->set_expiration(chunk.expiration.ToInternalValue());
+      }
+      budget.set_engagement_last_updated(
+          info.last_engagement_award.ToInternalValue());
+      budget.set_origin(origin.Serialize());
+      entries->push_back(std::make_pair(origin.Serialize(), budget));
+    } else {
+      // If the origin doesn't exist in the cache, this is a remove operation.
+      keys_to_remove->push_back(origin.Serialize());
     }
-    budget.set_engagement_last_updated(
-        info.last_engagement_award.ToInternalValue());
-    entries->push_back(std::make_pair(origin.Serialize(), budget));
-  } else {
-    // If the origin doesn't exist in the cache, this is a remove operation.
-    keys_to_remove->push_back(origin.Serialize());
   }
 
   // Send the updates to the database.
-  db_->UpdateEntries(std::move(entries), std::move(keys_to_remove), callback);
+  db_->UpdateEntries(std::move(entries), std::move(keys_to_remove),
+                     base::Bind(&BudgetDatabase::DidWriteCachedValues,
+                                weak_ptr_factory_.GetWeakPtr(), origins,
+                                callback));
+}
+
+void BudgetDatabase::DidWriteCachedValues(const std::set<url::Origin>& origins,
+                                          const StoreBudgetCallback& callback,
+                                          bool success) {
+  base::ScopedClosureRunner unpin(base::Bind(
+      &BudgetDatabase::UnpinOrigins, base::Unretained(this), origins));
+
+  if (success) {
+    failed_write_count_ = 0;
+    callback.Run(success);
+    return;
+  }
+
+  // The cache still holds the correct values, so queue the origins to be
+  // written again rather than letting the database drift from the cache.
+  // Origins which were dirtied again since are already queued.
+  dirty_origins_.insert(origins.begin(), origins.end());
+  if (failed_write_count_ < kMaxWriteRetries && !flush_timer_.IsRunning()) {
+    flush_timer_.Start(
+        FROM_HERE,
+        base::TimeDelta::FromMilliseconds(kInitialWriteRetryDelayMs
+                                          << failed_write_count_),
+        base::Bind(&BudgetDatabase::FlushDirtyOrigins,
+                   base::Unretained(this)));
+  }
+  ++failed_write_count_;
+
+  callback.Run(success);
 }
 
 void BudgetDatabase::SyncCache(const url::Origin& origin,
                                const CacheCallback& callback) {
   // If the origin isn't already cached, add it to the cache.
-  if (!IsCached(origin)) {
-    CacheCallback add_callback =
-        base::Bind(&BudgetDatabase::SyncLoadedCache,
-                   weak_ptr_factory_.GetWeakPtr(), origin, callback);
-    db_->GetEntry(origin.Serialize(), base::Bind(&BudgetDatabase::AddToCache,
-                                                 weak_ptr_factory_.GetWeakPtr(),
-                                                 origin, add_callback));
+  bool is_cached = IsCached(origin);
+  UMA_HISTOGRAM_BOOLEAN("PushMessaging.BudgetCacheHit", is_cached);
+  if (!is_cached) {
+    ++cache_miss_count_;
+    LoadOrigin(origin,
+               base::Bind(&BudgetDatabase::SyncLoadedCache,
+                          weak_ptr_factory_.GetWeakPtr(), origin, callback));
     return;
   }
+  ++cache_hit_count_;
   SyncLoadedCache(origin, callback, true /* success */);
 }
 
+void BudgetDatabase::LoadOrigin(const url::Origin& origin,
+                                const CacheCallback& callback) {
+  // If the origin is already being loaded, wait for that load instead of
+  // reading it from the database again.
+  auto pending_load = pending_loads_.find(origin);
+  if (pending_load != pending_loads_.end()) {
+    pending_load->second.push_back(callback);
+    return;
+  }
+
+  pending_loads_[origin].push_back(callback);
+  db_->GetEntry(
+      origin.Serialize(),
+      base::Bind(&BudgetDatabase::AddToCache, weak_ptr_factory_.GetWeakPtr(),
+                 origin, base::Bind(&BudgetDatabase::DidLoadOrigin,
+                                    weak_ptr_factory_.GetWeakPtr(), origin)));
+}
+
+void BudgetDatabase::DidLoadOrigin(const url::Origin& origin, bool success) {
+  auto pending_load = pending_loads_.find(origin);
+  DCHECK(pending_load != pending_loads_.end());
+  std::vector<CacheCallback> callbacks;
+  callbacks.swap(pending_load->second);
+  pending_loads_.erase(pending_load);
+
+  for (const CacheCallback& callback : callbacks)
+    callback.Run(success);
+}
+
 void BudgetDatabase::SyncLoadedCache(const url::Origin& origin,
                                      const CacheCallback& callback,
                                      bool success) {
@@ -294,16 +1077,96 @@ void BudgetDatabase::SyncLoadedCache(const url::Origin& origin,
     return;
   }
 
+  bool needs_write = UpdateCachedBudget(origin);
+  if (needs_write)
+    ScheduleWrite(std::set<url::Origin>({origin}), callback);
+  else
+    callback.Run(success);
+}
+
+void BudgetDatabase::SyncCacheForOrigins(const std::set<url::Origin>& origins,
+                                         const CacheCallback& callback) {
+  std::set<url::Origin> uncached_origins;
+  for (const url::Origin& origin : origins) {
+    bool is_cached = IsCached(origin);
+    UMA_HISTOGRAM_BOOLEAN("PushMessaging.BudgetCacheHit", is_cached);
+    if (is_cached) {
+      ++cache_hit_count_;
+    } else {
+      ++cache_miss_count_;
+      uncached_origins.insert(origin);
+    }
+  }
+
+  if (uncached_origins.empty()) {
+    SyncLoadedCacheForOrigins(origins, callback, true /* success */);
+    return;
+  }
+
+  // Each load of an uncached origin runs |load_callback| once.
+  CacheCallback load_callback = base::Bind(
+      &LoadBarrier::DidLoad,
+      make_scoped_refptr(new LoadBarrier(
+          uncached_origins.size(),
+          base::Bind(&BudgetDatabase::SyncLoadedCacheForOrigins,
+                     weak_ptr_factory_.GetWeakPtr(), origins, callback))));
+
+  // Origins which are already being loaded share that load.
+  std::set<url::Origin> origins_to_load;
+  for (const url::Origin& origin : uncached_origins) {
+    auto pending_load = pending_loads_.find(origin);
+    if (pending_load != pending_loads_.end())
+      pending_load->second.push_back(load_callback);
+    else
+      origins_to_load.insert(origin);
+  }
+  if (origins_to_load.empty())
+    return;
+
+  // Reading the whole database only pays off when the batch is a large share
+  // of it. Otherwise the origins are read individually, all at once.
+  if (!entry_count_known_ ||
+      origins_to_load.size() * kLoadEntriesMinShare < known_entry_count_) {
+    for (const url::Origin& origin : origins_to_load)
+      LoadOrigin(origin, load_callback);
+    return;
+  }
+
+  for (const url::Origin& origin : origins_to_load)
+    pending_loads_[origin].push_back(load_callback);
+  db_->LoadEntries(base::Bind(&BudgetDatabase::AddEntriesToCache,
+                              weak_ptr_factory_.GetWeakPtr(), origins_to_load));
+}
+
+void BudgetDatabase::SyncLoadedCacheForOrigins(
+    const std::set<url::Origin>& origins,
+    const CacheCallback& callback,
+    bool success) {
+  if (!success) {
+    callback.Run(false /* success */);
+    return;
+  }
+
+  std::set<url::Origin> origins_to_write;
+  for (const url::Origin& origin : origins) {
+    if (UpdateCachedBudget(origin))
+      origins_to_write.insert(origin);
+  }
+
+  if (!origins_to_write.empty())
+    ScheduleWrite(origins_to_write, callback);
+  else
+    callback.Run(success);
+}
+
+bool BudgetDatabase::UpdateCachedBudget(const url::Origin& origin) {
   // Now, cleanup any expired budget chunks for the origin.
   bool needs_write = CleanupExpiredBudget(origin);
 
   // Get the SES score and add engagement budget for the site.
   AddEngagementBudget(origin);
-
-  if (needs_write)
-    WriteCachedValuesToDatabase(origin, callback);
-  else
-    callback.Run(success);
+  TouchOrigin(origin);
+  return needs_write;
 }
 
 void BudgetDatabase::AddEngagementBudget(const url::Origin& origin) {
@@ -323,10 +1186,8 @@ void BudgetDatabase::AddEngagementBudget(const url::Origin& origin) {
   }
 
   // Get the current SES score, and calculate the hourly budget for that score.
-  SiteEngagementService* service = SiteEngagementService::Get(profile_);
-  double hourly_budget = kMaximumHourlyBudget *
-                         service->GetScore(origin.GetURL()) /
-                         service->GetMaxPoints();
+  double hourly_budget = kMaximumHourlyBudget * GetEngagementScore(origin) /
+                         GetSiteEngagementService()->GetMaxPoints();
 
   // Update the last_engagement_award to the current time. If the origin wasn't
   // already in the map, this adds a new entry for it.
@@ -352,18 +1213,14 @@ bool BudgetDatabase::CleanupExpiredBudget(const url::Origin& origin) {
 
   base::Time now = clock_->Now();
   BudgetChunks& chunks = budget_map_[origin].chunks;
-  auto cleanup_iter = chunks.begin();
-
-  // This relies on the list of chunks being in timestamp order.
-  while (cleanup_iter != chunks.end() && cleanup_iter->expiration <= now)
-    cleanup_iter = chunks.erase(cleanup_iter);
+  chunks.RemoveExpired(now);
 
   // If the entire budget is empty now AND there have been no engagements
   // in the last kBudgetDurationInDays days, remove this from the cache.
   if (chunks.empty() &&
       budget_map_[origin].last_engagement_award <
           clock_->Now() - base::TimeDelta::FromDays(kBudgetDurationInDays)) {
-    budget_map_.erase(origin);
+    RemoveFromCache(origin);
     return true;
   }
 
@@ -372,3 +1229,76 @@ bool BudgetDatabase::CleanupExpiredBudget(const url::Origin& origin) {
   // origin spends some budget.
   return false;
 }
+
+void BudgetDatabase::TouchOrigin(const url::Origin& origin) {
+  auto iter = budget_map_.find(origin);
+  DCHECK(iter != budget_map_.end());
+  BudgetInfo& info = iter->second;
+
+  if (info.in_lru) {
+    lru_origins_.splice(lru_origins_.end(), lru_origins_, info.lru_position);
+  } else {
+    info.lru_position = lru_origins_.insert(lru_origins_.end(), origin);
+    info.in_lru = true;
+  }
+
+  cache_bytes_ -= info.memory_usage;
+  info.memory_usage = sizeof(BudgetInfo) + info.chunks.EstimateMemoryUsage() +
+                      EstimateOriginMemoryUsage(origin);
+  cache_bytes_ += info.memory_usage;
+}
+
+void BudgetDatabase::RemoveFromCache(const url::Origin& origin) {
+  auto iter = budget_map_.find(origin);
+  if (iter == budget_map_.end())
+    return;
+
+  BudgetInfo& info = iter->second;
+  if (info.in_lru)
+    lru_origins_.erase(info.lru_position);
+  cache_bytes_ -= info.memory_usage;
+  budget_map_.erase(iter);
+}
+
+void BudgetDatabase::PinOrigins(const std::set<url::Origin>& origins) {
+  for (const url::Origin& origin : origins)
+    ++pinned_origins_[origin];
+}
+
+void BudgetDatabase::UnpinOrigins(const std::set<url::Origin>& origins) {
+  for (const url::Origin& origin : origins) {
+    auto iter = pinned_origins_.find(origin);
+    DCHECK(iter != pinned_origins_.end());
+    if (--iter->second == 0)
+      pinned_origins_.erase(iter);
+  }
+
+  EvictIfNeeded();
+}
+
+void BudgetDatabase::EvictIfNeeded() {
+  if (max_cache_bytes_ == 0)
+    return;
+
+  bool needs_flush = false;
+  auto iter = lru_origins_.begin();
+  while (cache_bytes_ > max_cache_bytes_ && iter != lru_origins_.end()) {
+    url::Origin origin = *iter++;
+    if (pinned_origins_.count(origin))
+      continue;
+
+    // Dirty origins have to be written before they can be dropped. They are
+    // evicted once the flush below completes and unpins them.
+    if (dirty_origins_.count(origin)) {
+      needs_flush = true;
+      continue;
+    }
+
+    RemoveFromCache(origin);
+  }
+
+  // While writes are failing, the retry timer owns the next flush. Flushing
+  // here would retry at once each time the failed write unpins its origins.
+  if (cache_bytes_ > max_cache_bytes_ && needs_flush && !failed_write_count_)
+    FlushDirtyOrigins();
+}
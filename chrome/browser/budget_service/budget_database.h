@@ -8,10 +8,17 @@
 #include <list>
 #include <map>
 #include <memory>
+#include <set>
+#include <utility>
+#include <vector>
 
 #include "base/callback_forward.h"
 #include "base/macros.h"
 #include "base/memory/weak_ptr.h"
+#include "base/time/time.h"
+#include "base/timer/timer.h"
+#include "chrome/browser/budget_service/budget_chunk_queue.h"
+#include "chrome/browser/engagement/site_engagement_observer.h"
 #include "components/leveldb_proto/proto_database.h"
 #include "third_party/WebKit/public/platform/modules/budget_service/budget_service.mojom.h"
 
@@ -31,9 +38,13 @@ class Origin;
 
 class Profile;
 
+namespace user_prefs {
+class PrefRegistrySyncable;
+}
+
 // A class used to asynchronously read and write details of the budget
 // assigned to an origin. The class uses an underlying LevelDB.
-class BudgetDatabase {
+class BudgetDatabase : public SiteEngagementObserver {
  public:
   // Callback for getting a list of all budget chunks.
   using GetBudgetCallback = blink::mojom::BudgetService::GetBudgetCallback;
@@ -43,13 +54,44 @@ class BudgetDatabase {
       base::Callback<void(blink::mojom::BudgetServiceErrorType error_type,
                           bool success)>;
 
+  // Callback for getting the budget of several origins at once. The outer
+  // vector has one entry per requested origin, in the order requested.
+  using GetBudgetForOriginsCallback = base::Callback<void(
+      blink::mojom::BudgetServiceErrorType error_type,
+      std::vector<std::vector<blink::mojom::BudgetStatePtr>> predictions)>;
+
+  // This is invoked only after all of the spends have been written to the
+  // database. |success| has one entry per requested spend, in the order
+  // requested, indicating whether that origin had enough budget.
+  using SpendBudgetForOriginsCallback =
+      base::Callback<void(blink::mojom::BudgetServiceErrorType error_type,
+                          const std::vector<bool>& success)>;
+
+  // A list of origins and the amount of budget each of them wants to spend.
+  using OriginAmounts = std::vector<std::pair<url::Origin, double>>;
+
+  // Controls when budget changes are written to the database, and when the
+  // callers are told about them.
+  enum class Durability {
+    // Every change is written to the database before its callback is run.
+    WRITE_THROUGH,
+    // Changes are coalesced into delayed writes. Callbacks are run once the
+    // write containing their change has completed.
+    COALESCED,
+    // Changes are coalesced into delayed writes, but callbacks are run as soon
+    // as the cache has been updated. Changes may be lost on a crash.
+    CACHE_ONLY,
+  };
+
   // The database_dir specifies the location of the budget information on
   // disk. The task_runner is used by the ProtoDatabase to handle all blocking
   // calls and disk access.
   BudgetDatabase(Profile* profile,
                  const base::FilePath& database_dir,
                  const scoped_refptr<base::SequencedTaskRunner>& task_runner);
-  ~BudgetDatabase();
+  ~BudgetDatabase() override;
+
+  static void RegisterProfilePrefs(user_prefs::PrefRegistrySyncable* registry);
 
   // Get the full budget expectation for the origin. This will return a
   // sequence of time points and the expected budget at those times.
@@ -62,38 +104,84 @@ class BudgetDatabase {
                    double amount,
                    const SpendBudgetCallback& callback);
 
+  // Spends |amount| of budget for |origin| without waiting, if the origin is
+  // already cached. Returns false if the origin has to be loaded from the
+  // database first, in which case SpendBudget must be used instead. Otherwise
+  // |success| is set to whether the origin had enough budget, and the change
+  // is written to the database asynchronously.
+  bool SpendCachedBudget(const url::Origin& origin,
+                         double amount,
+                         bool* success);
+
+  // Batched version of GetBudgetDetails. Origins which are not yet cached are
+  // loaded concurrently, or with a single read of the whole database when they
+  // make up a large share of it.
+  void GetBudgetDetailsForOrigins(
+      const std::vector<url::Origin>& origins,
+      const GetBudgetForOriginsCallback& callback);
+
+  // Batched version of SpendBudget. Spends are applied in order, so an origin
+  // may appear more than once. All of the resulting changes are committed to
+  // the database in a single write.
+  void SpendBudgetForOrigins(const OriginAmounts& spends,
+                             const SpendBudgetForOriginsCallback& callback);
+
+  // The number of origin accesses that were served from the cache, and the
+  // number that had to read from the database.
+  int cache_hit_count() const { return cache_hit_count_; }
+  int cache_miss_count() const { return cache_miss_count_; }
+
+  // The estimated number of bytes used by the cache.
+  size_t cache_memory_usage() const { return cache_bytes_; }
+
+  // SiteEngagementObserver implementation.
+  void OnEngagementIncreased(content::WebContents* web_contents,
+                             const GURL& url,
+                             double score) override;
+
  private:
   friend class BudgetDatabaseTest;
 
   // Used to allow tests to change time for testing.
   void SetClockForTesting(std::unique_ptr<base::Clock> clock);
 
-  // Holds information about individual pieces of awarded budget. There is a
-  // one-to-one mapping of these to the chunks in the underlying database.
-  struct BudgetChunk {
-    BudgetChunk(double amount, base::Time expiration)
-        : amount(amount), expiration(expiration) {}
-    BudgetChunk(const BudgetChunk& other)
-        : amount(other.amount), expiration(other.expiration) {}
+  // Sets how changes are written to the database. Dirty origins are flushed
+  // after |flush_delay|, or as soon as there are |max_dirty_origins| of them.
+  void SetDurability(Durability durability,
+                     base::TimeDelta flush_delay,
+                     size_t max_dirty_origins);
 
-    double amount;
-    base::Time expiration;
-  };
+  // Sets the approximate number of bytes the cache may use. Zero means that
+  // the cache size isn't limited.
+  void SetMaxCacheSize(size_t max_cache_bytes);
 
-  // Data structure for caching budget information.
-  using BudgetChunks = std::list<BudgetChunk>;
+  // Data structure for caching budget information. There is a one-to-one
+  // mapping of its chunks to the chunks in the underlying database.
+  using BudgetChunks = BudgetChunkQueue;
 
   // Holds information about the overall budget for a site. This includes the
   // time the budget was last incremented, as well as a list of budget chunks
   // which have been awarded.
   struct BudgetInfo {
     BudgetInfo();
-    BudgetInfo(const BudgetInfo&& other);
+    BudgetInfo(BudgetInfo&& other);
     ~BudgetInfo();
 
     base::Time last_engagement_award;
     BudgetChunks chunks;
 
+    // The site engagement score of the origin, and when it was read from the
+    // SiteEngagementService. A null time means that no score is cached.
+    double engagement_score;
+    base::Time engagement_score_time;
+
+    // The position of the origin in |lru_origins_|, if |in_lru| is set.
+    std::list<url::Origin>::iterator lru_position;
+    bool in_lru;
+
+    // The estimated memory used by this entry when it was last accessed.
+    size_t memory_usage;
+
     DISALLOW_COPY_AND_ASSIGN(BudgetInfo);
   };
 
@@ -104,8 +192,53 @@ class BudgetDatabase {
 
   void OnDatabaseInit(bool success);
 
+  // Loads every entry in the database into the cache, so that the first
+  // access to each origin after startup doesn't have to read from disk.
+  // Expired chunks are dropped and fully expired origins are deleted in the
+  // same pass.
+  void WarmUpCache();
+  void DidLoadEntriesForWarmUp(
+      bool success,
+      std::unique_ptr<std::vector<budget_service::Budget>> entries);
+
+  // Runs the work which is deferred until browser startup has completed.
+  void OnStartupComplete();
+
+  // Scans the whole database for origins which haven't been accessed recently
+  // and still have expired budget stored, and rewrites or deletes them in
+  // batches. Cached origins are skipped, as they are cleaned up on access.
+  void SweepExpiredBudget();
+
+  // Starts the timer for the next sweep, a day after the last one, as
+  // remembered in the profile prefs. The sweep never runs right after startup.
+  void ScheduleSweep();
+  void RunScheduledSweep();
+  void DidLoadEntriesForSweep(
+      bool success,
+      std::unique_ptr<std::vector<budget_service::Budget>> entries);
+  void DidProbeLegacyEntryForSweep(
+      const url::Origin& origin,
+      const CacheCallback& callback,
+      bool success,
+      std::unique_ptr<budget_service::Budget> budget_proto);
+  void DidProbeLegacyEntriesForSweep(bool success);
+
+  // Queues the removal of expired budget from the stored |budget_proto| of
+  // |origin|, unless the sweep's copy of it is out of date.
+  void SweepEntry(const url::Origin& origin,
+                  const budget_service::Budget& budget_proto);
+  void WriteNextSweepBatch();
+  void DidWriteSweepBatch(bool success);
+
   bool IsCached(const url::Origin& origin) const;
 
+  // Returns whether |origin| may have changed since the running sweep read it.
+  bool IsSweepStale(const url::Origin& origin) const;
+
+  // Returns the engagement score of |origin|, reading it from the
+  // SiteEngagementService only if the cached score is missing or stale.
+  double GetEngagementScore(const url::Origin& origin);
+
   double GetBudget(const url::Origin& origin) const;
 
   void AddToCache(const url::Origin& origin,
@@ -113,6 +246,21 @@ class BudgetDatabase {
                   bool success,
                   std::unique_ptr<budget_service::Budget> budget);
 
+  // Adds all of the loaded |entries| for origins in |origins| to the cache,
+  // and completes their pending loads.
+  void AddEntriesToCache(
+      const std::set<url::Origin>& origins,
+      bool success,
+      std::unique_ptr<std::vector<budget_service::Budget>> entries);
+
+  // Converts |budget_proto| to the cache format and stores it for |origin|.
+  void StoreInCache(const url::Origin& origin,
+                    const budget_service::Budget& budget_proto);
+
+  // Builds the budget expectation for a cached origin.
+  std::vector<blink::mojom::BudgetStatePtr> GetPredictions(
+      const url::Origin& origin);
+
   void GetBudgetAfterSync(const url::Origin& origin,
                           const GetBudgetCallback& callback,
                           bool success);
@@ -124,14 +272,66 @@ class BudgetDatabase {
 
   void SpendBudgetAfterWrite(const SpendBudgetCallback& callback, bool success);
 
-  void WriteCachedValuesToDatabase(const url::Origin& origin,
+  void GetBudgetForOriginsAfterSync(
+      const std::vector<url::Origin>& origins,
+      const GetBudgetForOriginsCallback& callback,
+      bool success);
+
+  void SpendBudgetForOriginsAfterSync(
+      const OriginAmounts& spends,
+      const SpendBudgetForOriginsCallback& callback,
+      bool success);
+
+  void SpendBudgetForOriginsAfterWrite(
+      const SpendBudgetForOriginsCallback& callback,
+      const std::vector<bool>& spend_results,
+      bool success);
+
+  // Removes |amount| of budget from the cached chunks of |origin|. Returns
+  // false without changing anything if the origin doesn't have enough budget.
+  bool SpendFromCache(const url::Origin& origin, double amount);
+
+  // Writes the cached values of |origins| to the database according to the
+  // configured durability. |callback| is run when the change is considered
+  // stored.
+  void ScheduleWrite(const std::set<url::Origin>& origins,
+                     const StoreBudgetCallback& callback);
+
+  // Writes all dirty origins to the database in a single update.
+  void FlushDirtyOrigins();
+
+  // Writes the cached values for all of |origins| in a single update.
+  void WriteCachedValuesToDatabase(const std::set<url::Origin>& origins,
                                    const StoreBudgetCallback& callback);
 
+  // If the write failed, the cache is still correct, so the |origins| are
+  // marked dirty again and a retry is scheduled.
+  void DidWriteCachedValues(const std::set<url::Origin>& origins,
+                            const StoreBudgetCallback& callback,
+                            bool success);
+
   void SyncCache(const url::Origin& origin, const CacheCallback& callback);
+
+  // Reads |origin| from the database and runs |callback| once it is cached.
+  // If the origin is already being loaded, |callback| waits for that load.
+  void LoadOrigin(const url::Origin& origin, const CacheCallback& callback);
+
+  // Runs all of the callbacks waiting for |origin| to be loaded.
+  void DidLoadOrigin(const url::Origin& origin, bool success);
   void SyncLoadedCache(const url::Origin& origin,
                        const CacheCallback& callback,
                        bool success);
 
+  void SyncCacheForOrigins(const std::set<url::Origin>& origins,
+                           const CacheCallback& callback);
+  void SyncLoadedCacheForOrigins(const std::set<url::Origin>& origins,
+                                 const CacheCallback& callback,
+                                 bool success);
+
+  // Removes expired budget from a cached |origin| and awards it engagement
+  // budget. Returns whether the origin needs to be written to the database.
+  bool UpdateCachedBudget(const url::Origin& origin);
+
   // Add budget based on engagement with an origin. The method queries for the
   // engagement score of the origin, and then calculates when engagement budget
   // was last awarded and awards a portion of the score based on that.
@@ -140,6 +340,23 @@ class BudgetDatabase {
 
   bool CleanupExpiredBudget(const url::Origin& origin);
 
+  // Marks |origin| as the most recently used one and updates its estimated
+  // memory usage.
+  void TouchOrigin(const url::Origin& origin);
+
+  // Removes |origin| from the cache, including the LRU bookkeeping.
+  void RemoveFromCache(const url::Origin& origin);
+
+  // Origins are pinned while an operation or a database write needs their
+  // cached values, and can't be evicted until they are unpinned.
+  void PinOrigins(const std::set<url::Origin>& origins);
+  void UnpinOrigins(const std::set<url::Origin>& origins);
+
+  // Evicts the least recently used origins until the cache fits in
+  // |max_cache_bytes_|. Dirty origins are flushed first and evicted once the
+  // write has completed, unless a write is being retried after failing.
+  void EvictIfNeeded();
+
   Profile* profile_;
 
   // The database for storing budget information.
@@ -148,9 +365,66 @@ class BudgetDatabase {
   // Cached data for the origins which have been loaded.
   std::map<url::Origin, BudgetInfo> budget_map_;
 
+  // Callbacks waiting for each origin which is being loaded from the
+  // database. Only one load is issued per origin at a time.
+  std::map<url::Origin, std::vector<CacheCallback>> pending_loads_;
+
+  // The cached origins, least recently used first.
+  std::list<url::Origin> lru_origins_;
+
+  // The number of pending operations and writes using each origin.
+  std::map<url::Origin, int> pinned_origins_;
+
+  // The estimated memory used by the cache, and the limit for it.
+  size_t cache_bytes_;
+  size_t max_cache_bytes_;
+
+  int cache_hit_count_;
+  int cache_miss_count_;
+
+  // The number of entries in the database, as of the last time it was read as
+  // a whole. Used to decide how to load a batch of origins.
+  size_t known_entry_count_;
+  bool entry_count_known_;
+
   // The clock used to vend times.
   std::unique_ptr<base::Clock> clock_;
 
+  Durability durability_;
+  base::TimeDelta flush_delay_;
+  size_t max_dirty_origins_;
+
+  // Origins whose cached budget hasn't been written to the database yet.
+  std::set<url::Origin> dirty_origins_;
+
+  // Callbacks waiting for the next flush when using Durability::COALESCED.
+  std::vector<StoreBudgetCallback> pending_write_callbacks_;
+
+  // The number of writes that have been requested since the last flush.
+  int writes_since_flush_;
+
+  // The number of consecutive failed writes, used to back off retries.
+  int failed_write_count_;
+
+  // Fires to flush the dirty origins, or to retry a failed write.
+  base::OneShotTimer flush_timer_;
+
+  // Fires to sweep expired budget out of the database, once a day.
+  base::OneShotTimer sweep_timer_;
+
+  // Entries rewritten by the current sweep, and origins it deletes, which are
+  // waiting to be written to the database.
+  std::map<url::Origin, budget_service::Budget> sweep_updates_;
+  std::set<url::Origin> sweep_removals_;
+
+  // Origins written to the database since the current sweep started. The
+  // sweep's copy of them is stale, so it must not write them.
+  std::set<url::Origin> sweep_written_origins_;
+
+  // The number of bytes of stale budget the current sweep has removed.
+  int sweep_reclaimed_bytes_;
+  bool sweep_in_progress_;
+
   base::WeakPtrFactory<BudgetDatabase> weak_ptr_factory_;
 
   DISALLOW_COPY_AND_ASSIGN(BudgetDatabase);
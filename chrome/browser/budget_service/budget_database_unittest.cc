@@ -5,8 +5,12 @@
 #include "chrome/browser/budget_service/budget_database.h"
 
 #include <math.h>
+#include <string>
 #include <vector>
 
+#include "base/barrier_closure.h"
+#include "base/bind_helpers.h"
+#include "base/macros.h"
 #include "base/memory/ptr_util.h"
 #include "base/run_loop.h"
 #include "base/test/histogram_tester.h"
@@ -18,6 +22,7 @@
 #include "chrome/test/base/testing_profile.h"
 #include "components/leveldb_proto/proto_database.h"
 #include "components/leveldb_proto/proto_database_impl.h"
+#include "components/leveldb_proto/testing/fake_db.h"
 #include "content/public/browser/browser_thread.h"
 #include "content/public/test/test_browser_thread_bundle.h"
 #include "testing/gtest/include/gtest/gtest.h"
@@ -33,6 +38,39 @@ const double kMaxDailyBudget = 12;
 const double kEngagement = 25;
 
 const char kTestOrigin[] = "https://example.com";
+const char kOtherTestOrigin[] = "https://other.example.com";
+
+// A fake database, whose operations only complete when the test runs their
+// callbacks, which counts the reads and writes it is asked for.
+class CountingFakeDB
+    : public leveldb_proto::test::FakeDB<budget_service::Budget> {
+ public:
+  explicit CountingFakeDB(EntryMap* entries)
+      : FakeDB(entries), get_entry_count_(0), update_count_(0) {}
+  ~CountingFakeDB() override {}
+
+  void GetEntry(const std::string& key, const GetCallback& callback) override {
+    ++get_entry_count_;
+    FakeDB::GetEntry(key, callback);
+  }
+
+  void UpdateEntries(std::unique_ptr<KeyEntryVector> entries_to_save,
+                     std::unique_ptr<std::vector<std::string>> keys_to_remove,
+                     const UpdateCallback& callback) override {
+    ++update_count_;
+    FakeDB::UpdateEntries(std::move(entries_to_save), std::move(keys_to_remove),
+                          callback);
+  }
+
+  int get_entry_count() const { return get_entry_count_; }
+  int update_count() const { return update_count_; }
+
+ private:
+  int get_entry_count_;
+  int update_count_;
+
+  DISALLOW_COPY_AND_ASSIGN(CountingFakeDB);
+};
 
 }  // namespace
 
@@ -80,6 +118,151 @@ class BudgetDatabaseTest : public ::testing::Test {
     run_loop.Run();
   }
 
+  void SpendBudgetForOriginsComplete(base::Closure run_loop_closure,
+                                     blink::mojom::BudgetServiceErrorType error,
+                                     const std::vector<bool>& success) {
+    success_ = (error == blink::mojom::BudgetServiceErrorType::NONE);
+    spend_results_ = success;
+    run_loop_closure.Run();
+  }
+
+  void CountSpendComplete(int* spend_count,
+                          base::Closure closure,
+                          blink::mojom::BudgetServiceErrorType error,
+                          bool success) {
+    if (error == blink::mojom::BudgetServiceErrorType::NONE && success)
+      ++*spend_count;
+    closure.Run();
+  }
+
+  // Spend budget for several origins at once.
+  void SpendBudgetForOrigins(const BudgetDatabase::OriginAmounts& spends) {
+    base::RunLoop run_loop;
+    db_.SpendBudgetForOrigins(
+        spends,
+        base::Bind(&BudgetDatabaseTest::SpendBudgetForOriginsComplete,
+                   base::Unretained(this), run_loop.QuitClosure()));
+    run_loop.Run();
+  }
+
+  void GetBudgetDetailsForOriginsComplete(
+      base::Closure run_loop_closure,
+      blink::mojom::BudgetServiceErrorType error,
+      std::vector<std::vector<blink::mojom::BudgetStatePtr>> predictions) {
+    success_ = (error == blink::mojom::BudgetServiceErrorType::NONE);
+    predictions_for_origins_.swap(predictions);
+    run_loop_closure.Run();
+  }
+
+  // Get the budget predictions for several origins at once.
+  void GetBudgetDetailsForOrigins(const std::vector<url::Origin>& origins) {
+    base::RunLoop run_loop;
+    db_.GetBudgetDetailsForOrigins(
+        origins,
+        base::Bind(&BudgetDatabaseTest::GetBudgetDetailsForOriginsComplete,
+                   base::Unretained(this), run_loop.QuitClosure()));
+    run_loop.Run();
+  }
+
+  void SetDurability(BudgetDatabase::Durability durability) {
+    db_.SetDurability(durability, base::TimeDelta::FromHours(1),
+                      100 /* max_dirty_origins */);
+  }
+
+  // Write all coalesced changes to the database.
+  void FlushDirtyOrigins() {
+    db_.FlushDirtyOrigins();
+    base::RunLoop().RunUntilIdle();
+  }
+
+  // Load the whole database into the cache.
+  void WarmUpCache() {
+    db_.WarmUpCache();
+    base::RunLoop().RunUntilIdle();
+  }
+
+  bool IsCached() const { return db_.IsCached(origin_); }
+
+  // Run a sweep of expired budget over the whole database.
+  void SweepExpiredBudget() {
+    db_.SweepExpiredBudget();
+    base::RunLoop().RunUntilIdle();
+  }
+
+  // Schedule the next sweep, and return how long until it runs.
+  base::TimeDelta ScheduleSweep() {
+    db_.ScheduleSweep();
+    return db_.sweep_timer_.GetCurrentDelay();
+  }
+
+  void DidLoadEntries(
+      size_t* entry_count,
+      bool success,
+      std::unique_ptr<std::vector<budget_service::Budget>> entries) {
+    ASSERT_TRUE(success);
+    *entry_count = entries->size();
+  }
+
+  // The number of origins stored in the database.
+  size_t GetDatabaseEntryCount() {
+    size_t entry_count = 0;
+    db_.db_->LoadEntries(base::Bind(&BudgetDatabaseTest::DidLoadEntries,
+                                    base::Unretained(this), &entry_count));
+    base::RunLoop().RunUntilIdle();
+    return entry_count;
+  }
+
+  void DidUpdateEntries(bool success) { ASSERT_TRUE(success); }
+
+  // Write budget for |origin| in the format used before the origin was stored
+  // alongside the budget.
+  void WriteLegacyEntry(const url::Origin& origin,
+                        double amount,
+                        base::Time expiration,
+                        base::Time last_engagement_award) {
+    budget_service::Budget budget;
+    budget_service::BudgetChunk* chunk = budget.add_budget();
+    chunk->set_amount(amount);
+    chunk->set_expiration(expiration.ToInternalValue());
+    budget.set_engagement_last_updated(
+        last_engagement_award.ToInternalValue());
+
+    std::unique_ptr<leveldb_proto::ProtoDatabase<
+        budget_service::Budget>::KeyEntryVector>
+        entries(new leveldb_proto::ProtoDatabase<
+                budget_service::Budget>::KeyEntryVector());
+    entries->push_back(std::make_pair(origin.Serialize(), budget));
+    db_.db_->UpdateEntries(std::move(entries),
+                           base::MakeUnique<std::vector<std::string>>(),
+                           base::Bind(&BudgetDatabaseTest::DidUpdateEntries,
+                                      base::Unretained(this)));
+    base::RunLoop().RunUntilIdle();
+  }
+
+  // Drop the in-memory cache so that the next access reads from the database.
+  void ClearCache() {
+    while (!db_.budget_map_.empty()) {
+      url::Origin origin = db_.budget_map_.begin()->first;
+      db_.RemoveFromCache(origin);
+    }
+  }
+
+  void SetMaxCacheSize(size_t max_cache_bytes) {
+    db_.SetMaxCacheSize(max_cache_bytes);
+  }
+
+  // Replace the database with a fake one. Must be called before the database
+  // is first used.
+  CountingFakeDB* UseFakeDatabase() {
+    CountingFakeDB* fake_db = new CountingFakeDB(&fake_db_entries_);
+    db_.db_.reset(fake_db);
+    return fake_db;
+  }
+
+  bool IsFlushScheduled() const { return db_.flush_timer_.IsRunning(); }
+
+  BudgetDatabase* db() { return &db_; }
+
   Profile* profile() { return &profile_; }
   const url::Origin& origin() const { return origin_; }
 
@@ -99,11 +282,15 @@ class BudgetDatabaseTest : public ::testing::Test {
   base::HistogramTester* GetHistogramTester() { return &histogram_tester_; }
   bool success_;
   std::vector<blink::mojom::BudgetStatePtr> prediction_;
+  std::vector<std::vector<blink::mojom::BudgetStatePtr>>
+      predictions_for_origins_;
+  std::vector<bool> spend_results_;
 
  private:
   content::TestBrowserThreadBundle thread_bundle_;
   std::unique_ptr<budget_service::Budget> budget_;
   TestingProfile profile_;
+  CountingFakeDB::EntryMap fake_db_entries_;
   BudgetDatabase db_;
   base::HistogramTester histogram_tester_;
   const url::Origin origin_;
@@ -327,3 +514,388 @@ TEST_F(BudgetDatabaseTest, CheckEngagementHistograms) {
   EXPECT_EQ(floor(engagement * 2), low_budget_buckets[1].min);
   EXPECT_EQ(1, low_budget_buckets[1].count);
 }
+
+TEST_F(BudgetDatabaseTest, SpendBudgetForOriginsTest) {
+  SetClockForTesting();
+  const url::Origin other_origin(GURL(kOtherTestOrigin));
+
+  // Give the test origin engagement, but leave the other origin with none.
+  SetSiteEngagementScore(kEngagement);
+  double full_budget = kMaxDailyBudget * kDefaultExpirationInDays *
+                       (kEngagement / SiteEngagementScore::kMaxPoints);
+
+  // Spend from both origins, with the test origin spending twice.
+  SpendBudgetForOrigins({{origin(), 1}, {other_origin, 1}, {origin(), 2}});
+  ASSERT_TRUE(success_);
+  ASSERT_EQ(3U, spend_results_.size());
+  EXPECT_TRUE(spend_results_[0]);
+  EXPECT_FALSE(spend_results_[1]);
+  EXPECT_TRUE(spend_results_[2]);
+
+  // Reload both origins from the database in a single batch and check that
+  // the spends were persisted.
+  ClearCache();
+  GetBudgetDetailsForOrigins({origin(), other_origin});
+  ASSERT_TRUE(success_);
+  ASSERT_EQ(2U, predictions_for_origins_.size());
+  ASSERT_EQ(2U, predictions_for_origins_[0].size());
+  EXPECT_DOUBLE_EQ(full_budget - 3, predictions_for_origins_[0][0]->budget_at);
+  ASSERT_EQ(2U, predictions_for_origins_[1].size());
+  EXPECT_EQ(0, predictions_for_origins_[1][0]->budget_at);
+}
+
+TEST_F(BudgetDatabaseTest, CoalescedWritesTest) {
+  SetClockForTesting();
+  SetSiteEngagementScore(kEngagement);
+  SetDurability(BudgetDatabase::Durability::CACHE_ONLY);
+
+  // Each spend replies as soon as the cache is updated.
+  ASSERT_TRUE(SpendBudget(1));
+  ASSERT_TRUE(SpendBudget(1));
+  ASSERT_TRUE(SpendBudget(1));
+
+  // The three spends are written to the database by a single flush.
+  double full_budget = kMaxDailyBudget * kDefaultExpirationInDays *
+                       (kEngagement / SiteEngagementScore::kMaxPoints);
+  FlushDirtyOrigins();
+  GetHistogramTester()->ExpectUniqueSample(
+      "PushMessaging.BudgetCoalescedWrites", 2, 1);
+
+  // Reload from the database to check that the spends were persisted.
+  ClearCache();
+  GetBudgetDetails();
+  ASSERT_TRUE(success_);
+  ASSERT_EQ(2U, prediction_.size());
+  EXPECT_DOUBLE_EQ(full_budget - 3, prediction_[0]->budget_at);
+}
+
+TEST_F(BudgetDatabaseTest, WarmUpCacheTest) {
+  base::SimpleTestClock* clock = SetClockForTesting();
+  SetSiteEngagementScore(kEngagement);
+
+  // Write budget for the origin to the database.
+  ASSERT_TRUE(SpendBudget(1));
+  ClearCache();
+  ASSERT_FALSE(IsCached());
+
+  // Warming up the cache loads the origin without it being accessed.
+  WarmUpCache();
+  EXPECT_TRUE(IsCached());
+
+  // Once all of the origin's budget has expired, warming up the cache drops
+  // the origin instead.
+  clock->Advance(base::TimeDelta::FromDays(kDefaultExpirationInDays + 1));
+  ClearCache();
+  WarmUpCache();
+  EXPECT_FALSE(IsCached());
+}
+
+TEST_F(BudgetDatabaseTest, CacheEvictionTest) {
+  SetClockForTesting();
+  SetSiteEngagementScore(kEngagement);
+  double full_budget = kMaxDailyBudget * kDefaultExpirationInDays *
+                       (kEngagement / SiteEngagementScore::kMaxPoints);
+
+  // Make the cache too small to hold any origin. Origins are still cached
+  // while they are in use, and evicted once their write has completed.
+  SetMaxCacheSize(1);
+  ASSERT_TRUE(SpendBudget(1));
+  EXPECT_FALSE(IsCached());
+  EXPECT_EQ(1, db()->cache_miss_count());
+
+  // The evicted origin is reloaded from the database with its spend intact.
+  GetBudgetDetails();
+  ASSERT_TRUE(success_);
+  EXPECT_DOUBLE_EQ(full_budget - 1, prediction_[0]->budget_at);
+  EXPECT_EQ(2, db()->cache_miss_count());
+  EXPECT_EQ(0, db()->cache_hit_count());
+
+  // Without a limit, the origin stays cached.
+  SetMaxCacheSize(0);
+  GetBudgetDetails();
+  GetBudgetDetails();
+  EXPECT_TRUE(IsCached());
+  EXPECT_EQ(3, db()->cache_miss_count());
+  EXPECT_EQ(1, db()->cache_hit_count());
+}
+
+TEST_F(BudgetDatabaseTest, EvictionDoesNotRetryFailedWritesTest) {
+  SetClockForTesting();
+  SetSiteEngagementScore(kEngagement);
+  CountingFakeDB* fake_db = UseFakeDatabase();
+  SetDurability(BudgetDatabase::Durability::COALESCED);
+
+  // With a cache too small for any origin, the spend is flushed as soon as the
+  // origin is unpinned, so that it can be evicted.
+  SetMaxCacheSize(1);
+  db()->SpendBudget(
+      origin(), 1,
+      base::Bind(&BudgetDatabaseTest::WriteBudgetComplete,
+                 base::Unretained(this), base::Bind(&base::DoNothing)));
+  fake_db->GetCallback(true);
+  base::RunLoop().RunUntilIdle();
+  EXPECT_EQ(1, fake_db->update_count());
+
+  // The failed write is retried by the backoff timer rather than by the
+  // eviction which runs when the write unpins the origin.
+  fake_db->UpdateCallback(false);
+  base::RunLoop().RunUntilIdle();
+  EXPECT_FALSE(success_);
+  EXPECT_EQ(1, fake_db->update_count());
+  EXPECT_TRUE(IsFlushScheduled());
+  EXPECT_TRUE(IsCached());
+
+  // Once the retry succeeds, the origin is evicted.
+  FlushDirtyOrigins();
+  EXPECT_EQ(2, fake_db->update_count());
+  fake_db->UpdateCallback(true);
+  base::RunLoop().RunUntilIdle();
+  EXPECT_FALSE(IsCached());
+}
+
+TEST_F(BudgetDatabaseTest, ConcurrentLoadsTest) {
+  SetClockForTesting();
+  SetSiteEngagementScore(kEngagement);
+  CountingFakeDB* fake_db = UseFakeDatabase();
+  SetDurability(BudgetDatabase::Durability::COALESCED);
+
+  // Issue several spends for the uncached origin before any of them has
+  // finished loading it. They share a single read of the database.
+  int spend_count = 0;
+  base::RunLoop run_loop;
+  base::Closure barrier = base::BarrierClosure(3, run_loop.QuitClosure());
+  for (int i = 0; i < 3; ++i) {
+    db()->SpendBudget(
+        origin(), 1,
+        base::Bind(&BudgetDatabaseTest::CountSpendComplete,
+                   base::Unretained(this), &spend_count, barrier));
+  }
+  EXPECT_EQ(1, fake_db->get_entry_count());
+  EXPECT_EQ(3, db()->cache_miss_count());
+
+  fake_db->GetCallback(true);
+  base::RunLoop().RunUntilIdle();
+  EXPECT_EQ(1, fake_db->get_entry_count());
+  EXPECT_TRUE(IsCached());
+
+  // None of the spends is lost, and they are written together.
+  FlushDirtyOrigins();
+  EXPECT_EQ(1, fake_db->update_count());
+  fake_db->UpdateCallback(true);
+  run_loop.Run();
+  EXPECT_EQ(3, spend_count);
+}
+
+TEST_F(BudgetDatabaseTest, SweepExpiredBudgetTest) {
+  base::SimpleTestClock* clock = SetClockForTesting();
+  SetSiteEngagementScore(kEngagement);
+
+  // Write budget for the origin, then stop accessing it.
+  ASSERT_TRUE(SpendBudget(1));
+  ClearCache();
+  ASSERT_EQ(1U, GetDatabaseEntryCount());
+
+  // Sweeping before anything has expired leaves the database alone.
+  SweepExpiredBudget();
+  EXPECT_EQ(1U, GetDatabaseEntryCount());
+  GetHistogramTester()->ExpectUniqueSample(
+      "PushMessaging.BudgetSweepReclaimedBytes", 0, 1);
+
+  // Once the budget has expired, the sweep deletes the origin's entry.
+  clock->Advance(base::TimeDelta::FromDays(kDefaultExpirationInDays + 1));
+  SweepExpiredBudget();
+  EXPECT_EQ(0U, GetDatabaseEntryCount());
+  GetHistogramTester()->ExpectTotalCount(
+      "PushMessaging.BudgetSweepReclaimedBytes", 2);
+}
+
+TEST_F(BudgetDatabaseTest, SweepSchedulingTest) {
+  base::SimpleTestClock* clock = SetClockForTesting();
+  clock->SetNow(base::Time::Now());
+
+  // Without a previous sweep, the first one still waits for startup to end.
+  EXPECT_EQ(base::TimeDelta::FromMinutes(10), ScheduleSweep());
+
+  // Restarting soon after a sweep waits for the rest of the day.
+  SweepExpiredBudget();
+  clock->Advance(base::TimeDelta::FromHours(2));
+  EXPECT_EQ(base::TimeDelta::FromHours(22), ScheduleSweep());
+
+  clock->Advance(base::TimeDelta::FromHours(30));
+  EXPECT_EQ(base::TimeDelta::FromMinutes(10), ScheduleSweep());
+
+  // A sweep in the future, after the clock was set back, doesn't postpone the
+  // next one by more than a day.
+  clock->Advance(base::TimeDelta::FromDays(-10));
+  EXPECT_EQ(base::TimeDelta::FromHours(24), ScheduleSweep());
+}
+
+TEST_F(BudgetDatabaseTest, SweepSkipsOriginsWrittenDuringSweepTest) {
+  base::SimpleTestClock* clock = SetClockForTesting();
+  SetSiteEngagementScore(kEngagement);
+
+  // Let the stored budget and engagement award expire, so that the sweep
+  // would delete the origin's entry.
+  ASSERT_TRUE(SpendBudget(1));
+  clock->Advance(base::TimeDelta::FromDays(kDefaultExpirationInDays + 1));
+
+  // Start the sweep, then spend and evict the origin before the sweep's read
+  // of the database has returned.
+  db()->SweepExpiredBudget();
+  bool success = false;
+  ASSERT_TRUE(db()->SpendCachedBudget(origin(), 1, &success));
+  ASSERT_TRUE(success);
+  ClearCache();
+  base::RunLoop().RunUntilIdle();
+
+  // The sweep's older copy of the origin must not replace the new budget.
+  EXPECT_EQ(1U, GetDatabaseEntryCount());
+  GetBudgetDetails();
+  ASSERT_TRUE(success_);
+  EXPECT_GT(prediction_[0]->budget_at, 0);
+}
+
+TEST_F(BudgetDatabaseTest, SweepLegacyEntriesTest) {
+  base::SimpleTestClock* clock = SetClockForTesting();
+  SetSiteEngagementScore(kEngagement);
+  SiteEngagementService::Get(profile())->ResetBaseScoreForURL(
+      GURL(kOtherTestOrigin), kEngagement);
+
+  // Write legacy entries for two origins with engagement, one of which
+  // expires before the sweep.
+  url::Origin other_origin(GURL(kOtherTestOrigin));
+  base::Time now = clock->Now();
+  WriteLegacyEntry(origin(), 3, now + base::TimeDelta::FromDays(1), now);
+  WriteLegacyEntry(
+      other_origin, 5,
+      now + base::TimeDelta::FromDays(kDefaultExpirationInDays * 2), now);
+  clock->Advance(base::TimeDelta::FromDays(kDefaultExpirationInDays + 1));
+  ASSERT_EQ(2U, GetDatabaseEntryCount());
+
+  // The expired legacy entry is deleted, and the other one is kept.
+  SweepExpiredBudget();
+  EXPECT_EQ(1U, GetDatabaseEntryCount());
+
+  // The remaining entry was rewritten with its origin, so warming up the cache
+  // can now load it.
+  WarmUpCache();
+  std::vector<url::Origin> origins = {other_origin};
+  int miss_count = db()->cache_miss_count();
+  GetBudgetDetailsForOrigins(origins);
+  ASSERT_TRUE(success_);
+  EXPECT_EQ(miss_count, db()->cache_miss_count());
+  EXPECT_GE(predictions_for_origins_[0][0]->budget_at, 5);
+}
+
+TEST_F(BudgetDatabaseTest, CachedEngagementScoreTest) {
+  base::SimpleTestClock* clock = SetClockForTesting();
+  SetSiteEngagementScore(kEngagement);
+
+  double hourly_budget =
+      kMaxDailyBudget / 24 * (kEngagement / SiteEngagementScore::kMaxPoints);
+  GetBudgetDetails();
+  ASSERT_TRUE(success_);
+  double budget = prediction_[0]->budget_at;
+
+  // Resetting the score isn't announced to observers, so the next award still
+  // uses the cached score.
+  SetSiteEngagementScore(kEngagement * 2);
+  clock->Advance(base::TimeDelta::FromHours(2));
+  GetBudgetDetails();
+  ASSERT_TRUE(success_);
+  EXPECT_DOUBLE_EQ(budget + 2 * hourly_budget, prediction_[0]->budget_at);
+  budget = prediction_[0]->budget_at;
+
+  // An increase in engagement invalidates the cached score.
+  db()->OnEngagementIncreased(nullptr, GURL(kTestOrigin), kEngagement * 2);
+  clock->Advance(base::TimeDelta::FromHours(1));
+  GetBudgetDetails();
+  ASSERT_TRUE(success_);
+  EXPECT_DOUBLE_EQ(budget + 2 * hourly_budget, prediction_[0]->budget_at);
+  budget = prediction_[0]->budget_at;
+
+  // A stale score is read again from the SiteEngagementService.
+  SetSiteEngagementScore(kEngagement);
+  clock->Advance(base::TimeDelta::FromHours(7));
+  GetBudgetDetails();
+  ASSERT_TRUE(success_);
+  EXPECT_DOUBLE_EQ(budget + 7 * hourly_budget, prediction_[0]->budget_at);
+}
+
+TEST_F(BudgetDatabaseTest, SpendCachedBudgetTest) {
+  SetSiteEngagementScore(kEngagement);
+
+  // Origins which aren't cached have to go through SpendBudget.
+  bool spent = false;
+  EXPECT_FALSE(db()->SpendCachedBudget(origin(), 1, &spent));
+
+  GetBudgetDetails();
+  ASSERT_TRUE(success_);
+  double full_budget = prediction_[0]->budget_at;
+
+  // Once the origin is cached, spends are decided straight away.
+  ASSERT_TRUE(db()->SpendCachedBudget(origin(), 1, &spent));
+  EXPECT_TRUE(spent);
+  ASSERT_TRUE(db()->SpendCachedBudget(origin(), full_budget, &spent));
+  EXPECT_FALSE(spent);
+
+  // The spend is written to the database in the background.
+  base::RunLoop().RunUntilIdle();
+  ClearCache();
+  GetBudgetDetails();
+  ASSERT_TRUE(success_);
+  EXPECT_DOUBLE_EQ(full_budget - 1, prediction_[0]->budget_at);
+}
+
+TEST_F(BudgetDatabaseTest, BatchSharesPendingLoadTest) {
+  SetClockForTesting();
+  SetSiteEngagementScore(kEngagement);
+  const url::Origin other_origin(GURL(kOtherTestOrigin));
+  double full_budget = kMaxDailyBudget * kDefaultExpirationInDays *
+                       (kEngagement / SiteEngagementScore::kMaxPoints);
+
+  ASSERT_TRUE(SpendBudget(1));
+  ClearCache();
+
+  // A batch issued while a spend is loading the origin waits for that load,
+  // and sees the spend.
+  int spend_count = 0;
+  db()->SpendBudget(origin(), 1,
+                    base::Bind(&BudgetDatabaseTest::CountSpendComplete,
+                               base::Unretained(this), &spend_count,
+                               base::Bind(&base::DoNothing)));
+  GetBudgetDetailsForOrigins({origin(), other_origin});
+  base::RunLoop().RunUntilIdle();
+  EXPECT_EQ(1, spend_count);
+  ASSERT_TRUE(success_);
+  ASSERT_EQ(2U, predictions_for_origins_.size());
+  EXPECT_DOUBLE_EQ(full_budget - 2, predictions_for_origins_[0][0]->budget_at);
+  EXPECT_EQ(4, db()->cache_miss_count());
+}
+
+TEST_F(BudgetDatabaseTest, BatchLoadsLegacyEntriesTest) {
+  base::SimpleTestClock* clock = SetClockForTesting();
+  const url::Origin other_origin(GURL(kOtherTestOrigin));
+  base::Time expiration = clock->Now() + base::TimeDelta::FromDays(1);
+  WriteLegacyEntry(origin(), 3, expiration, clock->Now());
+  WriteLegacyEntry(other_origin, 5, expiration, clock->Now());
+
+  // The origins are loaded even though their entries don't name them.
+  GetBudgetDetailsForOrigins({origin(), other_origin});
+  ASSERT_TRUE(success_);
+  ASSERT_EQ(2U, predictions_for_origins_.size());
+  EXPECT_DOUBLE_EQ(3, predictions_for_origins_[0][0]->budget_at);
+  EXPECT_DOUBLE_EQ(5, predictions_for_origins_[1][0]->budget_at);
+
+  // Once the size of the database is known, a batch covering all of it reads
+  // it at once, and falls back to individual reads for entries without an
+  // origin.
+  ClearCache();
+  WarmUpCache();
+  EXPECT_FALSE(IsCached());
+  GetBudgetDetailsForOrigins({origin(), other_origin});
+  ASSERT_TRUE(success_);
+  ASSERT_EQ(2U, predictions_for_origins_.size());
+  EXPECT_DOUBLE_EQ(3, predictions_for_origins_[0][0]->budget_at);
+  EXPECT_DOUBLE_EQ(5, predictions_for_origins_[1][0]->budget_at);
+}
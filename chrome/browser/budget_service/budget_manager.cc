@@ -67,6 +67,15 @@ void BudgetManager::Reserve(const url::Origin& origin,
                  false /* success */);
     return;
   }
+
+  // Cached origins are decided without waiting for the database.
+  bool success = false;
+  if (db_.SpendCachedBudget(origin, GetCost(type), &success)) {
+    DidReserve(origin, callback, blink::mojom::BudgetServiceErrorType::NONE,
+               success);
+    return;
+  }
+
   db_.SpendBudget(origin, GetCost(type),
                   base::Bind(&BudgetManager::DidReserve,
                              weak_ptr_factory_.GetWeakPtr(), origin, callback));
@@ -99,6 +108,12 @@ void BudgetManager::Consume(const url::Origin& origin,
 
   // If there wasn't a reservation already, try to directly consume budget.
   // The callback will return directly to the caller.
+  bool success = false;
+  if (db_.SpendCachedBudget(origin, GetCost(type), &success)) {
+    callback.Run(success);
+    return;
+  }
+
   db_.SpendBudget(origin, GetCost(type),
                   base::Bind(&BudgetManager::DidConsume,
                              weak_ptr_factory_.GetWeakPtr(), callback));
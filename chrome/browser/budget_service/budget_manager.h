@@ -55,6 +55,7 @@ class BudgetManager : public KeyedService {
                const ConsumeCallback& callback);
 
  private:
+  friend class BudgetManagerPerfTest;
   friend class BudgetManagerTest;
 
   void DidGetBudget(const GetBudgetCallback& callback,
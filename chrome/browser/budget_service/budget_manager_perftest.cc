@@ -0,0 +1,201 @@
+// Copyright 2017 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "base/files/file_path.h"
+#include "base/files/file_util.h"
+#include "base/macros.h"
+#include "base/run_loop.h"
+#include "base/strings/stringprintf.h"
+#include "base/threading/sequenced_worker_pool.h"
+#include "base/time/time.h"
+#include "chrome/browser/budget_service/budget_manager.h"
+#include "chrome/browser/budget_service/budget_manager_factory.h"
+#include "chrome/browser/engagement/site_engagement_score.h"
+#include "chrome/browser/engagement/site_engagement_service.h"
+#include "chrome/test/base/testing_profile.h"
+#include "content/public/browser/browser_thread.h"
+#include "content/public/test/test_browser_thread_bundle.h"
+#include "testing/gtest/include/gtest/gtest.h"
+#include "testing/perf/perf_test.h"
+#include "third_party/WebKit/public/platform/modules/budget_service/budget_service.mojom.h"
+#include "url/gurl.h"
+#include "url/origin.h"
+
+namespace {
+
+// The number of synthetic push-enabled origins.
+constexpr int kOriginCount = 500;
+
+// The number of push messages each origin receives during a storm.
+constexpr int kPushesPerOrigin = 8;
+
+const blink::mojom::BudgetOperationType kOperationType =
+    blink::mojom::BudgetOperationType::SILENT_PUSH;
+
+// Returns the |percentile|th latency of |latencies|, in milliseconds.
+double GetPercentile(std::vector<base::TimeDelta> latencies,
+                     double percentile) {
+  DCHECK(!latencies.empty());
+  std::sort(latencies.begin(), latencies.end());
+  size_t index = static_cast<size_t>(percentile / 100 * latencies.size());
+  return latencies[std::min(index, latencies.size() - 1)].InMillisecondsF();
+}
+
+void PrintLatencies(const std::string& trace,
+                    const std::vector<base::TimeDelta>& latencies) {
+  perf_test::PrintResult("budget_manager", "", trace + "_p50",
+                         GetPercentile(latencies, 50), "ms", true);
+  perf_test::PrintResult("budget_manager", "", trace + "_p99",
+                         GetPercentile(latencies, 99), "ms", true);
+}
+
+}  // namespace
+
+// Drives the BudgetManager against the on-disk database of a testing profile,
+// with a population of origins that all receive bursts of push messages.
+class BudgetManagerPerfTest : public testing::Test {
+ public:
+  BudgetManagerPerfTest() {}
+  ~BudgetManagerPerfTest() override {}
+
+  void SetUp() override {
+    // Give the origins a spread of engagement, so that some of them run out
+    // of budget during the storm.
+    SiteEngagementService* service = SiteEngagementService::Get(&profile_);
+    for (int i = 0; i < kOriginCount; ++i) {
+      GURL url(base::StringPrintf("https://origin%d.example.com", i));
+      origins_.push_back(url::Origin(url));
+      service->ResetBaseScoreForURL(
+          url, SiteEngagementScore::kMaxPoints * (i % 10 + 1) / 10);
+    }
+  }
+
+  BudgetManager* manager() {
+    return BudgetManagerFactory::GetForProfile(&profile_);
+  }
+
+  const std::vector<url::Origin>& origins() const { return origins_; }
+
+  base::TimeDelta TimeGetBudget(const url::Origin& origin) {
+    base::RunLoop run_loop;
+    base::TimeTicks start = base::TimeTicks::Now();
+    manager()->GetBudget(
+        origin, base::Bind(&BudgetManagerPerfTest::DidGetBudget,
+                           base::Unretained(this), run_loop.QuitClosure()));
+    run_loop.Run();
+    return base::TimeTicks::Now() - start;
+  }
+
+  base::TimeDelta TimeReserve(const url::Origin& origin) {
+    base::RunLoop run_loop;
+    base::TimeTicks start = base::TimeTicks::Now();
+    manager()->Reserve(
+        origin, kOperationType,
+        base::Bind(&BudgetManagerPerfTest::DidReserve, base::Unretained(this),
+                   run_loop.QuitClosure()));
+    run_loop.Run();
+    return base::TimeTicks::Now() - start;
+  }
+
+  base::TimeDelta TimeConsume(const url::Origin& origin) {
+    base::RunLoop run_loop;
+    base::TimeTicks start = base::TimeTicks::Now();
+    manager()->Consume(
+        origin, kOperationType,
+        base::Bind(&BudgetManagerPerfTest::DidConsume, base::Unretained(this),
+                   run_loop.QuitClosure()));
+    run_loop.Run();
+    return base::TimeTicks::Now() - start;
+  }
+
+  // Waits for all of the pending database writes to reach the disk.
+  void FlushDatabase() {
+    content::BrowserThread::GetBlockingPool()->FlushForTesting();
+    base::RunLoop().RunUntilIdle();
+  }
+
+  // The size of the database on disk. LevelDB appends every write to its log,
+  // so the growth of the database approximates the number of bytes written.
+  int64_t GetDatabaseSize() {
+    return base::ComputeDirectorySize(
+        profile_.GetPath().Append(FILE_PATH_LITERAL("BudgetDatabase")));
+  }
+
+  size_t GetCacheMemoryUsage() {
+    return manager()->db_.cache_memory_usage();
+  }
+
+ private:
+  void DidGetBudget(base::Closure run_loop_closure,
+                    blink::mojom::BudgetServiceErrorType error,
+                    std::vector<blink::mojom::BudgetStatePtr> budget) {
+    EXPECT_EQ(blink::mojom::BudgetServiceErrorType::NONE, error);
+    run_loop_closure.Run();
+  }
+
+  void DidReserve(base::Closure run_loop_closure,
+                  blink::mojom::BudgetServiceErrorType error,
+                  bool success) {
+    EXPECT_EQ(blink::mojom::BudgetServiceErrorType::NONE, error);
+    run_loop_closure.Run();
+  }
+
+  void DidConsume(base::Closure run_loop_closure, bool success) {
+    run_loop_closure.Run();
+  }
+
+  content::TestBrowserThreadBundle thread_bundle_;
+  TestingProfile profile_;
+  std::vector<url::Origin> origins_;
+
+  DISALLOW_COPY_AND_ASSIGN(BudgetManagerPerfTest);
+};
+
+TEST_F(BudgetManagerPerfTest, PushStorm) {
+  // The first query for each origin has to read it from the database.
+  std::vector<base::TimeDelta> cold_latencies;
+  for (const url::Origin& origin : origins())
+    cold_latencies.push_back(TimeGetBudget(origin));
+  PrintLatencies("get_budget_cold", cold_latencies);
+
+  FlushDatabase();
+  int64_t initial_database_size = GetDatabaseSize();
+
+  // Each push reserves budget when the message arrives and consumes the
+  // reservation when the event is dispatched. Every other push also consumes
+  // budget directly, as a message without a reservation would.
+  std::vector<base::TimeDelta> reserve_latencies;
+  std::vector<base::TimeDelta> consume_latencies;
+  for (int push = 0; push < kPushesPerOrigin; ++push) {
+    for (const url::Origin& origin : origins()) {
+      reserve_latencies.push_back(TimeReserve(origin));
+      consume_latencies.push_back(TimeConsume(origin));
+      if (push % 2)
+        consume_latencies.push_back(TimeConsume(origin));
+    }
+  }
+  PrintLatencies("reserve", reserve_latencies);
+  PrintLatencies("consume", consume_latencies);
+
+  std::vector<base::TimeDelta> warm_latencies;
+  for (const url::Origin& origin : origins())
+    warm_latencies.push_back(TimeGetBudget(origin));
+  PrintLatencies("get_budget_warm", warm_latencies);
+
+  FlushDatabase();
+  int64_t bytes_written =
+      std::max<int64_t>(0, GetDatabaseSize() - initial_database_size);
+  perf_test::PrintResult("budget_manager", "", "database_bytes_written",
+                         static_cast<size_t>(bytes_written), "bytes", true);
+  perf_test::PrintResult("budget_manager", "", "memory_per_cached_origin",
+                         GetCacheMemoryUsage() / origins().size(), "bytes",
+                         true);
+}
@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <string>
 
+#include "base/bind_helpers.h"
 #include "base/memory/ptr_util.h"
 #include "base/run_loop.h"
 #include "base/test/histogram_tester.h"
@@ -184,3 +185,30 @@ TEST_F(BudgetManagerTest, TestUniqueOrigin) {
   ASSERT_EQ(blink::mojom::BudgetServiceErrorType::NOT_SUPPORTED, error_);
   ASSERT_FALSE(ConsumeBudget(type));
 }
+
+TEST_F(BudgetManagerTest, ReserveCachedOriginSynchronously) {
+  const blink::mojom::BudgetOperationType type =
+      blink::mojom::BudgetOperationType::SILENT_PUSH;
+  SetSiteEngagementScore(kTestSES);
+
+  // Loading the origin into the cache has to wait for the database.
+  ASSERT_TRUE(GetBudget());
+
+  // Reserving and consuming budget for a cached origin replies immediately.
+  success_ = false;
+  GetManager()->Reserve(
+      origin(), type,
+      base::Bind(&BudgetManagerTest::ReserveCallback, base::Unretained(this),
+                 base::Bind(&base::DoNothing)));
+  EXPECT_TRUE(success_);
+
+  // The first consume uses the reservation, the second spends budget.
+  for (int i = 0; i < 2; i++) {
+    success_ = false;
+    GetManager()->Consume(
+        origin(), type,
+        base::Bind(&BudgetManagerTest::ConsumeCallback, base::Unretained(this),
+                   base::Bind(&base::DoNothing)));
+    EXPECT_TRUE(success_);
+  }
+}
@@ -5,10 +5,8 @@
 #include "chrome/browser/font_family_cache.h"
 
 #include <stddef.h>
+#include <string.h>
 
-#include <map>
-
-#include "base/strings/stringprintf.h"
 #include "base/strings/utf_string_conversions.h"
 #include "chrome/browser/chrome_notification_types.h"
 #include "chrome/browser/profiles/profile.h"
@@ -20,6 +18,20 @@
 // Identifies the user data on the profile.
 const char kFontFamilyCacheKey[] = "FontFamilyCacheKey";
 
+namespace {
+
+// Returns the compile time constant for |script|, or null if it isn't one of
+// prefs::kWebKitScriptsForFontFamilyMaps.
+const char* FindScript(const char* script) {
+  for (size_t i = 0; i < prefs::kWebKitScriptsForFontFamilyMapsLength; ++i) {
+    if (strcmp(script, prefs::kWebKitScriptsForFontFamilyMaps[i]) == 0)
+      return prefs::kWebKitScriptsForFontFamilyMaps[i];
+  }
+  return nullptr;
+}
+
+}  // namespace
+
 FontFamilyCache::FontFamilyCache(Profile* profile)
     : prefs_(profile->GetPrefs()) {
   profile_pref_registrar_.Init(profile->GetPrefs());
@@ -47,49 +59,47 @@ void FontFamilyCache::FillFontFamilyMap(Profile* profile,
 
 void FontFamilyCache::FillFontFamilyMap(const char* map_name,
                                         content::ScriptFontFamilyMap* map) {
-  // TODO(falken): Get rid of the brute-force scan over possible
-  // (font family / script) combinations - see http://crbug.com/308095.
-  for (size_t i = 0; i < prefs::kWebKitScriptsForFontFamilyMapsLength; ++i) {
-    const char* script = prefs::kWebKitScriptsForFontFamilyMaps[i];
-    base::string16 result = FetchAndCacheFont(script, map_name);
-    if (!result.empty())
-      (*map)[script] = result;
+  const ScriptFontMap& fonts = GetScriptFontMap(map_name);
+  for (ScriptFontMap::const_iterator it = fonts.begin(); it != fonts.end();
+       ++it) {
+    (*map)[it->first] = it->second;
   }
 }
 
-base::string16 FontFamilyCache::FetchFont(const char* script,
-                                          const char* map_name) {
-  std::string pref_name = base::StringPrintf("%s.%s", map_name, script);
-  std::string font = prefs_->GetString(pref_name.c_str());
-  base::string16 font16 = base::UTF8ToUTF16(font);
+base::string16 FontFamilyCache::FetchFont(const char* pref_name) {
+  return base::UTF8ToUTF16(prefs_->GetString(pref_name));
+}
+
+const FontFamilyCache::ScriptFontMap& FontFamilyCache::GetScriptFontMap(
+    const char* map_name) {
+  FontFamilyMap::const_iterator it = font_family_map_.find(map_name);
+  if (it != font_family_map_.end())
+    return it->second;
 
-  // Lazily constructs the map if it doesn't already exist.
   ScriptFontMap& map = font_family_map_[map_name];
-  map[script] = font16;
 
-  // Register for profile preference changes.
-  profile_pref_registrar_.Add(
-      pref_name.c_str(),
-      base::Bind(&FontFamilyCache::OnPrefsChanged, base::Unretained(this)));
-  return font16;
-}
+  // Reuse the same buffer for all of the preference names.
+  std::string pref_name(map_name);
+  pref_name.push_back('.');
+  const size_t map_name_length = pref_name.size();
+  for (size_t i = 0; i < prefs::kWebKitScriptsForFontFamilyMapsLength; ++i) {
+    const char* script = prefs::kWebKitScriptsForFontFamilyMaps[i];
+    pref_name.resize(map_name_length);
+    pref_name.append(script);
 
-base::string16 FontFamilyCache::FetchAndCacheFont(const char* script,
-                                                  const char* map_name) {
-  FontFamilyMap::const_iterator it = font_family_map_.find(map_name);
-  if (it != font_family_map_.end()) {
-    ScriptFontMap::const_iterator it2 = it->second.find(script);
-    if (it2 != it->second.end())
-      return it2->second;
-  }
+    base::string16 font = FetchFont(pref_name.c_str());
+    if (!font.empty())
+      map[script] = font;
 
-  return FetchFont(script, map_name);
+    // Scripts without a font are observed too, in case one is set.
+    profile_pref_registrar_.Add(
+        pref_name.c_str(),
+        base::Bind(&FontFamilyCache::OnPrefsChanged, base::Unretained(this)));
+  }
+  return map;
 }
 
-// There are ~1000 entries in the cache. Avoid unnecessary object construction,
-// including std::string.
 void FontFamilyCache::OnPrefsChanged(const std::string& pref_name) {
-  const size_t delimiter_length = 1;
   const char delimiter = '.';
   for (FontFamilyMap::iterator it = font_family_map_.begin();
        it != font_family_map_.end();
@@ -97,34 +107,23 @@ void FontFamilyCache::OnPrefsChanged(const std::string& pref_name) {
     const char* map_name = it->first;
     size_t map_name_length = strlen(map_name);
 
-    // If the map name doesn't match, move on.
-    if (pref_name.compare(0, map_name_length, map_name) != 0)
+    // If the map name or the delimiter don't match, move on.
+    if (pref_name.size() <= map_name_length ||
+        pref_name.compare(0, map_name_length, map_name) != 0 ||
+        pref_name[map_name_length] != delimiter) {
       continue;
-
-    ScriptFontMap& map = it->second;
-    for (ScriptFontMap::iterator it2 = map.begin(); it2 != map.end(); ++it2) {
-      const char* script = it2->first;
-      size_t script_length = strlen(script);
-
-      // If the length doesn't match, move on.
-      if (pref_name.size() !=
-          map_name_length + script_length + delimiter_length)
-        continue;
-
-      // If the script doesn't match, move on.
-      if (pref_name.compare(
-              map_name_length + delimiter_length, script_length, script) != 0)
-        continue;
-
-      // If the delimiter doesn't match, move on.
-      if (pref_name[map_name_length] != delimiter)
-        continue;
-
-      // Clear the cache and the observer.
-      map.erase(it2);
-      profile_pref_registrar_.Remove(pref_name.c_str());
-      break;
     }
+
+    const char* script = FindScript(pref_name.c_str() + map_name_length + 1);
+    if (!script)
+      return;
+
+    base::string16 font = FetchFont(pref_name.c_str());
+    if (font.empty())
+      it->second.erase(script);
+    else
+      it->second[script] = font;
+    return;
   }
 }
 
@@ -5,8 +5,9 @@
 #ifndef CHROME_BROWSER_FONT_FAMILY_CACHE_H_
 #define CHROME_BROWSER_FONT_FAMILY_CACHE_H_
 
+#include <string>
+
 #include "base/containers/hash_tables.h"
-#include "base/gtest_prod_util.h"
 #include "base/macros.h"
 #include "base/strings/string16.h"
 #include "base/supports_user_data.h"
@@ -18,12 +19,14 @@
 class PrefService;
 class Profile;
 
-FORWARD_DECLARE_TEST(FontFamilyCacheTest, Caching);
-
 // Caches font family preferences associated with a PrefService. This class
 // relies on the assumption that each concatenation of map_name + '.' + script
 // is a unique string. It also relies on the assumption that the (const char*)
 // keys used in both inner and outer hash_maps are compile time constants.
+//
+// Most scripts have no font preference, so for each font family the cache only
+// holds the scripts which do. It is built the first time the font family is
+// used, and then kept up to date as the preferences change.
 class FontFamilyCache : public base::SupportsUserData::Data,
                         public content::NotificationObserver {
  public:
@@ -35,19 +38,18 @@ class FontFamilyCache : public base::SupportsUserData::Data,
                                 const char* map_name,
                                 content::ScriptFontFamilyMap* map);
 
-  // Fills |map| with font family preferences.
+  // Fills |map| with font family preferences. |map_name| must be one of the
+  // font family map names in pref_font_webkit_names.h.
   void FillFontFamilyMap(const char* map_name,
                          content::ScriptFontFamilyMap* map);
 
  protected:
   // Exposed and virtual for testing.
   // Fetches the font without checking the cache.
-  virtual base::string16 FetchFont(const char* script, const char* map_name);
+  virtual base::string16 FetchFont(const char* pref_name);
 
  private:
-  FRIEND_TEST_ALL_PREFIXES(::FontFamilyCacheTest, Caching);
-
-  // Map from script to font.
+  // Map from script to font, for the scripts which have a font.
   // Key comparison uses pointer equality.
   typedef base::hash_map<const char*, base::string16> ScriptFontMap;
 
@@ -55,20 +57,17 @@ class FontFamilyCache : public base::SupportsUserData::Data,
   // Key comparison uses pointer equality.
   typedef base::hash_map<const char*, ScriptFontMap> FontFamilyMap;
 
-  // Checks the cache for the font. If not present, fetches the font and stores
-  // the result in the cache.
-  // This method needs to be very fast, because it's called ~20,000 times on a
-  // fresh launch with an empty profile. It's important to avoid unnecessary
-  // object construction, hence the heavy use of const char* and the minimal use
-  // of std::string.
-  // |script| and |map_name| must be compile time constants. Two behaviors rely
-  // on this: key comparison uses pointer equality, and keys must outlive the
-  // hash_maps.
-  base::string16 FetchAndCacheFont(const char* script, const char* map_name);
+  // Returns the fonts of |map_name|. The first call for a font family reads the
+  // preference of every script once, and observes them.
+  // This method needs to be very fast, because it's called for each font family
+  // every time WebPreferences are built. After the first call, it only costs a
+  // hash lookup.
+  // |map_name| must be a compile time constant. Two behaviors rely on this: key
+  // comparison uses pointer equality, and keys must outlive the hash_maps.
+  const ScriptFontMap& GetScriptFontMap(const char* map_name);
 
   // Called when font family preferences changed.
-  // Invalidates the cached entry, and removes the relevant observer.
-  // Note: It is safe to remove the observer from the pref change callback.
+  // Updates the font of the script in the cache.
   void OnPrefsChanged(const std::string& pref_name);
 
   // content::NotificationObserver override.
@@ -4,8 +4,12 @@
 
 #include "chrome/browser/font_family_cache.h"
 
+#include <string>
+
 #include "base/macros.h"
 #include "base/strings/utf_string_conversions.h"
+#include "chrome/common/pref_font_webkit_names.h"
+#include "chrome/common/pref_names.h"
 #include "chrome/test/base/testing_profile.h"
 #include "components/sync_preferences/testing_pref_service_syncable.h"
 #include "content/public/test/test_browser_thread_bundle.h"
@@ -18,9 +22,9 @@ class TestingFontFamilyCache : public FontFamilyCache {
   explicit TestingFontFamilyCache(Profile* profile)
       : FontFamilyCache(profile), fetch_font_count_(0) {}
   ~TestingFontFamilyCache() override {}
-  base::string16 FetchFont(const char* script, const char* map_name) override {
+  base::string16 FetchFont(const char* pref_name) override {
     ++fetch_font_count_;
-    return FontFamilyCache::FetchFont(script, map_name);
+    return FontFamilyCache::FetchFont(pref_name);
   }
 
   int fetch_font_count_;
@@ -29,9 +33,15 @@ class TestingFontFamilyCache : public FontFamilyCache {
   DISALLOW_COPY_AND_ASSIGN(TestingFontFamilyCache);
 };
 
+std::string GetFont(const content::ScriptFontFamilyMap& map,
+                    const char* script) {
+  content::ScriptFontFamilyMap::const_iterator it = map.find(script);
+  return it == map.end() ? std::string() : base::UTF16ToUTF8(it->second);
+}
+
 }  // namespace
 
-// Tests that the cache is correctly set and cleared.
+// Tests that the cache is correctly built and updated.
 TEST(FontFamilyCacheTest, Caching) {
   content::TestBrowserThreadBundle thread_bundle_;
   TestingProfile profile;
@@ -41,39 +51,48 @@ TEST(FontFamilyCacheTest, Caching) {
 
   std::string font1("font 1");
   std::string font2("font 2");
-  std::string map_name("webkit.webprefs.fonts.pictograph");
-  std::string script("Zzyxca");
-  std::string pref_name(map_name + '.' + script);
-  std::string pref_name2(map_name + '.' + "adsf");
-
-  // Registers 2 preferences, and sets the first one.
-  prefs->registry()->RegisterStringPref(pref_name.c_str(), std::string());
-  prefs->registry()->RegisterStringPref(pref_name2.c_str(), std::string());
+  const char* map_name = prefs::kWebKitPictographFontFamilyMap;
+  const char* script = prefs::kWebKitScriptsForFontFamilyMaps[0];
+  const char* script2 = prefs::kWebKitScriptsForFontFamilyMaps[1];
+  std::string pref_name(std::string(map_name) + '.' + script);
+  std::string pref_name2(std::string(map_name) + '.' + script2);
+
   prefs->SetString(pref_name.c_str(), font1.c_str());
+  prefs->SetString(pref_name2.c_str(), std::string());
 
-  // Check that the right preference is returned.
-  std::string result = base::UTF16ToUTF8(
-      cache.FetchAndCacheFont(script.c_str(), map_name.c_str()));
-  EXPECT_EQ(font1, result);
-  EXPECT_EQ(1, cache.fetch_font_count_);
+  // The first use reads the preference of every script once.
+  content::ScriptFontFamilyMap map;
+  cache.FillFontFamilyMap(map_name, &map);
+  EXPECT_EQ(font1, GetFont(map, script));
+  EXPECT_EQ(0u, map.count(script2));
+  EXPECT_EQ(static_cast<int>(prefs::kWebKitScriptsForFontFamilyMapsLength),
+            cache.fetch_font_count_);
 
   // Check that the second access uses the cache.
-  result = base::UTF16ToUTF8(
-      cache.FetchAndCacheFont(script.c_str(), map_name.c_str()));
-  EXPECT_EQ(font1, result);
-  EXPECT_EQ(1, cache.fetch_font_count_);
+  int fetch_font_count = cache.fetch_font_count_;
+  map.clear();
+  cache.FillFontFamilyMap(map_name, &map);
+  EXPECT_EQ(font1, GetFont(map, script));
+  EXPECT_EQ(fetch_font_count, cache.fetch_font_count_);
 
-  // Changing another preference should have no effect.
+  // Setting the font of a script without one adds it to the cache.
   prefs->SetString(pref_name2.c_str(), "katy perry");
-  result = base::UTF16ToUTF8(
-      cache.FetchAndCacheFont(script.c_str(), map_name.c_str()));
-  EXPECT_EQ(font1, result);
-  EXPECT_EQ(1, cache.fetch_font_count_);
+  EXPECT_EQ(fetch_font_count + 1, cache.fetch_font_count_);
+  map.clear();
+  cache.FillFontFamilyMap(map_name, &map);
+  EXPECT_EQ(font1, GetFont(map, script));
+  EXPECT_EQ("katy perry", GetFont(map, script2));
 
-  // Changing the preferences invalidates the cache.
+  // Changing the preferences updates the cache.
   prefs->SetString(pref_name.c_str(), font2.c_str());
-  result = base::UTF16ToUTF8(
-      cache.FetchAndCacheFont(script.c_str(), map_name.c_str()));
-  EXPECT_EQ(font2, result);
-  EXPECT_EQ(2, cache.fetch_font_count_);
+  map.clear();
+  cache.FillFontFamilyMap(map_name, &map);
+  EXPECT_EQ(font2, GetFont(map, script));
+
+  // Scripts whose font is cleared are dropped from the cache.
+  prefs->SetString(pref_name.c_str(), std::string());
+  map.clear();
+  cache.FillFontFamilyMap(map_name, &map);
+  EXPECT_EQ(0u, map.count(script));
+  EXPECT_EQ(fetch_font_count + 3, cache.fetch_font_count_);
 }
@@ -14,12 +14,34 @@ using content::BrowserThread;
 IconLoader* IconLoader::Create(const base::FilePath& file_path,
                                IconSize size,
                                IconLoadedCallback callback) {
-  return new IconLoader(file_path, size, callback);
+  return new IconLoader(file_path, IconGroup(), size, callback);
+}
+
+// static
+IconLoader* IconLoader::CreateForGroup(const IconGroup& group,
+                                       IconSize size,
+                                       IconLoadedCallback callback) {
+  return new IconLoader(base::FilePath(), group, size, callback);
+}
+
+// static
+void IconLoader::ReadGroups(const std::vector<base::FilePath>& file_paths,
+                            const GroupsReadCallback& callback) {
+  BrowserThread::PostTaskAndReplyWithResult(
+      BrowserThread::FILE, FROM_HERE,
+      base::Bind(&IconLoader::GroupsForFilepaths, file_paths), callback);
 }
 
 void IconLoader::Start() {
   target_task_runner_ = base::ThreadTaskRunnerHandle::Get();
 
+  // The group is already known if the loader was created with
+  // CreateForGroup().
+  if (file_path_.empty()) {
+    OnReadGroup();
+    return;
+  }
+
   BrowserThread::PostTaskAndReply(
       BrowserThread::FILE, FROM_HERE,
       base::Bind(&IconLoader::ReadGroup, base::Unretained(this)),
@@ -27,12 +49,26 @@ void IconLoader::Start() {
 }
 
 IconLoader::IconLoader(const base::FilePath& file_path,
+                       const IconGroup& group,
                        IconSize size,
                        IconLoadedCallback callback)
-    : file_path_(file_path), icon_size_(size), callback_(callback) {}
+    : file_path_(file_path),
+      group_(group),
+      icon_size_(size),
+      callback_(callback) {}
 
 IconLoader::~IconLoader() {}
 
+// static
+std::vector<IconLoader::IconGroup> IconLoader::GroupsForFilepaths(
+    const std::vector<base::FilePath>& file_paths) {
+  std::vector<IconGroup> groups;
+  groups.reserve(file_paths.size());
+  for (const base::FilePath& file_path : file_paths)
+    groups.push_back(GroupForFilepath(file_path));
+  return groups;
+}
+
 void IconLoader::ReadGroup() {
   group_ = GroupForFilepath(file_path_);
 }
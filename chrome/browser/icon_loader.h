@@ -7,6 +7,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "base/callback.h"
 #include "base/files/file_path.h"
@@ -45,19 +46,37 @@ class IconLoader {
   using IconLoadedCallback =
       base::Callback<void(std::unique_ptr<gfx::Image>, const IconGroup&)>;
 
+  // The callback invoked with the groups of the files passed to ReadGroups(),
+  // in the same order.
+  using GroupsReadCallback =
+      base::Callback<void(const std::vector<IconGroup>&)>;
+
   // Creates an IconLoader, which owns itself. If the IconLoader might outlive
   // the caller, be sure to use a weak pointer in the |callback|.
   static IconLoader* Create(const base::FilePath& file_path,
                             IconSize size,
                             IconLoadedCallback callback);
 
+  // Creates an IconLoader for the icon of |group|, which skips determining the
+  // group of a file.
+  static IconLoader* CreateForGroup(const IconGroup& group,
+                                    IconSize size,
+                                    IconLoadedCallback callback);
+
   // Starts the process of reading the icon. When the reading of the icon is
   // complete, the IconLoadedCallback callback will be fulfilled, and the
   // IconLoader will delete itself.
   void Start();
 
+  // Determines the groups of all of |file_paths| in a single task on the file
+  // thread, and runs |callback| on the calling thread. This is much cheaper
+  // than starting an IconLoader per file when many files share a few groups.
+  static void ReadGroups(const std::vector<base::FilePath>& file_paths,
+                         const GroupsReadCallback& callback);
+
  private:
   IconLoader(const base::FilePath& file_path,
+             const IconGroup& group,
              IconSize size,
              IconLoadedCallback callback);
 
@@ -66,6 +85,9 @@ class IconLoader {
   // Given a file path, get the group for the given file.
   static IconGroup GroupForFilepath(const base::FilePath& file_path);
 
+  static std::vector<IconGroup> GroupsForFilepaths(
+      const std::vector<base::FilePath>& file_paths);
+
   // The thread ReadIcon() should be called on.
   static content::BrowserThread::ID ReadIconThreadID();
 
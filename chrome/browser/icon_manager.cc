@@ -4,16 +4,95 @@
 
 #include "chrome/browser/icon_manager.h"
 
+#include <algorithm>
 #include <memory>
+#include <set>
+#include <string>
 #include <tuple>
+#include <utility>
+#include <vector>
 
 #include "base/bind.h"
+#include "base/location.h"
+#include "base/logging.h"
+#include "base/metrics/histogram_macros.h"
+#include "base/strings/string_number_conversions.h"
 #include "base/task_runner.h"
+#include "base/threading/thread_task_runner_handle.h"
+#include "base/time/time.h"
+#include "base/values.h"
+#include "chrome/browser/after_startup_task_utils.h"
+#include "components/prefs/pref_registry_simple.h"
+#include "components/prefs/pref_service.h"
+#include "components/prefs/scoped_user_pref_update.h"
 #include "third_party/skia/include/core/SkBitmap.h"
 #include "third_party/skia/include/core/SkCanvas.h"
 
 namespace {
 
+// The number of files whose group is remembered. This covers a long list of
+// downloads.
+const size_t kMaxGroupCacheEntries = 2000;
+
+// The budget for the cached icons, which are typically 16 to 48 pixels wide.
+const size_t kMaxIconCacheBytes = 2 * 1024 * 1024;
+
+// A dictionary in local state from "<size> <group>" to the number of times the
+// icon was requested.
+const char kIconUsagePref[] = "icon_manager.usage";
+
+// The number of icons whose usage is remembered.
+const size_t kMaxTrackedIcons = 64;
+
+// How long the usage of the icons is counted in memory before it is written to
+// local state.
+const int kUsageWriteDelaySeconds = 60;
+
+// All the usage counts are halved once one of them exceeds this, so that icons
+// which are no longer used are eventually overtaken by new ones.
+const int kMaxUsageCount = 1000;
+
+// The number of most used icons loaded after startup, and the pause between
+// two of them.
+const size_t kWarmUpIconCount = 8;
+const int kWarmUpIntervalMs = 200;
+
+// Returns false for groups which are not worth remembering across restarts:
+// per-instance groups on Windows are the full paths of the files themselves.
+// Other groups, such as MIME types, may contain separators too.
+bool IsSharedGroup(const IconLoader::IconGroup& group) {
+  return !base::FilePath(group).IsAbsolute();
+}
+
+std::string GetUsageKey(const IconLoader::IconGroup& group,
+                        IconLoader::IconSize size) {
+  return base::IntToString(size) + " " + base::FilePath(group).AsUTF8Unsafe();
+}
+
+bool ParseUsageKey(const std::string& usage_key,
+                   IconLoader::IconGroup* group,
+                   IconLoader::IconSize* size) {
+  size_t separator = usage_key.find(' ');
+  int size_value = 0;
+  if (separator == std::string::npos ||
+      !base::StringToInt(usage_key.substr(0, separator), &size_value) ||
+      size_value < IconLoader::SMALL || size_value > IconLoader::ALL) {
+    return false;
+  }
+  *group = base::FilePath::FromUTF8Unsafe(usage_key.substr(separator + 1))
+               .value();
+  *size = static_cast<IconLoader::IconSize>(size_value);
+  return IsSharedGroup(*group);
+}
+
+// Approximates the memory held by |image| by the size of its pixels at the
+// default scale.
+size_t GetImageByteSize(const gfx::Image& image) {
+  if (image.IsEmpty())
+    return 0;
+  return 4u * image.Width() * image.Height();
+}
+
 void RunCallbackIfNotCanceled(
     const base::CancelableTaskTracker::IsCanceledCallback& is_canceled,
     const IconManager::IconRequestCallback& callback,
@@ -23,25 +102,62 @@ void RunCallbackIfNotCanceled(
   callback.Run(image);
 }
 
+void RunBatchCallbackIfNotCanceled(
+    const base::CancelableTaskTracker::IsCanceledCallback& is_canceled,
+    const IconManager::IconBatchRequestCallback& callback,
+    const std::vector<gfx::Image>& images) {
+  if (is_canceled.Run())
+    return;
+  callback.Run(images);
+}
+
 }  // namespace
 
-IconManager::IconManager() : weak_factory_(this) {}
+IconManager::IconManager(PrefService* local_state)
+    : group_cache_(kMaxGroupCacheEntries),
+      icon_cache_(
+          base::MRUCache<CacheKey, std::unique_ptr<CachedIcon>>::NO_AUTO_EVICT),
+      icon_cache_bytes_(0),
+      cache_hit_count_(0),
+      cache_miss_count_(0),
+      memory_pressure_listener_(new base::MemoryPressureListener(
+          base::Bind(&IconManager::OnMemoryPressure, base::Unretained(this)))),
+      local_state_(local_state),
+      next_batch_id_(0),
+      weak_factory_(this) {}
 
 IconManager::~IconManager() {
 }
 
+// static
+void IconManager::RegisterPrefs(PrefRegistrySimple* registry) {
+  registry->RegisterDictionaryPref(kIconUsagePref);
+}
+
+void IconManager::WarmUpCacheAfterStartup() {
+  if (!local_state_)
+    return;
+  AfterStartupTaskUtils::PostTask(
+      FROM_HERE, base::ThreadTaskRunnerHandle::Get(),
+      base::Bind(&IconManager::WarmUpCache, weak_factory_.GetWeakPtr()));
+}
+
 gfx::Image* IconManager::LookupIconFromFilepath(const base::FilePath& file_path,
                                                 IconLoader::IconSize size) {
-  auto group_it = group_cache_.find(file_path);
-  if (group_it == group_cache_.end())
-    return nullptr;
+  auto group_it = group_cache_.Get(file_path);
+  auto icon_it = icon_cache_.end();
+  if (group_it != group_cache_.end())
+    icon_it = icon_cache_.Get(CacheKey(group_it->second, size));
 
-  CacheKey key(group_it->second, size);
-  auto icon_it = icon_cache_.find(key);
-  if (icon_it == icon_cache_.end())
+  bool hit = icon_it != icon_cache_.end();
+  UMA_HISTOGRAM_BOOLEAN("IconManager.LookupHit", hit);
+  if (!hit) {
+    ++cache_miss_count_;
     return nullptr;
+  }
 
-  return icon_it->second.get();
+  ++cache_hit_count_;
+  return icon_it->second->image.get();
 }
 
 base::CancelableTaskTracker::TaskId IconManager::LoadIcon(
@@ -55,33 +171,326 @@ base::CancelableTaskTracker::TaskId IconManager::LoadIcon(
   IconRequestCallback callback_runner = base::Bind(
       &RunCallbackIfNotCanceled, is_canceled, callback);
 
-  IconLoader* loader = IconLoader::Create(
-      file_path, size,
-      base::Bind(&IconManager::OnIconLoaded, weak_factory_.GetWeakPtr(),
-                 callback_runner, file_path, size));
-  loader->Start();
+  ReadGroups(std::vector<base::FilePath>(1, file_path),
+             base::Bind(&IconManager::OnGroupRead, weak_factory_.GetWeakPtr(),
+                        callback_runner, file_path, size));
+
+  return id;
+}
+
+base::CancelableTaskTracker::TaskId IconManager::LoadIcons(
+    const std::vector<base::FilePath>& file_paths,
+    IconLoader::IconSize size,
+    const IconBatchRequestCallback& callback,
+    base::CancelableTaskTracker* tracker) {
+  base::CancelableTaskTracker::IsCanceledCallback is_canceled;
+  base::CancelableTaskTracker::TaskId id =
+      tracker->NewTrackedTaskId(&is_canceled);
 
+  int batch_id = next_batch_id_++;
+  std::unique_ptr<IconBatch> batch(new IconBatch);
+  batch->file_paths = file_paths;
+  batch->size = size;
+  batch->callback =
+      base::Bind(&RunBatchCallbackIfNotCanceled, is_canceled, callback);
+  batches_[batch_id] = std::move(batch);
+
+  ReadGroups(file_paths, base::Bind(&IconManager::OnBatchGroupsRead,
+                                    weak_factory_.GetWeakPtr(), batch_id));
   return id;
 }
 
-void IconManager::OnIconLoaded(IconRequestCallback callback,
-                               base::FilePath file_path,
-                               IconLoader::IconSize size,
+void IconManager::OnBatchGroupsRead(
+    int batch_id,
+    const std::vector<IconLoader::IconGroup>& groups) {
+  IconBatch* batch = batches_[batch_id].get();
+  DCHECK_EQ(batch->file_paths.size(), groups.size());
+  batch->groups = groups;
+
+  std::vector<CacheKey> keys;
+  for (const IconLoader::IconGroup& group : groups)
+    keys.push_back(CacheKey(group, batch->size));
+  RecordUsage(keys);
+
+  for (size_t i = 0; i < groups.size(); ++i) {
+    group_cache_.Put(batch->file_paths[i], groups[i]);
+    if (batch->icons.count(groups[i]))
+      continue;
+
+    auto icon_it = icon_cache_.Get(CacheKey(groups[i], batch->size));
+    if (icon_it != icon_cache_.end()) {
+      batch->icons[groups[i]] = *icon_it->second->image;
+      continue;
+    }
+
+    batch->icons[groups[i]] = gfx::Image();
+    ++batch->pending_loads;
+    LoadGroupIcon(CacheKey(groups[i], batch->size),
+                  base::Bind(&IconManager::OnBatchIconLoaded,
+                             base::Unretained(this), batch_id, groups[i]));
+  }
+
+  if (!batch->pending_loads)
+    FinishBatch(batch_id);
+}
+
+void IconManager::OnBatchIconLoaded(int batch_id,
+                                    IconLoader::IconGroup group,
+                                    gfx::Image* image) {
+  IconBatch* batch = batches_[batch_id].get();
+  if (image)
+    batch->icons[group] = *image;
+
+  if (!--batch->pending_loads)
+    FinishBatch(batch_id);
+}
+
+void IconManager::FinishBatch(int batch_id) {
+  auto batch_it = batches_.find(batch_id);
+  std::unique_ptr<IconBatch> batch = std::move(batch_it->second);
+  batches_.erase(batch_it);
+
+  std::vector<gfx::Image> images;
+  images.reserve(batch->groups.size());
+  for (const IconLoader::IconGroup& group : batch->groups)
+    images.push_back(batch->icons[group]);
+  batch->callback.Run(images);
+}
+
+void IconManager::OnGroupRead(
+    IconRequestCallback callback,
+    base::FilePath file_path,
+    IconLoader::IconSize size,
+    const std::vector<IconLoader::IconGroup>& groups) {
+  DCHECK_EQ(1u, groups.size());
+  group_cache_.Put(file_path, groups[0]);
+
+  CacheKey key(groups[0], size);
+  RecordUsage(std::vector<CacheKey>(1, key));
+  LoadGroupIcon(key, callback);
+}
+
+void IconManager::LoadGroupIcon(const CacheKey& key,
+                                const IconRequestCallback& callback) {
+  auto pending_it = pending_loads_.find(key);
+  if (pending_it != pending_loads_.end()) {
+    pending_it->second.push_back(callback);
+    return;
+  }
+
+  pending_loads_[key].push_back(callback);
+  StartIconLoader(
+      key.group, key.size,
+      base::Bind(&IconManager::OnIconLoaded, weak_factory_.GetWeakPtr(), key));
+}
+
+void IconManager::ReadGroups(const std::vector<base::FilePath>& file_paths,
+                             const IconLoader::GroupsReadCallback& callback) {
+  IconLoader::ReadGroups(file_paths, callback);
+}
+
+void IconManager::StartIconLoader(
+    const IconLoader::IconGroup& group,
+    IconLoader::IconSize size,
+    const IconLoader::IconLoadedCallback& callback) {
+  IconLoader::CreateForGroup(group, size, callback)->Start();
+}
+
+void IconManager::OnIconLoaded(CacheKey key,
                                std::unique_ptr<gfx::Image> result,
                                const IconLoader::IconGroup& group) {
+  auto pending_it = pending_loads_.find(key);
+  std::vector<IconRequestCallback> callbacks = std::move(pending_it->second);
+  pending_loads_.erase(pending_it);
+
+  for (const IconRequestCallback& callback : callbacks)
+    callback.Run(result.get());
+
   // Cache the bitmap. Watch out: |result| may be null, which indicates a
   // failure. We assume that if we have an entry in |icon_cache_| it must not be
   // null.
-  CacheKey key(group, size);
-  if (result) {
-    callback.Run(result.get());
-    icon_cache_[key] = std::move(result);
-  } else {
-    callback.Run(nullptr);
-    icon_cache_.erase(key);
+  if (result)
+    AddIcon(key, std::move(result));
+  else
+    RemoveIcon(key);
+}
+
+void IconManager::RecordUsage(const std::vector<CacheKey>& keys) {
+  if (!local_state_)
+    return;
+
+  // A request counts once for each distinct icon, however many of its files
+  // share the icon.
+  std::set<std::string> used_keys;
+  for (const CacheKey& key : keys) {
+    if (!IsSharedGroup(key.group))
+      continue;
+    std::string usage_key = GetUsageKey(key.group, key.size);
+    if (used_keys.insert(usage_key).second)
+      ++unwritten_usage_[usage_key];
+  }
+
+  // Every write walks the whole dictionary and notifies the observers of local
+  // state, so the usage is written in batches rather than for every request.
+  if (!unwritten_usage_.empty() && !usage_write_timer_.IsRunning()) {
+    usage_write_timer_.Start(
+        FROM_HERE, base::TimeDelta::FromSeconds(kUsageWriteDelaySeconds),
+        base::Bind(&IconManager::WriteUsage, base::Unretained(this)));
+  }
+}
+
+void IconManager::WriteUsage() {
+  usage_write_timer_.Stop();
+  if (unwritten_usage_.empty())
+    return;
+
+  DictionaryPrefUpdate update(local_state_, kIconUsagePref);
+  base::DictionaryValue* usage = update.Get();
+
+  bool age_counts = false;
+  for (const auto& unwritten : unwritten_usage_) {
+    // Groups may contain dots, which must not be taken for paths.
+    int count = 0;
+    usage->GetIntegerWithoutPathExpansion(unwritten.first, &count);
+    count += unwritten.second;
+    usage->SetIntegerWithoutPathExpansion(unwritten.first, count);
+    age_counts |= count > kMaxUsageCount;
+  }
+
+  if (age_counts) {
+    std::vector<std::pair<std::string, int>> counts;
+    for (base::DictionaryValue::Iterator it(*usage); !it.IsAtEnd();
+         it.Advance()) {
+      int count = 0;
+      it.value().GetAsInteger(&count);
+      counts.push_back(std::make_pair(it.key(), count));
+    }
+    // Round up, so that every tracked icon keeps a count of at least 1.
+    for (const auto& count : counts) {
+      usage->SetIntegerWithoutPathExpansion(count.first,
+                                            (count.second + 1) / 2);
+    }
+  }
+
+  // Forget the least used icons. The icons used since the last write are kept
+  // unless there are too many of them, as a new icon would otherwise be
+  // forgotten as soon as it is first written.
+  while (usage->size() > kMaxTrackedIcons) {
+    bool keep_unwritten_keys = usage->size() > unwritten_usage_.size();
+    std::string least_used;
+    int least_count = 0;
+    for (base::DictionaryValue::Iterator it(*usage); !it.IsAtEnd();
+         it.Advance()) {
+      if (keep_unwritten_keys && unwritten_usage_.count(it.key()))
+        continue;
+      int count = 0;
+      it.value().GetAsInteger(&count);
+      if (least_used.empty() || count < least_count) {
+        least_used = it.key();
+        least_count = count;
+      }
+    }
+    usage->RemoveWithoutPathExpansion(least_used, nullptr);
+  }
+
+  unwritten_usage_.clear();
+}
+
+void IconManager::WarmUpCache() {
+  const base::DictionaryValue* usage =
+      local_state_->GetDictionary(kIconUsagePref);
+  std::vector<std::pair<int, CacheKey>> icons;
+  for (base::DictionaryValue::Iterator it(*usage); !it.IsAtEnd();
+       it.Advance()) {
+    IconLoader::IconGroup group;
+    IconLoader::IconSize size = IconLoader::SMALL;
+    int count = 0;
+    if (ParseUsageKey(it.key(), &group, &size) &&
+        it.value().GetAsInteger(&count)) {
+      icons.push_back(std::make_pair(count, CacheKey(group, size)));
+    }
   }
 
-  group_cache_[file_path] = group;
+  size_t warm_up_count = std::min(icons.size(), kWarmUpIconCount);
+  std::partial_sort(icons.begin(), icons.begin() + warm_up_count, icons.end(),
+                    [](const std::pair<int, CacheKey>& a,
+                       const std::pair<int, CacheKey>& b) {
+                      return a.first > b.first;
+                    });
+  for (size_t i = 0; i < warm_up_count; ++i)
+    warm_up_queue_.push_back(icons[i].second);
+
+  WarmUpNextIcon();
+}
+
+void IconManager::WarmUpNextIcon() {
+  // Icons may have been loaded for other requests in the meantime.
+  while (!warm_up_queue_.empty() &&
+         icon_cache_.Peek(warm_up_queue_.front()) != icon_cache_.end()) {
+    warm_up_queue_.pop_front();
+  }
+  if (warm_up_queue_.empty())
+    return;
+
+  CacheKey key = warm_up_queue_.front();
+  warm_up_queue_.pop_front();
+  LoadGroupIcon(key, base::Bind(&IconManager::OnWarmUpIconLoaded,
+                                base::Unretained(this)));
+}
+
+void IconManager::OnWarmUpIconLoaded(gfx::Image* image) {
+  // Give input and painting a chance to run before the next icon, since on
+  // some platforms icons are loaded on the UI thread.
+  base::ThreadTaskRunnerHandle::Get()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&IconManager::WarmUpNextIcon, weak_factory_.GetWeakPtr()),
+      base::TimeDelta::FromMilliseconds(kWarmUpIntervalMs));
+}
+
+void IconManager::AddIcon(const CacheKey& key,
+                          std::unique_ptr<gfx::Image> image) {
+  RemoveIcon(key);
+
+  std::unique_ptr<CachedIcon> icon(new CachedIcon(std::move(image)));
+  if (icon->byte_size > kMaxIconCacheBytes)
+    return;
+  EvictIconsToSize(kMaxIconCacheBytes - icon->byte_size);
+
+  icon_cache_bytes_ += icon->byte_size;
+  icon_cache_.Put(key, std::move(icon));
+}
+
+void IconManager::RemoveIcon(const CacheKey& key) {
+  auto it = icon_cache_.Peek(key);
+  if (it == icon_cache_.end())
+    return;
+  icon_cache_bytes_ -= it->second->byte_size;
+  icon_cache_.Erase(it);
+}
+
+void IconManager::EvictIconsToSize(size_t max_bytes) {
+  while (icon_cache_bytes_ > max_bytes) {
+    auto oldest = icon_cache_.rbegin();
+    icon_cache_bytes_ -= oldest->second->byte_size;
+    icon_cache_.Erase(oldest);
+  }
+}
+
+void IconManager::OnMemoryPressure(
+    base::MemoryPressureListener::MemoryPressureLevel memory_pressure_level) {
+  switch (memory_pressure_level) {
+    case base::MemoryPressureListener::MEMORY_PRESSURE_LEVEL_NONE:
+      break;
+    case base::MemoryPressureListener::MEMORY_PRESSURE_LEVEL_MODERATE:
+      // Keep the most recently used half, which is likely still on screen.
+      EvictIconsToSize(icon_cache_bytes_ / 2);
+      group_cache_.ShrinkToSize(group_cache_.size() / 2);
+      break;
+    case base::MemoryPressureListener::MEMORY_PRESSURE_LEVEL_CRITICAL:
+      EvictIconsToSize(0);
+      group_cache_.Clear();
+      break;
+  }
 }
 
 IconManager::CacheKey::CacheKey(const IconLoader::IconGroup& group,
@@ -91,3 +500,12 @@ IconManager::CacheKey::CacheKey(const IconLoader::IconGroup& group,
 bool IconManager::CacheKey::operator<(const CacheKey &other) const {
   return std::tie(group, size) < std::tie(other.group, other.size);
 }
+
+IconManager::IconBatch::IconBatch() : pending_loads(0) {}
+
+IconManager::IconBatch::~IconBatch() {}
+
+IconManager::CachedIcon::CachedIcon(std::unique_ptr<gfx::Image> image)
+    : image(std::move(image)), byte_size(GetImageByteSize(*this->image)) {}
+
+IconManager::CachedIcon::~CachedIcon() {}
@@ -32,33 +32,66 @@
 //   1. A quick, synchronous check of its caches which does not touch the disk:
 //      IconManager::LookupIcon()
 //   2. An asynchronous icon load from a file on the file thread:
-//      IconManager::LoadIcon()
+//      IconManager::LoadIcon(), or IconManager::LoadIcons() for many files
 //
 // When using the second (asynchronous) method, callers must supply a callback
 // which will be run once the icon has been extracted. The icon manager will
 // cache the results of the icon extraction so that subsequent lookups will be
 // fast.
 //
+// The IconManager remembers in local state which icons are loaded most often,
+// and loads them again after the next startup, so that the first look at the
+// downloads doesn't have to wait for them.
+//
 // Icon bitmaps returned should be treated as const since they may be referenced
 // by other clients. Make a copy of the icon if you need to modify it.
+//
+// Both caches are bounded, and the least recently used entries are dropped
+// when they grow too large or when the system is low on memory. Icons returned
+// by the IconManager must therefore not be kept.
 
 #ifndef CHROME_BROWSER_ICON_MANAGER_H_
 #define CHROME_BROWSER_ICON_MANAGER_H_
 
+#include <stddef.h>
+
+#include <deque>
 #include <map>
 #include <memory>
+#include <string>
+#include <vector>
 
+#include "base/containers/mru_cache.h"
 #include "base/files/file_path.h"
 #include "base/macros.h"
+#include "base/memory/memory_pressure_listener.h"
 #include "base/memory/weak_ptr.h"
 #include "base/task/cancelable_task_tracker.h"
+#include "base/timer/timer.h"
 #include "chrome/browser/icon_loader.h"
 #include "ui/gfx/image/image.h"
 
+class PrefRegistrySimple;
+class PrefService;
+
 class IconManager {
  public:
-  IconManager();
-  ~IconManager();
+  // |local_state| keeps the usage of the icons across restarts. It may be null,
+  // in which case no icons are loaded after startup.
+  explicit IconManager(PrefService* local_state);
+  virtual ~IconManager();
+
+  static void RegisterPrefs(PrefRegistrySimple* registry);
+
+  // Loads the icons used most often in previous sessions, once browser startup
+  // is complete. The icons are loaded one at a time, with a pause in between,
+  // so that the UI thread stays responsive.
+  void WarmUpCacheAfterStartup();
+
+  // Writes the usage of the icons counted since the last write to local state.
+  // This happens periodically, and must also be done before local state is
+  // committed at shutdown.
+  void WriteUsage();
 
   // Synchronous call to examine the internal caches for the icon. Returns the
   // icon if we have already loaded it, or null if we don't have it and must
@@ -72,7 +105,8 @@ class IconManager {
 
   // Asynchronous call to lookup and return the icon associated with file. The
   // work is done on the file thread, with the callbacks running on the thread
-  // this function is called.
+  // this function is called. Calls made while the same icon is being loaded
+  // share that load.
   //
   // Note:
   // 1. This does *not* check the cache.
@@ -86,13 +120,46 @@ class IconManager {
       const IconRequestCallback& callback,
       base::CancelableTaskTracker* tracker);
 
- private:
-  void OnIconLoaded(IconRequestCallback callback,
-                    base::FilePath file_path,
-                    IconLoader::IconSize size,
-                    std::unique_ptr<gfx::Image> result,
-                    const IconLoader::IconGroup& group);
+  // Called with the icons of the files passed to LoadIcons(), in the same
+  // order. The icon of a file is empty if it could not be loaded.
+  using IconBatchRequestCallback =
+      base::Callback<void(const std::vector<gfx::Image>&)>;
+
+  // Asynchronous call to load the icons of many files, such as a long list of
+  // downloads. The groups of all of |file_paths| are determined in a single
+  // task on the file thread, then the icon of each distinct group is loaded
+  // once and shared by all the files of that group, and by any other pending
+  // request for the same icon. |callback| is run on the thread this function
+  // is called, once every icon is available.
+  //
+  // Like LoadIcon(), this does *not* check the cache for the groups of the
+  // files, but icons already in the cache are not loaded again.
+  base::CancelableTaskTracker::TaskId LoadIcons(
+      const std::vector<base::FilePath>& file_paths,
+      IconLoader::IconSize size,
+      const IconBatchRequestCallback& callback,
+      base::CancelableTaskTracker* tracker);
+
+  // Statistics for LookupIconFromFilepath(): lookups which found the icon, and
+  // lookups which didn't.
+  int cache_hit_count() const { return cache_hit_count_; }
+  int cache_miss_count() const { return cache_miss_count_; }
+
+  // The approximate number of bytes of pixels held by the icon cache.
+  size_t icon_cache_bytes() const { return icon_cache_bytes_; }
+
+ protected:
+  // Determines the groups of |file_paths| on the file thread. Virtual for
+  // testing.
+  virtual void ReadGroups(const std::vector<base::FilePath>& file_paths,
+                          const IconLoader::GroupsReadCallback& callback);
+
+  // Starts an IconLoader for the icon of |group|. Virtual for testing.
+  virtual void StartIconLoader(const IconLoader::IconGroup& group,
+                               IconLoader::IconSize size,
+                               const IconLoader::IconLoadedCallback& callback);
 
+ private:
   struct CacheKey {
     CacheKey(const IconLoader::IconGroup& group, IconLoader::IconSize size);
 
@@ -103,8 +170,99 @@ class IconManager {
     IconLoader::IconSize size;
   };
 
-  std::map<base::FilePath, IconLoader::IconGroup> group_cache_;
-  std::map<CacheKey, std::unique_ptr<gfx::Image>> icon_cache_;
+  // Counts a use of each distinct icon of |keys|, to be written to local state
+  // by WriteUsage().
+  void RecordUsage(const std::vector<CacheKey>& keys);
+
+  void WarmUpCache();
+  void WarmUpNextIcon();
+  void OnWarmUpIconLoaded(gfx::Image* image);
+
+  void OnGroupRead(IconRequestCallback callback,
+                   base::FilePath file_path,
+                   IconLoader::IconSize size,
+                   const std::vector<IconLoader::IconGroup>& groups);
+
+  // Loads the icon for |key|, and runs |callback| with it. If the icon is
+  // already being loaded, |callback| waits for that load instead.
+  void LoadGroupIcon(const CacheKey& key, const IconRequestCallback& callback);
+
+  void OnIconLoaded(CacheKey key,
+                    std::unique_ptr<gfx::Image> result,
+                    const IconLoader::IconGroup& group);
+
+  // A cached icon and its approximate size in bytes.
+  struct CachedIcon {
+    explicit CachedIcon(std::unique_ptr<gfx::Image> image);
+    ~CachedIcon();
+
+    std::unique_ptr<gfx::Image> image;
+    size_t byte_size;
+  };
+
+  // A pending LoadIcons() request.
+  struct IconBatch {
+    IconBatch();
+    ~IconBatch();
+
+    std::vector<base::FilePath> file_paths;
+    IconLoader::IconSize size;
+    IconBatchRequestCallback callback;
+
+    // The groups of |file_paths|, once they have been read.
+    std::vector<IconLoader::IconGroup> groups;
+
+    // The icon of each distinct group, and the number of them still loading.
+    std::map<IconLoader::IconGroup, gfx::Image> icons;
+    size_t pending_loads;
+  };
+
+  void OnBatchGroupsRead(int batch_id,
+                         const std::vector<IconLoader::IconGroup>& groups);
+  void OnBatchIconLoaded(int batch_id,
+                         IconLoader::IconGroup group,
+                         gfx::Image* image);
+
+  // Runs the callback of the batch, once all of its icons are loaded.
+  void FinishBatch(int batch_id);
+
+  // Adds |image| to the icon cache, replacing any previous icon for |key|.
+  void AddIcon(const CacheKey& key, std::unique_ptr<gfx::Image> image);
+  void RemoveIcon(const CacheKey& key);
+
+  // Drops the least recently used icons until the icon cache holds at most
+  // |max_bytes|.
+  void EvictIconsToSize(size_t max_bytes);
+
+  void OnMemoryPressure(
+      base::MemoryPressureListener::MemoryPressureLevel memory_pressure_level);
+
+  // The groups of recently looked up files, and the icons of recently used
+  // groups, most recently used first.
+  base::MRUCache<base::FilePath, IconLoader::IconGroup> group_cache_;
+  base::MRUCache<CacheKey, std::unique_ptr<CachedIcon>> icon_cache_;
+  size_t icon_cache_bytes_;
+
+  int cache_hit_count_;
+  int cache_miss_count_;
+
+  std::unique_ptr<base::MemoryPressureListener> memory_pressure_listener_;
+
+  PrefService* local_state_;
+
+  // The uses of each icon since the usage was last written to local state, by
+  // usage key, and the timer for the next write.
+  std::map<std::string, int> unwritten_usage_;
+  base::OneShotTimer usage_write_timer_;
+
+  // The icons still to be loaded after startup, most used first.
+  std::deque<CacheKey> warm_up_queue_;
+
+  // The callbacks waiting for each icon being loaded.
+  std::map<CacheKey, std::vector<IconRequestCallback>> pending_loads_;
+
+  std::map<int, std::unique_ptr<IconBatch>> batches_;
+  int next_batch_id_;
 
   base::WeakPtrFactory<IconManager> weak_factory_;
 
@@ -0,0 +1,400 @@
+// Copyright 2017 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chrome/browser/icon_manager.h"
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/bind.h"
+#include "base/macros.h"
+#include "base/memory/memory_pressure_listener.h"
+#include "base/memory/ptr_util.h"
+#include "base/run_loop.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/task/cancelable_task_tracker.h"
+#include "base/values.h"
+#include "build/build_config.h"
+#include "chrome/browser/after_startup_task_utils.h"
+#include "components/prefs/scoped_user_pref_update.h"
+#include "components/prefs/testing_pref_service.h"
+#include "content/public/test/test_browser_thread_bundle.h"
+#include "testing/gtest/include/gtest/gtest.h"
+#include "third_party/skia/include/core/SkBitmap.h"
+#include "ui/gfx/image/image.h"
+
+namespace {
+
+const IconLoader::IconGroup kGroupA = FILE_PATH_LITERAL("image/png");
+const IconLoader::IconGroup kGroupB = FILE_PATH_LITERAL("text/plain");
+const IconLoader::IconGroup kGroupC = FILE_PATH_LITERAL("application/pdf");
+const IconLoader::IconGroup kGroupD = FILE_PATH_LITERAL("audio/mpeg");
+
+// On Windows, executables are groups to themselves.
+#if defined(OS_WIN)
+const IconLoader::IconGroup kPerInstanceGroup =
+    FILE_PATH_LITERAL("C:\\Downloads\\setup.exe");
+#else
+const IconLoader::IconGroup kPerInstanceGroup =
+    FILE_PATH_LITERAL("/downloads/setup.exe");
+#endif
+
+const char kIconUsagePref[] = "icon_manager.usage";
+
+// A square icon |pixels| wide, which the IconManager accounts for as
+// 4 * |pixels| * |pixels| bytes.
+std::unique_ptr<gfx::Image> CreateIcon(int pixels) {
+  SkBitmap bitmap;
+  bitmap.allocN32Pixels(pixels, pixels);
+  bitmap.eraseColor(SK_ColorBLUE);
+  return base::MakeUnique<gfx::Image>(gfx::Image::CreateFrom1xBitmap(bitmap));
+}
+
+// An IconManager which doesn't ask the system for the groups of the files or
+// for their icons. Tests complete these requests themselves.
+class TestIconManager : public IconManager {
+ public:
+  explicit TestIconManager(PrefService* local_state)
+      : IconManager(local_state) {}
+  ~TestIconManager() override {}
+
+  // Completes the oldest group read still pending.
+  void FinishGroupRead(const std::vector<IconLoader::IconGroup>& groups) {
+    ASSERT_FALSE(group_reads_.empty());
+    IconLoader::GroupsReadCallback callback = group_reads_.front();
+    group_reads_.pop_front();
+    callback.Run(groups);
+  }
+
+  // Completes the load of the icon of |group| with an icon |pixels| wide.
+  void FinishIconLoad(const IconLoader::IconGroup& group, int pixels) {
+    auto it = icon_loads_.find(group);
+    ASSERT_NE(icon_loads_.end(), it);
+    IconLoader::IconLoadedCallback callback = it->second;
+    icon_loads_.erase(it);
+    callback.Run(CreateIcon(pixels), group);
+  }
+
+  size_t pending_group_reads() const { return group_reads_.size(); }
+
+  // The number of IconLoaders started for |group|.
+  int loader_count(const IconLoader::IconGroup& group) const {
+    auto it = loader_counts_.find(group);
+    return it == loader_counts_.end() ? 0 : it->second;
+  }
+
+ protected:
+  void ReadGroups(const std::vector<base::FilePath>& file_paths,
+                  const IconLoader::GroupsReadCallback& callback) override {
+    group_reads_.push_back(callback);
+  }
+
+  void StartIconLoader(
+      const IconLoader::IconGroup& group,
+      IconLoader::IconSize size,
+      const IconLoader::IconLoadedCallback& callback) override {
+    ++loader_counts_[group];
+    icon_loads_[group] = callback;
+  }
+
+ private:
+  std::deque<IconLoader::GroupsReadCallback> group_reads_;
+  std::map<IconLoader::IconGroup, IconLoader::IconLoadedCallback> icon_loads_;
+  std::map<IconLoader::IconGroup, int> loader_counts_;
+
+  DISALLOW_COPY_AND_ASSIGN(TestIconManager);
+};
+
+}  // namespace
+
+class IconManagerTest : public testing::Test {
+ public:
+  IconManagerTest() : icon_manager_(&local_state_) {
+    IconManager::RegisterPrefs(local_state_.registry());
+  }
+  ~IconManagerTest() override {}
+
+ protected:
+  // Loads the icon of |file_path|, which belongs to |group|, as an icon
+  // |pixels| wide.
+  void LoadIcon(const base::FilePath& file_path,
+                const IconLoader::IconGroup& group,
+                int pixels) {
+    icon_manager_.LoadIcon(file_path, IconLoader::SMALL,
+                           base::Bind(&IconManagerTest::OnIconLoaded,
+                                      base::Unretained(this)),
+                           &tracker_);
+    icon_manager_.FinishGroupRead(
+        std::vector<IconLoader::IconGroup>(1, group));
+    icon_manager_.FinishIconLoad(group, pixels);
+  }
+
+  bool IsCached(const base::FilePath& file_path) {
+    return icon_manager_.LookupIconFromFilepath(file_path, IconLoader::SMALL) !=
+           nullptr;
+  }
+
+  // Returns the usage count of small icons of |group| in local state.
+  int GetUsageCount(const IconLoader::IconGroup& group) {
+    int count = 0;
+    local_state_.GetDictionary(kIconUsagePref)
+        ->GetIntegerWithoutPathExpansion(
+            "0 " + base::FilePath(group).AsUTF8Unsafe(), &count);
+    return count;
+  }
+
+  void OnIconLoaded(gfx::Image* image) {
+    loaded_icons_.push_back(image ? *image : gfx::Image());
+  }
+
+  void OnIconsLoaded(const std::vector<gfx::Image>& images) {
+    ++batch_count_;
+    loaded_icons_.insert(loaded_icons_.end(), images.begin(), images.end());
+  }
+
+  content::TestBrowserThreadBundle thread_bundle_;
+  TestingPrefServiceSimple local_state_;
+  base::CancelableTaskTracker tracker_;
+  TestIconManager icon_manager_;
+  std::vector<gfx::Image> loaded_icons_;
+  int batch_count_ = 0;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(IconManagerTest);
+};
+
+// Tests that the least recently used icons are dropped once the icons don't fit
+// the byte budget of the cache.
+TEST_F(IconManagerTest, EvictsLeastRecentlyUsedIcons) {
+  const base::FilePath file_a(FILE_PATH_LITERAL("a.png"));
+  const base::FilePath file_b(FILE_PATH_LITERAL("b.txt"));
+  const base::FilePath file_c(FILE_PATH_LITERAL("c.pdf"));
+
+  // Two icons of 1MB each fill the 2MB budget.
+  LoadIcon(file_a, kGroupA, 512);
+  LoadIcon(file_b, kGroupB, 512);
+  EXPECT_EQ(2u * 1024 * 1024, icon_manager_.icon_cache_bytes());
+  ASSERT_EQ(2u, loaded_icons_.size());
+  EXPECT_EQ(512, loaded_icons_[0].Width());
+
+  // Looking up the first icon makes the second the least recently used, so the
+  // third icon takes its place.
+  EXPECT_TRUE(IsCached(file_a));
+  LoadIcon(file_c, kGroupC, 512);
+  EXPECT_EQ(2u * 1024 * 1024, icon_manager_.icon_cache_bytes());
+  EXPECT_TRUE(IsCached(file_a));
+  EXPECT_FALSE(IsCached(file_b));
+  EXPECT_TRUE(IsCached(file_c));
+
+  EXPECT_EQ(3, icon_manager_.cache_hit_count());
+  EXPECT_EQ(1, icon_manager_.cache_miss_count());
+
+  // An icon larger than the whole budget is returned but not cached.
+  const base::FilePath file_d(FILE_PATH_LITERAL("d.mp3"));
+  LoadIcon(file_d, kGroupD, 1024);
+  ASSERT_EQ(4u, loaded_icons_.size());
+  EXPECT_EQ(1024, loaded_icons_[3].Width());
+  EXPECT_FALSE(IsCached(file_d));
+  EXPECT_EQ(2u * 1024 * 1024, icon_manager_.icon_cache_bytes());
+}
+
+// Tests that moderate memory pressure keeps the most recently used half of the
+// icons, and critical memory pressure drops all of them.
+TEST_F(IconManagerTest, TrimsOnMemoryPressure) {
+  const base::FilePath file_a(FILE_PATH_LITERAL("a.png"));
+  const base::FilePath file_b(FILE_PATH_LITERAL("b.txt"));
+  const base::FilePath file_c(FILE_PATH_LITERAL("c.pdf"));
+  const base::FilePath file_d(FILE_PATH_LITERAL("d.mp3"));
+
+  // Four icons of 64KB each.
+  LoadIcon(file_a, kGroupA, 128);
+  LoadIcon(file_b, kGroupB, 128);
+  LoadIcon(file_c, kGroupC, 128);
+  LoadIcon(file_d, kGroupD, 128);
+  EXPECT_EQ(4u * 64 * 1024, icon_manager_.icon_cache_bytes());
+
+  base::MemoryPressureListener::NotifyMemoryPressure(
+      base::MemoryPressureListener::MEMORY_PRESSURE_LEVEL_MODERATE);
+  base::RunLoop().RunUntilIdle();
+  EXPECT_EQ(2u * 64 * 1024, icon_manager_.icon_cache_bytes());
+  EXPECT_FALSE(IsCached(file_a));
+  EXPECT_FALSE(IsCached(file_b));
+  EXPECT_TRUE(IsCached(file_c));
+  EXPECT_TRUE(IsCached(file_d));
+
+  base::MemoryPressureListener::NotifyMemoryPressure(
+      base::MemoryPressureListener::MEMORY_PRESSURE_LEVEL_CRITICAL);
+  base::RunLoop().RunUntilIdle();
+  EXPECT_EQ(0u, icon_manager_.icon_cache_bytes());
+  EXPECT_FALSE(IsCached(file_c));
+  EXPECT_FALSE(IsCached(file_d));
+}
+
+// Tests that a batch loads the icon of each distinct group once, doesn't load
+// icons which are already cached, and returns the icons in the order of the
+// files.
+TEST_F(IconManagerTest, LoadIconsLoadsEachGroupOnce) {
+  LoadIcon(base::FilePath(FILE_PATH_LITERAL("cached.pdf")), kGroupC, 48);
+  loaded_icons_.clear();
+
+  std::vector<base::FilePath> file_paths;
+  file_paths.push_back(base::FilePath(FILE_PATH_LITERAL("1.png")));
+  file_paths.push_back(base::FilePath(FILE_PATH_LITERAL("2.txt")));
+  file_paths.push_back(base::FilePath(FILE_PATH_LITERAL("3.png")));
+  file_paths.push_back(base::FilePath(FILE_PATH_LITERAL("4.pdf")));
+  file_paths.push_back(base::FilePath(FILE_PATH_LITERAL("5.txt")));
+  file_paths.push_back(base::FilePath(FILE_PATH_LITERAL("6.png")));
+  icon_manager_.LoadIcons(file_paths, IconLoader::SMALL,
+                          base::Bind(&IconManagerTest::OnIconsLoaded,
+                                     base::Unretained(this)),
+                          &tracker_);
+
+  // The groups of all the files are read at once.
+  EXPECT_EQ(1u, icon_manager_.pending_group_reads());
+  std::vector<IconLoader::IconGroup> groups;
+  groups.push_back(kGroupA);
+  groups.push_back(kGroupB);
+  groups.push_back(kGroupA);
+  groups.push_back(kGroupC);
+  groups.push_back(kGroupB);
+  groups.push_back(kGroupA);
+  icon_manager_.FinishGroupRead(groups);
+
+  EXPECT_EQ(1, icon_manager_.loader_count(kGroupA));
+  EXPECT_EQ(1, icon_manager_.loader_count(kGroupB));
+  EXPECT_EQ(1, icon_manager_.loader_count(kGroupC));
+
+  icon_manager_.FinishIconLoad(kGroupA, 16);
+  EXPECT_EQ(0, batch_count_);
+  icon_manager_.FinishIconLoad(kGroupB, 32);
+  EXPECT_EQ(1, batch_count_);
+
+  ASSERT_EQ(6u, loaded_icons_.size());
+  EXPECT_EQ(16, loaded_icons_[0].Width());
+  EXPECT_EQ(32, loaded_icons_[1].Width());
+  EXPECT_EQ(16, loaded_icons_[2].Width());
+  EXPECT_EQ(48, loaded_icons_[3].Width());
+  EXPECT_EQ(32, loaded_icons_[4].Width());
+  EXPECT_EQ(16, loaded_icons_[5].Width());
+
+  // Every file of the batch can now be looked up.
+  for (const base::FilePath& file_path : file_paths)
+    EXPECT_TRUE(IsCached(file_path));
+}
+
+// Tests that a LoadIcon() call for an icon which is already being loaded waits
+// for that load instead of starting another IconLoader.
+TEST_F(IconManagerTest, ConcurrentLoadsShareLoader) {
+  const base::FilePath file_a(FILE_PATH_LITERAL("a.txt"));
+  const base::FilePath file_b(FILE_PATH_LITERAL("b.txt"));
+  const IconManager::IconRequestCallback callback =
+      base::Bind(&IconManagerTest::OnIconLoaded, base::Unretained(this));
+  icon_manager_.LoadIcon(file_a, IconLoader::SMALL, callback, &tracker_);
+  icon_manager_.LoadIcon(file_b, IconLoader::SMALL, callback, &tracker_);
+  EXPECT_EQ(2u, icon_manager_.pending_group_reads());
+
+  icon_manager_.FinishGroupRead(std::vector<IconLoader::IconGroup>(1, kGroupB));
+  icon_manager_.FinishGroupRead(std::vector<IconLoader::IconGroup>(1, kGroupB));
+  EXPECT_EQ(1, icon_manager_.loader_count(kGroupB));
+  EXPECT_TRUE(loaded_icons_.empty());
+
+  icon_manager_.FinishIconLoad(kGroupB, 16);
+  ASSERT_EQ(2u, loaded_icons_.size());
+  EXPECT_EQ(16, loaded_icons_[0].Width());
+  EXPECT_EQ(16, loaded_icons_[1].Width());
+
+  // Once the load is done, the next request loads the icon again.
+  LoadIcon(file_a, kGroupB, 32);
+  EXPECT_EQ(2, icon_manager_.loader_count(kGroupB));
+  ASSERT_EQ(3u, loaded_icons_.size());
+  EXPECT_EQ(32, loaded_icons_[2].Width());
+}
+
+// Tests that the most used MIME types are loaded again after startup, and that
+// per-instance groups are not remembered.
+TEST_F(IconManagerTest, WarmsUpMostUsedIcons) {
+  LoadIcon(base::FilePath(FILE_PATH_LITERAL("a.txt")), kGroupB, 16);
+  LoadIcon(base::FilePath(FILE_PATH_LITERAL("b.txt")), kGroupB, 16);
+  LoadIcon(base::FilePath(FILE_PATH_LITERAL("c.png")), kGroupA, 16);
+  LoadIcon(base::FilePath(kPerInstanceGroup), kPerInstanceGroup, 16);
+  icon_manager_.WriteUsage();
+  EXPECT_EQ(2, GetUsageCount(kGroupB));
+  EXPECT_EQ(1, GetUsageCount(kGroupA));
+  EXPECT_EQ(0, GetUsageCount(kPerInstanceGroup));
+  EXPECT_EQ(2u, local_state_.GetDictionary(kIconUsagePref)->size());
+
+  AfterStartupTaskUtils::UnsafeResetForTesting();
+  TestIconManager icon_manager(&local_state_);
+  icon_manager.WarmUpCacheAfterStartup();
+  base::RunLoop().RunUntilIdle();
+  EXPECT_EQ(0, icon_manager.loader_count(kGroupB));
+
+  // The most used icon is loaded first, once startup is complete.
+  AfterStartupTaskUtils::SetBrowserStartupIsCompleteForTesting();
+  base::RunLoop().RunUntilIdle();
+  EXPECT_EQ(1, icon_manager.loader_count(kGroupB));
+  EXPECT_EQ(0, icon_manager.loader_count(kGroupA));
+  icon_manager.FinishIconLoad(kGroupB, 16);
+  EXPECT_EQ(0, icon_manager.loader_count(kPerInstanceGroup));
+
+  AfterStartupTaskUtils::UnsafeResetForTesting();
+}
+
+// Tests that a batch counts one use of each of its icons, however many of its
+// files share them.
+TEST_F(IconManagerTest, CountsBatchUsageOncePerIcon) {
+  std::vector<base::FilePath> file_paths;
+  file_paths.push_back(base::FilePath(FILE_PATH_LITERAL("1.txt")));
+  file_paths.push_back(base::FilePath(FILE_PATH_LITERAL("2.txt")));
+  file_paths.push_back(base::FilePath(FILE_PATH_LITERAL("3.png")));
+  icon_manager_.LoadIcons(file_paths, IconLoader::SMALL,
+                          base::Bind(&IconManagerTest::OnIconsLoaded,
+                                     base::Unretained(this)),
+                          &tracker_);
+  std::vector<IconLoader::IconGroup> groups;
+  groups.push_back(kGroupB);
+  groups.push_back(kGroupB);
+  groups.push_back(kGroupA);
+  icon_manager_.FinishGroupRead(groups);
+
+  // The usage is only written to local state later.
+  EXPECT_EQ(0, GetUsageCount(kGroupB));
+  icon_manager_.WriteUsage();
+  EXPECT_EQ(1, GetUsageCount(kGroupB));
+  EXPECT_EQ(1, GetUsageCount(kGroupA));
+}
+
+// Tests that a new icon is remembered even when the usage of many other icons
+// already is, and that the counts are halved once one of them gets large.
+TEST_F(IconManagerTest, AgesUsage) {
+  {
+    DictionaryPrefUpdate update(&local_state_, kIconUsagePref);
+    for (int i = 0; i < 64; ++i) {
+      update->SetIntegerWithoutPathExpansion(
+          "0 type/" + base::IntToString(i), 5);
+    }
+  }
+
+  LoadIcon(base::FilePath(FILE_PATH_LITERAL("a.png")), kGroupA, 16);
+  icon_manager_.WriteUsage();
+  EXPECT_EQ(64u, local_state_.GetDictionary(kIconUsagePref)->size());
+  EXPECT_EQ(1, GetUsageCount(kGroupA));
+
+  {
+    DictionaryPrefUpdate update(&local_state_, kIconUsagePref);
+    update->SetIntegerWithoutPathExpansion(
+        "0 " + base::FilePath(kGroupB).AsUTF8Unsafe(), 1000);
+  }
+  LoadIcon(base::FilePath(FILE_PATH_LITERAL("b.txt")), kGroupB, 16);
+  icon_manager_.WriteUsage();
+  EXPECT_EQ(501, GetUsageCount(kGroupB));
+  EXPECT_EQ(3, GetUsageCount(FILE_PATH_LITERAL("type/63")));
+
+  // The least used icon made room for the new one.
+  EXPECT_EQ(64u, local_state_.GetDictionary(kIconUsagePref)->size());
+  EXPECT_EQ(0, GetUsageCount(kGroupA));
+}
@@ -4,16 +4,31 @@
 
 #include "chrome/browser/image_decoder.h"
 
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <tuple>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "base/bind.h"
 #include "base/callback.h"
+#include "base/containers/mru_cache.h"
+#include "base/feature_list.h"
+#include "base/hash.h"
+#include "base/memory/ptr_util.h"
+#include "base/metrics/field_trial_params.h"
+#include "base/metrics/histogram_macros.h"
 #include "base/threading/thread_task_runner_handle.h"
+#include "base/time/time.h"
+#include "base/timer/timer.h"
 #include "build/build_config.h"
 #include "content/public/browser/browser_thread.h"
 #include "content/public/common/service_manager_connection.h"
 #include "ipc/ipc_channel.h"
-#include "services/image_decoder/public/cpp/decode.h"
+#include "services/image_decoder/public/interfaces/constants.mojom.h"
+#include "services/image_decoder/public/interfaces/image_decoder.mojom.h"
 #include "services/service_manager/public/cpp/connector.h"
 #include "third_party/skia/include/core/SkBitmap.h"
 #include "ui/gfx/geometry/size.h"
@@ -23,6 +38,23 @@ namespace {
 const int64_t kMaxImageSizeInBytes =
     static_cast<int64_t>(IPC::Channel::kMaximumMessageSize);
 
+// How long the connection to the decoder service is kept open after the last
+// decode has finished.
+const int kIdleConnectionTimeoutSeconds = 10;
+
+// The number of decodes sent to the service at once. The service decodes one
+// image at a time, so a couple are enough to keep it busy.
+const size_t kMaxPendingDecodes = 2;
+
+// Keeps the results of recent decodes in memory, keyed by a hash of the
+// encoded image and the decode options, so that decoding the same image again
+// is free. Identical decodes which are started at the same time are sent to
+// the service only once. The max_bytes parameter sets the size of the cache.
+const base::Feature kImageDecoderResultCacheFeature{
+    "ImageDecoderResultCache", base::FEATURE_DISABLED_BY_DEFAULT};
+const char kMaxCacheBytesParam[] = "max_bytes";
+const int kDefaultMaxCacheBytes = 2 * 1024 * 1024;
+
 // Note that this is always called on the thread which initiated the
 // corresponding image_decoder::Decode request.
 void OnDecodeImageDone(
@@ -55,28 +87,407 @@ void RunDecodeCallbackOnTaskRunner(
   task_runner->PostTask(FROM_HERE, base::Bind(callback, image));
 }
 
+// Keeps a connection to the image decoder service, so that decodes which
+// follow each other don't each have to connect to the service. The connection
+// is closed once it has been idle for a while, which lets the service's
+// process exit, and is reopened by the next decode. Only a few decodes are
+// sent to the service at a time, and the others wait here, where cancelled
+// decodes can still be dropped. Lives on the IO thread.
+class DecoderConnection {
+ public:
+  static DecoderConnection* GetInstance() {
+    DCHECK_CURRENTLY_ON(content::BrowserThread::IO);
+    static auto* connection = new DecoderConnection();
+    return connection;
+  }
+
+  // Decodes |image_data| for the ImageDecoder request with |request_id|.
+  void Decode(
+      int request_id,
+      std::vector<uint8_t> image_data,
+      image_decoder::mojom::ImageCodec codec,
+      bool shrink_to_fit,
+      const gfx::Size& desired_image_frame_size,
+      int64_t max_size_in_bytes,
+      const image_decoder::mojom::ImageDecoder::DecodeImageCallback& callback) {
+    DCHECK_CURRENTLY_ON(content::BrowserThread::IO);
+    if (max_cache_bytes_ == 0) {
+      QueueDecode(request_id, std::move(image_data), codec, shrink_to_fit,
+                  desired_image_frame_size, max_size_in_bytes, callback);
+      return;
+    }
+
+    DecodeKey key(base::Hash(image_data.data(), image_data.size()),
+                  image_data.size(), codec, shrink_to_fit,
+                  desired_image_frame_size.width(),
+                  desired_image_frame_size.height(), max_size_in_bytes);
+
+    // Entries keep the encoded image, so that a hash collision can't return
+    // the wrong image.
+    auto cached = results_.Get(key);
+    if (cached != results_.end() &&
+        cached->second->image_data == image_data) {
+      UMA_HISTOGRAM_BOOLEAN("ImageDecoder.ResultCacheHit", true);
+      callback.Run(cached->second->image);
+      return;
+    }
+
+    auto shared = shared_decodes_.find(key);
+    if (shared != shared_decodes_.end()) {
+      if (shared->second.image_data == image_data) {
+        UMA_HISTOGRAM_BOOLEAN("ImageDecoder.ResultCacheHit", true);
+        shared->second.callbacks[request_id] = callback;
+        shared_decode_keys_[request_id] = key;
+        return;
+      }
+
+      // Colliding images are decoded without the cache.
+      QueueDecode(request_id, std::move(image_data), codec, shrink_to_fit,
+                  desired_image_frame_size, max_size_in_bytes, callback);
+      return;
+    }
+
+    UMA_HISTOGRAM_BOOLEAN("ImageDecoder.ResultCacheHit", false);
+    SharedDecode& decode = shared_decodes_[key];
+    decode.image_data = image_data;
+    decode.queued_request_id = request_id;
+    decode.callbacks[request_id] = callback;
+    shared_decode_keys_[request_id] = key;
+    QueueDecode(request_id, std::move(image_data), codec, shrink_to_fit,
+                desired_image_frame_size, max_size_in_bytes,
+                base::Bind(&DecoderConnection::OnSharedDecodeDone,
+                           base::Unretained(this), key));
+  }
+
+  // Drops the decodes of the requests in |request_ids| which haven't been
+  // sent to the service yet. Decodes which other requests share are kept.
+  void Cancel(const std::vector<int>& request_ids) {
+    DCHECK_CURRENTLY_ON(content::BrowserThread::IO);
+    for (int request_id : request_ids) {
+      auto key = shared_decode_keys_.find(request_id);
+      if (key == shared_decode_keys_.end()) {
+        queued_decodes_.erase(request_id);
+        continue;
+      }
+
+      auto shared = shared_decodes_.find(key->second);
+      DCHECK(shared != shared_decodes_.end());
+      shared_decode_keys_.erase(key);
+      shared->second.callbacks.erase(request_id);
+      if (shared->second.callbacks.empty() &&
+          queued_decodes_.erase(shared->second.queued_request_id)) {
+        shared_decodes_.erase(shared);
+      }
+    }
+  }
+
+ private:
+  // The hash and size of the encoded image, then the decode options.
+  using DecodeKey = std::tuple<uint32_t,
+                               size_t,
+                               image_decoder::mojom::ImageCodec,
+                               bool,
+                               int,
+                               int,
+                               int64_t>;
+
+  // A decoded image, with the encoded image it came from.
+  struct CachedResult {
+    std::vector<uint8_t> image_data;
+    SkBitmap image;
+  };
+
+  // A decode which several requests are waiting for. It is queued under the
+  // id of the request which started it.
+  struct SharedDecode {
+    std::vector<uint8_t> image_data;
+    int queued_request_id;
+    std::map<int, image_decoder::mojom::ImageDecoder::DecodeImageCallback>
+        callbacks;
+  };
+
+  // A decode waiting to be sent to the service.
+  struct QueuedDecode {
+    std::vector<uint8_t> image_data;
+    image_decoder::mojom::ImageCodec codec;
+    bool shrink_to_fit;
+    gfx::Size desired_image_frame_size;
+    int64_t max_size_in_bytes;
+    image_decoder::mojom::ImageDecoder::DecodeImageCallback callback;
+  };
+
+  DecoderConnection()
+      : connection_ready_(false),
+        next_decode_id_(0),
+        results_(ResultCache::NO_AUTO_EVICT),
+        cache_bytes_(0),
+        max_cache_bytes_(0) {
+    if (base::FeatureList::IsEnabled(kImageDecoderResultCacheFeature)) {
+      max_cache_bytes_ = base::GetFieldTrialParamByFeatureAsInt(
+          kImageDecoderResultCacheFeature, kMaxCacheBytesParam,
+          kDefaultMaxCacheBytes);
+    }
+  }
+  ~DecoderConnection() = delete;
+
+  void QueueDecode(
+      int request_id,
+      std::vector<uint8_t> image_data,
+      image_decoder::mojom::ImageCodec codec,
+      bool shrink_to_fit,
+      const gfx::Size& desired_image_frame_size,
+      int64_t max_size_in_bytes,
+      const image_decoder::mojom::ImageDecoder::DecodeImageCallback& callback) {
+    QueuedDecode& decode = queued_decodes_[request_id];
+    decode.image_data = std::move(image_data);
+    decode.codec = codec;
+    decode.shrink_to_fit = shrink_to_fit;
+    decode.desired_image_frame_size = desired_image_frame_size;
+    decode.max_size_in_bytes = max_size_in_bytes;
+    decode.callback = callback;
+    SendQueuedDecodes();
+  }
+
+  // Sends the oldest queued decodes while there is room for them.
+  void SendQueuedDecodes() {
+    while (pending_decodes_.size() < kMaxPendingDecodes &&
+           !queued_decodes_.empty()) {
+      QueuedDecode decode = std::move(queued_decodes_.begin()->second);
+      queued_decodes_.erase(queued_decodes_.begin());
+      SendDecode(decode);
+    }
+  }
+
+  void SendDecode(const QueuedDecode& decode) {
+    if (!decoder_)
+      Connect();
+    idle_timer_.Stop();
+
+    int decode_id = next_decode_id_++;
+    pending_decodes_[decode_id] = decode.callback;
+    decoder_->DecodeImage(
+        decode.image_data, decode.codec, decode.shrink_to_fit,
+        decode.max_size_in_bytes, decode.desired_image_frame_size,
+        base::Bind(&DecoderConnection::OnDecodeImage, base::Unretained(this),
+                   decode_id, base::TimeTicks::Now(), !connection_ready_));
+  }
+
+  // Caches the result of a shared decode, and passes it to every caller.
+  void OnSharedDecodeDone(const DecodeKey& key, const SkBitmap& image) {
+    auto shared = shared_decodes_.find(key);
+    DCHECK(shared != shared_decodes_.end());
+    SharedDecode decode = std::move(shared->second);
+    shared_decodes_.erase(shared);
+
+    // The pixels are shared by the cache and every caller, so none of them
+    // may change them.
+    SkBitmap shared_image(image);
+    if (!shared_image.isNull() && !shared_image.empty()) {
+      shared_image.setImmutable();
+      AddToCache(key, std::move(decode.image_data), shared_image);
+    }
+    for (const auto& callback : decode.callbacks) {
+      shared_decode_keys_.erase(callback.first);
+      callback.second.Run(shared_image);
+    }
+  }
+
+  void AddToCache(const DecodeKey& key,
+                  std::vector<uint8_t> image_data,
+                  const SkBitmap& image) {
+    size_t byte_size = image.computeByteSize() + image_data.size();
+    if (byte_size > max_cache_bytes_)
+      return;
+
+    auto existing = results_.Peek(key);
+    if (existing != results_.end()) {
+      cache_bytes_ -= GetByteSize(*existing->second);
+      results_.Erase(existing);
+    }
+    while (cache_bytes_ + byte_size > max_cache_bytes_) {
+      auto oldest = results_.rbegin();
+      cache_bytes_ -= GetByteSize(*oldest->second);
+      results_.Erase(oldest);
+    }
+
+    std::unique_ptr<CachedResult> result(new CachedResult);
+    result->image_data = std::move(image_data);
+    result->image = image;
+    results_.Put(key, std::move(result));
+    cache_bytes_ += byte_size;
+  }
+
+  static size_t GetByteSize(const CachedResult& result) {
+    return result.image.computeByteSize() + result.image_data.size();
+  }
+
+  void Connect() {
+    service_manager::mojom::ConnectorRequest connector_request;
+    connector_ = service_manager::Connector::Create(&connector_request);
+    BindToBrowserConnector(std::move(connector_request));
+
+    connector_->BindInterface(image_decoder::mojom::kServiceName, &decoder_);
+    decoder_.set_connection_error_handler(base::Bind(
+        &DecoderConnection::OnConnectionError, base::Unretained(this)));
+    connection_ready_ = false;
+  }
+
+  void Disconnect() {
+    idle_timer_.Stop();
+    decoder_.reset();
+    connector_.reset();
+  }
+
+  void OnDecodeImage(int decode_id,
+                     base::TimeTicks start_time,
+                     bool waited_for_connection,
+                     const SkBitmap& image) {
+    // Decodes which were started before the service first answered include
+    // the time to connect to it, and usually to launch its process.
+    base::TimeDelta decode_time = base::TimeTicks::Now() - start_time;
+    if (waited_for_connection)
+      UMA_HISTOGRAM_TIMES("ImageDecoder.DecodeTime.FirstDecode", decode_time);
+    else
+      UMA_HISTOGRAM_TIMES("ImageDecoder.DecodeTime.SteadyState", decode_time);
+    connection_ready_ = true;
+
+    auto iter = pending_decodes_.find(decode_id);
+    DCHECK(iter != pending_decodes_.end());
+    image_decoder::mojom::ImageDecoder::DecodeImageCallback callback =
+        iter->second;
+    pending_decodes_.erase(iter);
+    callback.Run(image);
+
+    SendQueuedDecodes();
+    if (pending_decodes_.empty()) {
+      idle_timer_.Start(
+          FROM_HERE,
+          base::TimeDelta::FromSeconds(kIdleConnectionTimeoutSeconds),
+          base::Bind(&DecoderConnection::Disconnect, base::Unretained(this)));
+    }
+  }
+
+  // Fails every decode sent to the service, for instance when the service's
+  // process has crashed. Queued decodes are sent over a new connection.
+  void OnConnectionError() {
+    Disconnect();
+    std::map<int, image_decoder::mojom::ImageDecoder::DecodeImageCallback>
+        failed_decodes;
+    failed_decodes.swap(pending_decodes_);
+    for (const auto& decode : failed_decodes)
+      decode.second.Run(SkBitmap());
+    SendQueuedDecodes();
+  }
+
+  std::unique_ptr<service_manager::Connector> connector_;
+  image_decoder::mojom::ImageDecoderPtr decoder_;
+
+  // Whether |decoder_| has answered a decode yet.
+  bool connection_ready_;
+
+  // The decodes sent to the service, by decode id.
+  int next_decode_id_;
+  std::map<int, image_decoder::mojom::ImageDecoder::DecodeImageCallback>
+      pending_decodes_;
+
+  // The decodes waiting to be sent, by request id, and so oldest first.
+  std::map<int, QueuedDecode> queued_decodes_;
+
+  base::OneShotTimer idle_timer_;
+
+  // Recent results, most recently used first, and their total size. The cache
+  // is disabled when |max_cache_bytes_| is 0.
+  using ResultCache =
+      base::MRUCache<DecodeKey, std::unique_ptr<CachedResult>>;
+  ResultCache results_;
+  size_t cache_bytes_;
+  size_t max_cache_bytes_;
+
+  std::map<DecodeKey, SharedDecode> shared_decodes_;
+
+  // The shared decode each request is waiting for.
+  std::unordered_map<int, DecodeKey> shared_decode_keys_;
+
+  DISALLOW_COPY_AND_ASSIGN(DecoderConnection);
+};
+
+// An image waiting to be sent to the decoder service.
+struct PendingDecode {
+  PendingDecode(
+      int request_id,
+      std::vector<uint8_t> image_data,
+      const image_decoder::mojom::ImageDecoder::DecodeImageCallback& callback,
+      scoped_refptr<base::SequencedTaskRunner> callback_task_runner)
+      : request_id(request_id),
+        image_data(std::move(image_data)),
+        callback(callback),
+        callback_task_runner(std::move(callback_task_runner)) {}
+
+  int request_id;
+  std::vector<uint8_t> image_data;
+  image_decoder::mojom::ImageDecoder::DecodeImageCallback callback;
+  scoped_refptr<base::SequencedTaskRunner> callback_task_runner;
+};
+
+image_decoder::mojom::ImageCodec ToMojoImageCodec(
+    ImageDecoder::ImageCodec image_codec) {
+#if defined(OS_CHROMEOS)
+  if (image_codec == ImageDecoder::ROBUST_JPEG_CODEC)
+    return image_decoder::mojom::ImageCodec::ROBUST_JPEG;
+  if (image_codec == ImageDecoder::ROBUST_PNG_CODEC)
+    return image_decoder::mojom::ImageCodec::ROBUST_PNG;
+#endif  // defined(OS_CHROMEOS)
+  return image_decoder::mojom::ImageCodec::DEFAULT;
+}
+
 void DecodeImage(
+    int request_id,
     std::vector<uint8_t> image_data,
     image_decoder::mojom::ImageCodec codec,
     bool shrink_to_fit,
     const gfx::Size& desired_image_frame_size,
+    int64_t max_size_in_bytes,
     const image_decoder::mojom::ImageDecoder::DecodeImageCallback& callback,
     scoped_refptr<base::SequencedTaskRunner> callback_task_runner) {
-  DCHECK_CURRENTLY_ON(content::BrowserThread::IO);
+  DecoderConnection::GetInstance()->Decode(
+      request_id, std::move(image_data), codec, shrink_to_fit,
+      desired_image_frame_size,
+      max_size_in_bytes,
+      base::Bind(&RunDecodeCallbackOnTaskRunner, callback,
+                 callback_task_runner));
+}
 
-  service_manager::mojom::ConnectorRequest connector_request;
-  std::unique_ptr<service_manager::Connector> connector =
-      service_manager::Connector::Create(&connector_request);
-  BindToBrowserConnector(std::move(connector_request));
+// Hands all of |decodes| to the shared connection at once.
+void DecodeImageBatch(std::vector<std::unique_ptr<PendingDecode>> decodes,
+                      image_decoder::mojom::ImageCodec codec,
+                      bool shrink_to_fit,
+                      const gfx::Size& desired_image_frame_size,
+                      int64_t max_size_in_bytes) {
+  DecoderConnection* connection = DecoderConnection::GetInstance();
+  for (auto& decode : decodes) {
+    connection->Decode(decode->request_id, std::move(decode->image_data),
+                       codec, shrink_to_fit, desired_image_frame_size,
+                       max_size_in_bytes,
+                       base::Bind(&RunDecodeCallbackOnTaskRunner,
+                                  decode->callback,
+                                  decode->callback_task_runner));
+  }
+}
 
-  image_decoder::Decode(connector.get(), image_data, codec, shrink_to_fit,
-                        kMaxImageSizeInBytes, desired_image_frame_size,
-                        base::Bind(&RunDecodeCallbackOnTaskRunner, callback,
-                                   callback_task_runner));
+void CancelDecodes(const std::vector<int>& request_ids) {
+  DecoderConnection::GetInstance()->Cancel(request_ids);
 }
 
 }  // namespace
 
+ImageDecoder::BatchItem::BatchItem(ImageRequest* image_request,
+                                   std::vector<uint8_t> image_data)
+    : image_request(image_request), image_data(std::move(image_data)) {}
+
+ImageDecoder::BatchItem::BatchItem(BatchItem&& other) = default;
+
+ImageDecoder::BatchItem::~BatchItem() {}
+
 ImageDecoder::ImageRequest::ImageRequest()
     : task_runner_(base::ThreadTaskRunnerHandle::Get()) {
   DCHECK(sequence_checker_.CalledOnValidSequence());
@@ -119,9 +530,22 @@ void ImageDecoder::StartWithOptions(ImageRequest* image_request,
                                     ImageCodec image_codec,
                                     bool shrink_to_fit,
                                     const gfx::Size& desired_image_frame_size) {
+  StartWithOptions(image_request, std::move(image_data), image_codec,
+                   shrink_to_fit, desired_image_frame_size,
+                   kMaxImageSizeInBytes);
+}
+
+// static
+void ImageDecoder::StartWithOptions(ImageRequest* image_request,
+                                    std::vector<uint8_t> image_data,
+                                    ImageCodec image_codec,
+                                    bool shrink_to_fit,
+                                    const gfx::Size& desired_image_frame_size,
+                                    int64_t max_size_in_bytes) {
   ImageDecoder::GetInstance()->StartWithOptionsImpl(
       image_request, std::move(image_data), image_codec, shrink_to_fit,
-      desired_image_frame_size);
+      desired_image_frame_size,
+      std::min(max_size_in_bytes, kMaxImageSizeInBytes));
 }
 
 // static
@@ -134,38 +558,34 @@ void ImageDecoder::StartWithOptions(ImageRequest* image_request,
                    image_codec, shrink_to_fit, gfx::Size());
 }
 
-ImageDecoder::ImageDecoder() : image_request_id_counter_(0) {}
+// static
+void ImageDecoder::StartBatch(std::vector<BatchItem> items,
+                              ImageCodec image_codec,
+                              bool shrink_to_fit,
+                              const gfx::Size& desired_image_frame_size) {
+  ImageDecoder::GetInstance()->StartBatchImpl(
+      std::move(items), image_codec, shrink_to_fit, desired_image_frame_size);
+}
+
+ImageDecoder::RequestShard::RequestShard() {}
+
+ImageDecoder::RequestShard::~RequestShard() {}
+
+ImageDecoder::ImageDecoder() {}
 
 void ImageDecoder::StartWithOptionsImpl(
     ImageRequest* image_request,
     std::vector<uint8_t> image_data,
     ImageCodec image_codec,
     bool shrink_to_fit,
-    const gfx::Size& desired_image_frame_size) {
+    const gfx::Size& desired_image_frame_size,
+    int64_t max_size_in_bytes) {
   DCHECK(image_request);
   DCHECK(image_request->task_runner());
 
-  int request_id;
-  {
-    base::AutoLock lock(map_lock_);
-    request_id = image_request_id_counter_++;
-    image_request_id_map_.insert(std::make_pair(request_id, image_request));
-  }
-
-  image_decoder::mojom::ImageCodec codec =
-      image_decoder::mojom::ImageCodec::DEFAULT;
-#if defined(OS_CHROMEOS)
-  if (image_codec == ROBUST_JPEG_CODEC)
-    codec = image_decoder::mojom::ImageCodec::ROBUST_JPEG;
-  if (image_codec == ROBUST_PNG_CODEC)
-    codec = image_decoder::mojom::ImageCodec::ROBUST_PNG;
-#endif  // defined(OS_CHROMEOS)
-
-  auto callback = base::Bind(
-      &OnDecodeImageDone,
-      base::Bind(&ImageDecoder::OnDecodeImageFailed, base::Unretained(this)),
-      base::Bind(&ImageDecoder::OnDecodeImageSucceeded, base::Unretained(this)),
-      request_id);
+  int request_id = AddRequest(image_request);
+  image_decoder::mojom::ImageCodec codec = ToMojoImageCodec(image_codec);
+  auto callback = CreateDecodeCallback(request_id);
 
   // NOTE: There exist ImageDecoder consumers which implicitly rely on this
   // operation happening on a thread which always has a ThreadTaskRunnerHandle.
@@ -173,9 +593,78 @@ void ImageDecoder::StartWithOptionsImpl(
   // implementation.
   content::BrowserThread::PostTask(
       content::BrowserThread::IO, FROM_HERE,
-      base::Bind(&DecodeImage, base::Passed(&image_data), codec, shrink_to_fit,
-                 desired_image_frame_size, callback,
-                 make_scoped_refptr(image_request->task_runner())));
+      base::Bind(&DecodeImage, request_id, base::Passed(&image_data), codec,
+                 shrink_to_fit, desired_image_frame_size, max_size_in_bytes,
+                 callback, make_scoped_refptr(image_request->task_runner())));
+}
+
+void ImageDecoder::StartBatchImpl(std::vector<BatchItem> items,
+                                  ImageCodec image_codec,
+                                  bool shrink_to_fit,
+                                  const gfx::Size& desired_image_frame_size) {
+  std::vector<std::unique_ptr<PendingDecode>> decodes;
+  for (BatchItem& item : items) {
+    DCHECK(item.image_request);
+    DCHECK(item.image_request->task_runner());
+    int request_id = AddRequest(item.image_request);
+    decodes.push_back(base::MakeUnique<PendingDecode>(
+        request_id, std::move(item.image_data),
+        CreateDecodeCallback(request_id),
+        make_scoped_refptr(item.image_request->task_runner())));
+  }
+
+  // The whole batch takes a single trip to the IO thread.
+  content::BrowserThread::PostTask(
+      content::BrowserThread::IO, FROM_HERE,
+      base::Bind(&DecodeImageBatch, base::Passed(&decodes),
+                 ToMojoImageCodec(image_codec), shrink_to_fit,
+                 desired_image_frame_size, kMaxImageSizeInBytes));
+}
+
+int ImageDecoder::AddRequest(ImageRequest* image_request) {
+  // The id encodes the shard of the request, so that the request can be found
+  // from its id.
+  size_t shard_index = GetShardIndex(image_request);
+  int request_id = static_cast<int>(
+      request_id_sequence_.GetNext() * kNumRequestShards + shard_index);
+
+  RequestShard& shard = shards_[shard_index];
+  base::AutoLock lock(shard.lock);
+  shard.requests[request_id] = image_request;
+  shard.request_ids[image_request].push_back(request_id);
+  return request_id;
+}
+
+ImageDecoder::ImageRequest* ImageDecoder::TakeRequest(int request_id) {
+  RequestShard& shard = shards_[request_id % kNumRequestShards];
+  base::AutoLock lock(shard.lock);
+  auto it = shard.requests.find(request_id);
+  if (it == shard.requests.end())
+    return nullptr;
+  ImageRequest* image_request = it->second;
+  shard.requests.erase(it);
+
+  auto ids = shard.request_ids.find(image_request);
+  DCHECK(ids != shard.request_ids.end());
+  ids->second.erase(
+      std::find(ids->second.begin(), ids->second.end(), request_id));
+  if (ids->second.empty())
+    shard.request_ids.erase(ids);
+  return image_request;
+}
+
+// static
+size_t ImageDecoder::GetShardIndex(const ImageRequest* image_request) {
+  return base::Hash(&image_request, sizeof(image_request)) % kNumRequestShards;
+}
+
+base::Callback<void(const SkBitmap&)> ImageDecoder::CreateDecodeCallback(
+    int request_id) {
+  return base::Bind(
+      &OnDecodeImageDone,
+      base::Bind(&ImageDecoder::OnDecodeImageFailed, base::Unretained(this)),
+      base::Bind(&ImageDecoder::OnDecodeImageSucceeded, base::Unretained(this)),
+      request_id);
 }
 
 // static
@@ -185,44 +674,40 @@ void ImageDecoder::Cancel(ImageRequest* image_request) {
 }
 
 void ImageDecoder::CancelImpl(ImageRequest* image_request) {
-  base::AutoLock lock(map_lock_);
-  for (auto it = image_request_id_map_.begin();
-       it != image_request_id_map_.end();) {
-    if (it->second == image_request) {
-      image_request_id_map_.erase(it++);
-    } else {
-      ++it;
-    }
+  std::vector<int> request_ids;
+  {
+    RequestShard& shard = shards_[GetShardIndex(image_request)];
+    base::AutoLock lock(shard.lock);
+    auto ids = shard.request_ids.find(image_request);
+    if (ids == shard.request_ids.end())
+      return;
+    request_ids.swap(ids->second);
+    shard.request_ids.erase(ids);
+    for (int request_id : request_ids)
+      shard.requests.erase(request_id);
   }
+
+  // Decodes which haven't reached the service yet are dropped.
+  content::BrowserThread::PostTask(
+      content::BrowserThread::IO, FROM_HERE,
+      base::Bind(&CancelDecodes, request_ids));
 }
 
 void ImageDecoder::OnDecodeImageSucceeded(
     const SkBitmap& decoded_image,
     int request_id) {
-  ImageRequest* image_request;
-  {
-    base::AutoLock lock(map_lock_);
-    auto it = image_request_id_map_.find(request_id);
-    if (it == image_request_id_map_.end())
-      return;
-    image_request = it->second;
-    image_request_id_map_.erase(it);
-  }
+  ImageRequest* image_request = TakeRequest(request_id);
+  if (!image_request)
+    return;
 
   DCHECK(image_request->task_runner()->RunsTasksOnCurrentThread());
   image_request->OnImageDecoded(decoded_image);
 }
 
 void ImageDecoder::OnDecodeImageFailed(int request_id) {
-  ImageRequest* image_request;
-  {
-    base::AutoLock lock(map_lock_);
-    auto it = image_request_id_map_.find(request_id);
-    if (it == image_request_id_map_.end())
-      return;
-    image_request = it->second;
-    image_request_id_map_.erase(it);
-  }
+  ImageRequest* image_request = TakeRequest(request_id);
+  if (!image_request)
+    return;
 
   DCHECK(image_request->task_runner()->RunsTasksOnCurrentThread());
   image_request->OnDecodeImageFailed();
@@ -5,10 +5,15 @@
 #ifndef CHROME_BROWSER_IMAGE_DECODER_H_
 #define CHROME_BROWSER_IMAGE_DECODER_H_
 
-#include <map>
+#include <stddef.h>
+#include <stdint.h>
+
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "base/atomic_sequence_num.h"
+#include "base/callback_forward.h"
 #include "base/macros.h"
 #include "base/memory/ref_counted.h"
 #include "base/sequence_checker.h"
@@ -38,7 +43,8 @@ class ImageDecoder {
   // SequencedTaskRunner.
   class ImageRequest {
    public:
-    // Called when image is decoded.
+    // Called when image is decoded. The pixels of |decoded_image| may be
+    // shared with other requests, and are immutable when they are.
     virtual void OnImageDecoded(const SkBitmap& decoded_image) = 0;
 
     // Called when decoding image failed. ImageRequest can do some cleanup in
@@ -75,6 +81,16 @@ class ImageDecoder {
 #endif  // defined(OS_CHROMEOS)
   };
 
+  // An image to decode as part of a batch, and the request to notify.
+  struct BatchItem {
+    BatchItem(ImageRequest* image_request, std::vector<uint8_t> image_data);
+    BatchItem(BatchItem&& other);
+    ~BatchItem();
+
+    ImageRequest* image_request;
+    std::vector<uint8_t> image_data;
+  };
+
   static ImageDecoder* GetInstance();
 
   // Calls StartWithOptions() with ImageCodec::DEFAULT_CODEC and
@@ -97,18 +113,51 @@ class ImageDecoder {
                                ImageCodec image_codec,
                                bool shrink_to_fit,
                                const gfx::Size& desired_image_frame_size);
+  // Same as above, but if |shrink_to_fit| is true the decoded image is shrunk
+  // until it takes at most |max_size_in_bytes|, instead of the largest size
+  // which can be sent over IPC.
+  static void StartWithOptions(ImageRequest* image_request,
+                               std::vector<uint8_t> image_data,
+                               ImageCodec image_codec,
+                               bool shrink_to_fit,
+                               const gfx::Size& desired_image_frame_size,
+                               int64_t max_size_in_bytes);
   // Deprecated. Use std::vector<uint8_t> version to avoid an extra copy.
   static void StartWithOptions(ImageRequest* image_request,
                                const std::string& image_data,
                                ImageCodec image_codec,
                                bool shrink_to_fit);
 
-  // Removes all instances of |image_request| from |image_request_id_map_|,
+  // Starts decoding several images with the same options, which is cheaper
+  // than starting them one by one. Each request is notified on its own
+  // |task_runner_| as its image is decoded, and can be cancelled on its own.
+  static void StartBatch(std::vector<BatchItem> items,
+                         ImageCodec image_codec,
+                         bool shrink_to_fit,
+                         const gfx::Size& desired_image_frame_size);
+
+  // Removes all instances of |image_request| from the pending requests,
   // ensuring callbacks are not made to the image_request after it is destroyed.
+  // Its images are not decoded if they haven't reached the service yet.
   static void Cancel(ImageRequest* image_request);
 
  private:
-  using RequestMap = std::map<int, ImageRequest*>;
+  // The pending requests are spread over shards by their address, each with
+  // its own lock, so that requests on different threads rarely contend.
+  static const size_t kNumRequestShards = 8;
+
+  struct RequestShard {
+    RequestShard();
+    ~RequestShard();
+
+    // Protects |requests| and |request_ids|.
+    base::Lock lock;
+
+    // Map of request id's to ImageRequests, and of ImageRequests to their
+    // request id's.
+    std::unordered_map<int, ImageRequest*> requests;
+    std::unordered_map<ImageRequest*, std::vector<int>> request_ids;
+  };
 
   ImageDecoder();
   ~ImageDecoder() = delete;
@@ -117,7 +166,26 @@ class ImageDecoder {
                             std::vector<uint8_t> image_data,
                             ImageCodec image_codec,
                             bool shrink_to_fit,
-                            const gfx::Size& desired_image_frame_size);
+                            const gfx::Size& desired_image_frame_size,
+                            int64_t max_size_in_bytes);
+
+  void StartBatchImpl(std::vector<BatchItem> items,
+                      ImageCodec image_codec,
+                      bool shrink_to_fit,
+                      const gfx::Size& desired_image_frame_size);
+
+  // Adds |image_request| to the pending requests and returns its id.
+  int AddRequest(ImageRequest* image_request);
+
+  // Removes the request with |request_id| from the pending requests and
+  // returns it, or returns nullptr if it was cancelled.
+  ImageRequest* TakeRequest(int request_id);
+
+  static size_t GetShardIndex(const ImageRequest* image_request);
+
+  // Returns the callback which notifies the request with |request_id| once
+  // its image has been decoded.
+  base::Callback<void(const SkBitmap&)> CreateDecodeCallback(int request_id);
 
   void CancelImpl(ImageRequest* image_request);
 
@@ -125,14 +193,10 @@ class ImageDecoder {
   void OnDecodeImageSucceeded(const SkBitmap& decoded_image, int request_id);
   void OnDecodeImageFailed(int request_id);
 
-  // id to use for the next Start() request that comes in.
-  int image_request_id_counter_;
-
-  // Map of request id's to ImageRequests.
-  RequestMap image_request_id_map_;
+  // Generates the ids of new requests.
+  base::AtomicSequenceNumber request_id_sequence_;
 
-  // Protects |image_request_id_map_| and |image_request_id_counter_|.
-  base::Lock map_lock_;
+  RequestShard shards_[kNumRequestShards];
 
   DISALLOW_COPY_AND_ASSIGN(ImageDecoder);
 };
@@ -4,7 +4,15 @@
 
 #include "chrome/browser/image_decoder.h"
 
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "base/barrier_closure.h"
 #include "base/macros.h"
+#include "base/memory/ptr_util.h"
+#include "base/test/histogram_tester.h"
+#include "base/test/scoped_feature_list.h"
 #include "build/build_config.h"
 #include "chrome/grit/generated_resources.h"
 #include "chrome/test/base/in_process_browser_test.h"
@@ -13,6 +21,7 @@
 #include "content/public/browser/child_process_data.h"
 #include "content/public/test/test_utils.h"
 #include "ui/base/l10n/l10n_util.h"
+#include "ui/gfx/geometry/size.h"
 
 using content::BrowserThread;
 
@@ -279,3 +288,130 @@ IN_PROC_BROWSER_TEST_F(ImageDecoderBrowserTest, StartAndKillProcess) {
   }
   // Else the IO thread won the race and the image got decoded. Oh well.
 }
+
+// The decoder reconnects to the service after its process has been killed.
+IN_PROC_BROWSER_TEST_F(ImageDecoderBrowserTest, DecodeAfterKillProcess) {
+  bool decode_succeeded;
+  {
+    KillProcessObserver observer;
+    scoped_refptr<content::MessageLoopRunner> runner =
+        new content::MessageLoopRunner;
+    TestImageRequest test_request(runner->QuitClosure());
+    ImageDecoder::Start(&test_request, GetValidPngData());
+    runner->Run();
+    decode_succeeded = test_request.decode_succeeded();
+  }
+
+  // As above, the process may have been killed after the image was decoded,
+  // in which case the next decode races with noticing the crash.
+  if (decode_succeeded)
+    return;
+
+  scoped_refptr<content::MessageLoopRunner> runner =
+      new content::MessageLoopRunner;
+  TestImageRequest test_request(runner->QuitClosure());
+  ImageDecoder::Start(&test_request, GetValidPngData());
+  runner->Run();
+  EXPECT_TRUE(test_request.decode_succeeded());
+}
+
+// Decodes which follow each other share the connection to the service.
+IN_PROC_BROWSER_TEST_F(ImageDecoderBrowserTest, SequentialDecodes) {
+  for (int i = 0; i < 3; ++i) {
+    scoped_refptr<content::MessageLoopRunner> runner =
+        new content::MessageLoopRunner;
+    TestImageRequest test_request(runner->QuitClosure());
+    ImageDecoder::Start(&test_request, GetValidPngData());
+    runner->Run();
+    EXPECT_TRUE(test_request.decode_succeeded());
+  }
+}
+
+IN_PROC_BROWSER_TEST_F(ImageDecoderBrowserTest, StartBatch) {
+  scoped_refptr<content::MessageLoopRunner> runner =
+      new content::MessageLoopRunner;
+  base::Closure quit_closure = base::BarrierClosure(3, runner->QuitClosure());
+  TestImageRequest valid_request(quit_closure);
+  TestImageRequest invalid_request(quit_closure);
+  std::unique_ptr<TestImageRequest> cancelled_request(
+      new TestImageRequest(quit_closure));
+
+  std::vector<ImageDecoder::BatchItem> items;
+  items.emplace_back(&valid_request, GetValidPngData());
+  items.emplace_back(&invalid_request, std::vector<uint8_t>());
+  items.emplace_back(cancelled_request.get(), GetValidPngData());
+  ImageDecoder::StartBatch(std::move(items), ImageDecoder::DEFAULT_CODEC,
+                           /*shrink_to_fit=*/false,
+                           /*desired_image_frame_size=*/gfx::Size());
+
+  // Destroying a request cancels its decode without affecting the others.
+  cancelled_request.reset();
+  runner->Run();
+  EXPECT_TRUE(valid_request.decode_succeeded());
+  EXPECT_FALSE(invalid_request.decode_succeeded());
+}
+
+class ImageDecoderResultCacheBrowserTest : public ImageDecoderBrowserTest {
+ public:
+  ImageDecoderResultCacheBrowserTest() {
+    feature_list_.InitFromCommandLine("ImageDecoderResultCache",
+                                      std::string());
+  }
+
+ private:
+  base::test::ScopedFeatureList feature_list_;
+
+  DISALLOW_COPY_AND_ASSIGN(ImageDecoderResultCacheBrowserTest);
+};
+
+IN_PROC_BROWSER_TEST_F(ImageDecoderResultCacheBrowserTest,
+                       IdenticalDecodesAreShared) {
+  base::HistogramTester histograms;
+
+  // Concurrent decodes of the same image are decoded once.
+  {
+    scoped_refptr<content::MessageLoopRunner> runner =
+        new content::MessageLoopRunner;
+    base::Closure quit_closure = base::BarrierClosure(2, runner->QuitClosure());
+    TestImageRequest first_request(quit_closure);
+    TestImageRequest second_request(quit_closure);
+    ImageDecoder::Start(&first_request, GetValidPngData());
+    ImageDecoder::Start(&second_request, GetValidPngData());
+    runner->Run();
+    EXPECT_TRUE(first_request.decode_succeeded());
+    EXPECT_TRUE(second_request.decode_succeeded());
+  }
+
+  // Later decodes of the image come from the cache.
+  scoped_refptr<content::MessageLoopRunner> runner =
+      new content::MessageLoopRunner;
+  TestImageRequest test_request(runner->QuitClosure());
+  ImageDecoder::Start(&test_request, GetValidPngData());
+  runner->Run();
+  EXPECT_TRUE(test_request.decode_succeeded());
+
+  histograms.ExpectBucketCount("ImageDecoder.ResultCacheHit", true, 2);
+}
+
+// Cancelled requests don't hold up the decodes queued behind them.
+IN_PROC_BROWSER_TEST_F(ImageDecoderBrowserTest, CancelQueuedDecodes) {
+  const int kNumRequests = 10;
+  scoped_refptr<content::MessageLoopRunner> runner =
+      new content::MessageLoopRunner;
+  base::Closure quit_closure =
+      base::BarrierClosure(kNumRequests, runner->QuitClosure());
+  std::vector<std::unique_ptr<TestImageRequest>> requests;
+  std::vector<ImageDecoder::BatchItem> items;
+  for (int i = 0; i < kNumRequests; ++i) {
+    requests.push_back(base::MakeUnique<TestImageRequest>(quit_closure));
+    items.emplace_back(requests.back().get(), GetValidPngData());
+  }
+  ImageDecoder::StartBatch(std::move(items), ImageDecoder::DEFAULT_CODEC,
+                           /*shrink_to_fit=*/false,
+                           /*desired_image_frame_size=*/gfx::Size());
+
+  for (int i = 0; i < kNumRequests - 1; ++i)
+    requests[i].reset();
+  runner->Run();
+  EXPECT_TRUE(requests.back()->decode_succeeded());
+}